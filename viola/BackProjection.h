@@ -0,0 +1,122 @@
+#pragma once
+
+#include <vector>
+
+#include "project_config.h"
+
+IGNORE_WARNINGS_PUSH
+
+#include <mrpt/otherlibs/do_opencv_includes.h>
+
+IGNORE_WARNINGS_POP
+
+#include "ColorModel.h"
+#include "EllipseFunctions.h"
+
+// Colour likelihood by histogram back-projection
+// @article{swain1991color,
+//   title={Color indexing},
+//   author={Swain, Michael J and Ballard, Dana H},
+//   journal={International Journal of Computer Vision},
+//   year={1991}
+// }
+//
+// The ratio histogram min(model / frame, 1) of a target is back-projected once per frame over the region its
+// particles cover. The colour score of a particle is then the ellipse weighted mean of that map, read from
+// per-row prefix sums along the precomputed EllipseSpans of its depth, instead of a histogram per particle.
+
+// unweighted colour histogram (layout of compute_color_model2) of a colour bin image
+cv::Mat compute_color_histogram_from_bins(const cv::Mat &bins)
+{
+    cv::Mat histogram = cv::Mat::zeros(32, 32, CV_32FC1);
+    float *histogram_data = histogram.ptr<float>(0);
+    for (int i = 0; i < bins.rows; i++) {
+        const cv::Vec<ushort, 2> *bins_row = bins.ptr<cv::Vec<ushort, 2>>(i);
+        for (int j = 0; j < bins.cols; j++) {
+            histogram_data[bins_row[j][0]]++;
+            histogram_data[bins_row[j][1]]++;
+        }
+    }
+    histogram /= 2.0 * bins.rows * bins.cols;
+    return histogram;
+}
+
+cv::Mat compute_ratio_histogram(const cv::Mat &model, const cv::Mat &frame_histogram)
+{
+    cv::Mat ratio(model.rows, model.cols, CV_32FC1);
+    const float *model_data = model.ptr<float>(0);
+    const float *frame_data = frame_histogram.ptr<float>(0);
+    float *ratio_data = ratio.ptr<float>(0);
+    const int bins = model.rows * model.cols;
+    for (int b = 0; b < bins; b++) {
+        ratio_data[b] = frame_data[b] > 0 ? std::min(model_data[b] / frame_data[b], 1.f) : 0;
+    }
+    return ratio;
+}
+
+class ColorBackProjection
+{
+public:
+    // back-projects the ratio histogram over region (clamped to the frame); the score of a pixel is the mean
+    // of the ratios of its H-S and V bins.
+    void compute(const cv::Mat &hsv, const cv::Rect &region, const cv::Mat &ratio_histogram)
+    {
+        const cv::Rect frame_region(0, 0, hsv.cols, hsv.rows);
+        map_region = region & frame_region;
+        row_prefix.create(std::max(map_region.height, 1), map_region.width + 1, CV_32FC1);
+        const float *ratio_data = ratio_histogram.ptr<float>(0);
+
+        auto compute_row = [&](const int i) {
+            const cv::Vec3b *hsv_row = hsv.ptr<cv::Vec3b>(map_region.y + i) + map_region.x;
+            float *prefix_row = row_prefix.ptr<float>(i);
+            float sum = 0;
+            prefix_row[0] = 0;
+            for (int j = 0; j < map_region.width; j++) {
+                const cv::Vec<ushort, 2> bins = color_bin_indices(hsv_row[j]);
+                sum += 0.5f * (ratio_data[bins[0]] + ratio_data[bins[1]]);
+                prefix_row[j + 1] = sum;
+            }
+        };
+
+#ifdef USE_INTEL_TBB
+        tbb::parallel_for(tbb::blocked_range<int>(0, map_region.height, std::max(1, map_region.height / TBB_PARTITIONS)),
+            [&](const tbb::blocked_range<int> &r) {
+                for (int i = r.begin(); i < r.end(); i++) {
+                    compute_row(i);
+                }
+            }
+        );
+#else
+        for (int i = 0; i < map_region.height; i++) {
+            compute_row(i);
+        }
+#endif
+    };
+
+    // weighted mean score in [0, 1] of the ellipse whose mask has its top-left corner at roi_origin; the mask
+    // must lie inside the back-projected region.
+    inline float score(const cv::Point &roi_origin, const EllipseSpans &spans) const
+    {
+        const int x = roi_origin.x - map_region.x;
+        const int y = roi_origin.y - map_region.y;
+        float sum = 0;
+        for (int k = 0; k < spans.rings; k++) {
+            const int *begin = spans.begin.data() + k * spans.rows;
+            const int *end = spans.end.data() + k * spans.rows;
+            for (int i = 0; i < spans.rows; i++) {
+                const float *prefix_row = row_prefix.ptr<float>(y + i) + x;
+                sum += prefix_row[end[i]] - prefix_row[begin[i]];
+            }
+        }
+        return spans.total_weight > 0 ? sum / (spans.rings * spans.total_weight) : 0;
+    };
+
+    inline const cv::Rect &get_region() const
+    {
+        return map_region;
+    };
+
+protected:
+    cv::Rect map_region;
+    cv::Mat row_prefix;
+};
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Fixed capacity lock-free multi-producer multi-consumer queue (D. Vyukov's bounded MPMC queue). Every cell carries
+// a sequence number telling whether it is ready for the producer or the consumer of the current lap, so a push or
+// pop is one CAS on the shared position plus one release store. try_push and try_pop never block: a full or empty
+// queue is reported and the caller decides whether to drop, retry or wait.
+template<typename T>
+class BoundedQueue
+{
+public:
+    // capacity: a power of two
+    explicit BoundedQueue(const size_t capacity) :
+        cells(capacity), mask(capacity - 1), enqueue_position(0), dequeue_position(0)
+    {
+        assert(capacity >= 2 && (capacity & (capacity - 1)) == 0);
+        for (size_t i = 0; i < capacity; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    };
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    bool try_push(const T &value)
+    {
+        Cell *cell;
+        size_t position = enqueue_position.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[position & mask];
+            const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const intptr_t difference = intptr_t(sequence) - intptr_t(position);
+            if (difference == 0) {
+                if (enqueue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = enqueue_position.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = value;
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    };
+
+    bool try_pop(T &value)
+    {
+        Cell *cell;
+        size_t position = dequeue_position.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[position & mask];
+            const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const intptr_t difference = intptr_t(sequence) - intptr_t(position + 1);
+            if (difference == 0) {
+                if (dequeue_position.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = dequeue_position.load(std::memory_order_relaxed);
+            }
+        }
+        value = cell->value;
+        cell->sequence.store(position + mask + 1, std::memory_order_release);
+        return true;
+    };
+
+    // approximate while other threads push or pop
+    size_t size() const
+    {
+        const size_t pushed = enqueue_position.load(std::memory_order_relaxed);
+        const size_t popped = dequeue_position.load(std::memory_order_relaxed);
+        return pushed > popped ? pushed - popped : 0;
+    };
+
+    size_t capacity() const
+    {
+        return mask + 1;
+    };
+
+protected:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    // producers and consumers on their own cache lines
+    std::vector<Cell> cells;
+    const size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_position;
+    alignas(64) std::atomic<size_t> dequeue_position;
+};
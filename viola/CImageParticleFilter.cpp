@@ -1,10 +1,11 @@
 #pragma once
 
+#include <algorithm>
 #include <cmath>
 #include <limits>
 
 template<typename DEPTH_TYPE>
-CImageParticleFilter<DEPTH_TYPE>::CImageParticleFilter(EllipseStash *ellipses, const ImageRegistration * const reg, const normal_dist * const normal_distribution, const int ID) :
+CImageParticleFilter<DEPTH_TYPE>::CImageParticleFilter(EllipseStash *ellipses, const ImageRegistration * const reg, const DepthLikelihood * const depth_likelihood, const int ID) :
     hist_chest_color_score(0,1,1000),
     hist_head_color_score(0,1,1000),
     hist_head_fitting_score(0,1,1000),
@@ -12,11 +13,13 @@ CImageParticleFilter<DEPTH_TYPE>::CImageParticleFilter(EllipseStash *ellipses, c
     hist_score(0,1,1000),
     ellipses(ellipses),
     registration(reg),
-    depth_normal_distribution(normal_distribution)
+    depth_likelihood(depth_likelihood)
 {
     this->ID = ID;
     object_found = true;
     object_times_missing = 0;
+    frame_time = 0;
+    last_time = -1;
     transition_model_std_xy = MODEL_TRANSITION_STD_XY;
     missing_uncertaincy_multipler = MODEL_MISSING_UNCERTAINCY_MULTIPLER;
 }
@@ -46,6 +49,7 @@ template<typename DEPTH_TYPE>
 void CImageParticleFilter<DEPTH_TYPE>::set_head_color_model(const cv::Mat &model)
 {
     head_color_model = model.clone();
+    head_color_model_sqrt = color_model_sqrt(head_color_model);
 }
 
 template<typename DEPTH_TYPE>
@@ -58,6 +62,7 @@ template<typename DEPTH_TYPE>
 void CImageParticleFilter<DEPTH_TYPE>::set_torso_color_model(const cv::Mat &model)
 {
     torso_color_model = model.clone();
+    torso_color_model_sqrt = color_model_sqrt(torso_color_model);
 }
 
 template<typename DEPTH_TYPE>
@@ -103,19 +108,36 @@ void CImageParticleFilter<DEPTH_TYPE>::update_particles_with_transition_model(co
     ASSERT_(image_depth);
     std::cout << "UPDATE " << transition_model_std_xy << std::endl;
     const cv::Mat depth_mat = cv::Mat(image_depth->image.getAs<IplImage>());
+
+    // particles take the mean valid depth around them when the integral tables come with the frame, the single
+    // pixel otherwise
+    const CObservationImagePtr image_depth_sum = observation->getObservationBySensorLabelAs<CObservationImagePtr>("depth_sum");
+    const CObservationImagePtr image_depth_valid_count = observation->getObservationBySensorLabelAs<CObservationImagePtr>("depth_valid_count");
+    const DepthStatistics depth_statistics = image_depth_sum && image_depth_valid_count ?
+        DepthStatistics(cv::Mat(image_depth_sum->image.getAs<IplImage>()), cv::Mat(image_depth_valid_count->image.getAs<IplImage>())) :
+        DepthStatistics();
     hist_head_color_score.clear();
     hist_head_fitting_score.clear();
     hist_head_z_score.clear();
     hist_chest_color_score.clear();
     hist_score.clear();
 
+    // the noise is drawn in particle order up front: the generator is shared and not thread safe, and a fixed draw
+    // order keeps seeded runs reproducible
+    size_t N = m_particles.size();
+    std::vector<double> noise(5 * N);
+    for (double &n : noise) {
+        n = randomGenerator.drawGaussian1D_normalized();
+    }
+
     auto update_particle = [&](const size_t i) {
+        const double * const particle_noise = &noise[5 * i];
         const float old_x = m_particles[i].d->x;
         const float old_y = m_particles[i].d->y;
         const double old_z = m_particles[i].d->z;
         //TODO take care of this true and 0 *
-        m_particles[i].d->x += (true || object_found) * (0 * dt * m_particles[i].d->vx) + (transition_model_std_xy * randomGenerator.drawGaussian1D_normalized());
-        m_particles[i].d->y += (true || object_found) * (0 * dt * m_particles[i].d->vy) + (transition_model_std_xy * randomGenerator.drawGaussian1D_normalized());
+        m_particles[i].d->x += (true || object_found) * (0 * dt * m_particles[i].d->vx) + (transition_model_std_xy * particle_noise[0]);
+        m_particles[i].d->y += (true || object_found) * (0 * dt * m_particles[i].d->vy) + (transition_model_std_xy * particle_noise[1]);
         //m_particles[i].d->z  = object_found * (old_z);
         m_particles[i].d->z  = old_z;
 
@@ -130,13 +152,14 @@ void CImageParticleFilter<DEPTH_TYPE>::update_particles_with_transition_model(co
         m_particles[i].d->y = std::min(float(depth_mat.rows - 1), m_particles[i].d->y);
 
         if (point_in_mat(m_particles[i].d->x, m_particles[i].d->y, depth_mat)) {
-            m_particles[i].d->z = depth_mat.at<DEPTH_TYPE>(cvRound(m_particles[i].d->y), cvRound(m_particles[i].d->x));
+            const cv::Point pixel(cvRound(m_particles[i].d->x), cvRound(m_particles[i].d->y));
+            m_particles[i].d->z = depth_statistics.empty() ? depth_mat.at<DEPTH_TYPE>(pixel) : depth_statistics.depth_at(pixel);
         }
 
         const double inv_dt = 1.0 / dt;
-        m_particles[i].d->vx = object_found * ((m_particles[i].d->x - old_x) * inv_dt + MODEL_TRANSITION_STD_VXY * randomGenerator.drawGaussian1D_normalized());
-        m_particles[i].d->vy = object_found * ((m_particles[i].d->y - old_y) * inv_dt + MODEL_TRANSITION_STD_VXY * randomGenerator.drawGaussian1D_normalized());
-        m_particles[i].d->vz = object_found * ((m_particles[i].d->z - old_z) * inv_dt + MODEL_TRANSITION_STD_VXY * randomGenerator.drawGaussian1D_normalized());
+        m_particles[i].d->vx = object_found * ((m_particles[i].d->x - old_x) * inv_dt + MODEL_TRANSITION_STD_VXY * particle_noise[2]);
+        m_particles[i].d->vy = object_found * ((m_particles[i].d->y - old_y) * inv_dt + MODEL_TRANSITION_STD_VXY * particle_noise[3]);
+        m_particles[i].d->vz = object_found * ((m_particles[i].d->z - old_z) * inv_dt + MODEL_TRANSITION_STD_VXY * particle_noise[4]);
 
         m_particles[i].d->valid = false;
 
@@ -152,7 +175,6 @@ void CImageParticleFilter<DEPTH_TYPE>::update_particles_with_transition_model(co
         //printf("%f %f %f - %f %f %f\n", xx, yy, zz, m_particles[i].d->x, m_particles[i].d->y, m_particles[i].d->z);
     };
 
-    size_t N = m_particles.size();
 #ifdef USE_INTEL_TBB
     tbb::parallel_for(tbb::blocked_range<size_t>(0, N, N / TBB_PARTITIONS),
         [&update_particle](const tbb::blocked_range<size_t> &r) {
@@ -182,6 +204,28 @@ void CImageParticleFilter<DEPTH_TYPE>::split_particles()
     }
 }
 
+// Resampling leaves the particles in random order. Sorting the valid ones by the Z-order of their 16x16 pixel
+// cell, and then by depth (the EllipseStash key), makes consecutive particles (and so every TBB range) reuse
+// the same masks and image tiles.
+template<typename DEPTH_TYPE>
+void CImageParticleFilter<DEPTH_TYPE>::sort_particles_by_locality()
+{
+    constexpr int cell_bits = 4;
+    constexpr int depth_bits = 13;
+    constexpr uint32_t max_depth = (1 << depth_bits) - 1;
+
+    const size_t N = particles_valid_roi.size();
+    std::vector<uint32_t> keys(N);
+    for (size_t i = 0; i < N; i++) {
+        const ParticleData &particle = *(particles_valid_roi[i].get().d);
+        const uint32_t cell = morton_encode_2D(uint32_t(particle.x) >> cell_bits, uint32_t(particle.y) >> cell_bits);
+        const uint32_t depth = std::min(uint32_t(cvRound(particle.z)), max_depth);
+        keys[i] = (cell << depth_bits) | depth;
+    }
+
+    radix_sort_by_key(particles_valid_roi, keys);
+}
+
 cv::Mat compute_valid_particle_color_model(const ParticleData &particle, const cv::Mat &frame_hsv, EllipseStash &ellipses)
 {
     const cv::Mat &mask = ellipses.get_ellipse_mask_1D(BodyPart::HEAD, particle.z);
@@ -226,8 +270,53 @@ void CImageParticleFilter<DEPTH_TYPE>::weight_particles_with_model(const mrpt::o
     const cv::Mat gradient_vectors = cv::Mat(image_gradient_vectors->image.getAs<IplImage>());
     const cv::Mat gradient_magnitude = cv::Mat(image_gradient_magnitude->image.getAs<IplImage>());
 
+    // the shape term is read from the per-frame orientation response maps when they are available
+    const CObservationImagePtr image_response_maps = observation->getObservationBySensorLabelAs<CObservationImagePtr>("orientation_response_maps");
+    const bool use_response_maps = LIKELIHOOD_USE_RESPONSE_MAPS && image_response_maps;
+    const cv::Mat response_maps = use_response_maps ? cv::Mat(image_response_maps->image.getAs<IplImage>()) : cv::Mat();
+
+    // tiled copies of the frames, the ROI gathers touch far fewer cache lines on them
+    const CObservationImagePtr image_hsv_tiled = observation->getObservationBySensorLabelAs<CObservationImagePtr>("hsv_tiled");
+    const CObservationImagePtr image_gradient_vectors_tiled = observation->getObservationBySensorLabelAs<CObservationImagePtr>("gradient_vectors_tiled");
+    const CObservationImagePtr image_gradient_magnitude_tiled = observation->getObservationBySensorLabelAs<CObservationImagePtr>("gradient_magnitude_tiled");
+    const bool use_tiled_frames = LIKELIHOOD_HISTOGRAM_BACKEND == ColorHistogramBackend::TILED && image_hsv_tiled;
+    // the gradients are only tiled when the contour fitting reads them instead of the response maps
+    const bool use_tiled_gradients = LIKELIHOOD_USE_TILED_FRAMES && image_gradient_vectors_tiled && image_gradient_magnitude_tiled;
+
+    TiledImage<cv::Vec3b> frame_hsv_tiled;
+    TiledImage<cv::Vec2f> gradient_vectors_tiled;
+    TiledImage<float> gradient_magnitude_tiled;
+    if (use_tiled_frames) {
+        frame_hsv_tiled = TiledImage<cv::Vec3b>(cv::Mat(image_hsv_tiled->image.getAs<IplImage>()));
+    }
+    if (use_tiled_gradients) {
+        gradient_vectors_tiled = TiledImage<cv::Vec2f>(cv::Mat(image_gradient_vectors_tiled->image.getAs<IplImage>()));
+        gradient_magnitude_tiled = TiledImage<float>(cv::Mat(image_gradient_magnitude_tiled->image.getAs<IplImage>()));
+    }
+
+    // colour bin pyramid, levels [1, LIKELIHOOD_PYRAMID_LEVELS)
+    std::vector<cv::Mat> color_bin_pyramid(LIKELIHOOD_PYRAMID_LEVELS);
+    bool use_color_pyramid = LIKELIHOOD_USE_COLOR_PYRAMID;
+    for (int level = 1; level < LIKELIHOOD_PYRAMID_LEVELS && use_color_pyramid; level++) {
+        const CObservationImagePtr image_bins = observation->getObservationBySensorLabelAs<CObservationImagePtr>("hsv_bins_" + std::to_string(level));
+        if (image_bins) {
+            color_bin_pyramid[level] = cv::Mat(image_bins->image.getAs<IplImage>());
+        } else {
+            use_color_pyramid = false;
+        }
+    }
+
+    const CObservationImagePtr image_frame_histogram = observation->getObservationBySensorLabelAs<CObservationImagePtr>("hsv_frame_histogram");
+    const bool back_projection = LIKELIHOOD_COLOR_MODE == ColorLikelihood::BACK_PROJECTION && image_frame_histogram &&
+                                 !head_color_model.empty() && !torso_color_model.empty();
+    const cv::Mat frame_histogram = back_projection ? cv::Mat(image_frame_histogram->image.getAs<IplImage>()) : cv::Mat();
+
     split_particles();
 
+    if (LIKELIHOOD_SORT_PARTICLES) {
+        sort_particles_by_locality();
+    }
+
     assert(particles_invalid_roi.size() + particles_valid_roi.size() == m_particles.size());
 
     if (!particles_valid_roi.size()){
@@ -245,8 +334,45 @@ void CImageParticleFilter<DEPTH_TYPE>::weight_particles_with_model(const mrpt::o
 
     vector<cv::Mat> particles_head_color_model(N);
     vector<float> particles_ellipse_fitting(N);
+    vector<float> particles_z_score(N);
+
+    // In cascade mode the cheap terms run first (depth, then contour fitting) and the particles whose partial
+    // score falls below the bounds skip the colour histograms, getting WEIGHT_INVALID instead.
+    const bool cascade = LIKELIHOOD_CASCADE;
+    vector<uint8_t> particles_rejected(N, CASCADE_ACCEPTED);
+
+    // depth term of all the valid particles in one batch from the table
+    vector<float> particles_z(N);
+    for (size_t i = 0; i < N; i++) {
+        particles_z[i] = particles_valid_roi[i].get().d->z;
+    }
+    (*depth_likelihood)(particles_z.data(), last_distance, particles_z_score.data(), N);
+
+    if (cascade) {
+        for (size_t i = 0; i < N; i++) {
+            if (particles_z_score[i] < LIKELIHOOD_CASCADE_DEPTH_BOUND) {
+                particles_rejected[i] = CASCADE_REJECTED_DEPTH;
+            }
+        }
+    }
+
+    const bool histogram_engine = LIKELIHOOD_HISTOGRAM_BACKEND == ColorHistogramBackend::SIMD_ENGINE;
+
+    auto compute_particle_color_histogram = [&](const float x, const float y, const float z){
+        if (use_color_pyramid) {
+            const int level = ellipses->get_pyramid_level(BodyPart::HEAD, cvRound(z));
+            if (level > 0) {
+                const cv::Mat &level_weights = ellipses->get_pyramid_ellipse_mask_weights(BodyPart::HEAD, cvRound(z));
+                const cv::Mat &level_bins = color_bin_pyramid[level];
+                const float scale = 1.f / (1 << level);
+                // the rounding at the coarser level may push the region one pixel out
+                const int level_x = std::max(0, std::min(level_bins.cols - level_weights.cols, cvRound(x * scale - level_weights.cols * 0.5)));
+                const int level_y = std::max(0, std::min(level_bins.rows - level_weights.rows, cvRound(y * scale - level_weights.rows * 0.5)));
+                const cv::Rect level_roi = cv::Rect(level_x, level_y, level_weights.cols, level_weights.rows);
+                return compute_color_model2_from_bins(level_bins(level_roi), level_weights);
+            }
+        }
 
-    auto compute_particle_color_model = [&](const float x, const float y, const float z){
         const cv::Mat &mask_weights = ellipses->get_ellipse_mask_weights(BodyPart::HEAD, cvRound(z));
 
         const cv::Rect particle_roi = cv::Rect(
@@ -254,8 +380,13 @@ void CImageParticleFilter<DEPTH_TYPE>::weight_particles_with_model(const mrpt::o
             cvRound(y - mask_weights.rows * 0.5),
             mask_weights.cols, mask_weights.rows);
 
+        if (use_tiled_frames) {
+            return compute_color_model2(frame_hsv_tiled, particle_roi, mask_weights);
+        }
+
         const cv::Mat particle_roi_img = frame_hsv(particle_roi);
-        const cv::Mat color_model = compute_color_model2(particle_roi_img, mask_weights);
+        const cv::Mat color_model = histogram_engine ? compute_color_model_fused(particle_roi_img, mask_weights) :
+                                                       compute_color_model2(particle_roi_img, mask_weights);
 
 #ifdef DEBUG
         if (i == 0){
@@ -267,8 +398,38 @@ void CImageParticleFilter<DEPTH_TYPE>::weight_particles_with_model(const mrpt::o
         return color_model;
     };
 
-    auto compute_particle_ellipse_fitting = [&](const float x, const float y, const float z){
+    // with sqrt histograms the particle models are produced (and cached) as sqrt bins, like the target models
+    const bool sqrt_histograms = LIKELIHOOD_SQRT_HISTOGRAMS;
+
+    auto compute_particle_color_model_uncached = [&](const float x, const float y, const float z){
+        cv::Mat color_model = compute_particle_color_histogram(x, y, z);
+        if (sqrt_histograms) {
+            color_model_to_sqrt(color_model);
+        }
+        return color_model;
+    };
+
+    if (use_response_maps) {
+        // contour templates are built lazily, do it before going parallel
+        for (size_t i = 0; i < N; i++) {
+            const ParticleData &particle = *(particles_valid_roi[i].get().d);
+            contour_templates.get_template(ellipses->get_ellipse_size(BodyPart::HEAD, cvRound(particle.z)), *shape_model, response_maps);
+        }
+    }
+
+    auto compute_particle_ellipse_fitting_uncached = [&](const float x, const float y, const float z){
         const cv::Size ellipse_axes = ellipses->get_ellipse_size(BodyPart::HEAD, cvRound(z));
+
+        if (use_response_maps) {
+            const ContourTemplate &contour = contour_templates.get_template(ellipse_axes, *shape_model, response_maps);
+            return ellipse_contour_response(cv::Point(x, y), contour, response_maps);
+        }
+
+        if (use_tiled_gradients) {
+            return ellipse_contour_test(cv::Point(x, y), ellipse_axes.width * 0.5, ellipse_axes.height * 0.5,
+                                        *shape_model, gradient_vectors_tiled, gradient_magnitude_tiled);
+        }
+
         //TODO CHANGE THIS TO DO THE TEST OVER A ROI
         const float fitting = ellipse_contour_test(cv::Point(x, y),
                                              ellipse_axes.width * 0.5,
@@ -283,26 +444,90 @@ void CImageParticleFilter<DEPTH_TYPE>::weight_particles_with_model(const mrpt::o
         return fitting;
     };
 
+    // Duplicated particles (same pixel and depth after resampling) share their terms within the frame. The
+    // head and torso colour models are both histograms of the head sized mask, so they share a cache.
+    const bool memoize = LIKELIHOOD_MEMOIZE;
+    LikelihoodCache<cv::Mat> color_model_cache;
+    LikelihoodCache<float> ellipse_fitting_cache;
+
+    auto compute_particle_color_model = [&](const float x, const float y, const float z){
+        if (!memoize) {
+            return compute_particle_color_model_uncached(x, y, z);
+        }
+        const uint64_t key = likelihood_cache_key(LIKELIHOOD_TERM_COLOR_MODEL, cvRound(x), cvRound(y), cvRound(z));
+        return color_model_cache.get_or_compute(key, [&](){ return compute_particle_color_model_uncached(x, y, z); });
+    };
+
+    auto compute_particle_ellipse_fitting = [&](const float x, const float y, const float z){
+        if (!memoize) {
+            return compute_particle_ellipse_fitting_uncached(x, y, z);
+        }
+        // the contour is centered at cv::Point(x, y), which truncates
+        const uint64_t key = likelihood_cache_key(LIKELIHOOD_TERM_ELLIPSE_FITTING, int(x), int(y), cvRound(z));
+        return ellipse_fitting_cache.get_or_compute(key, [&](){ return compute_particle_ellipse_fitting_uncached(x, y, z); });
+    };
+
+    // In back-projection mode the colour terms are scores read from the maps of the models instead of histograms.
+    vector<float> particles_head_color_score(N);
+    vector<float> particles_torso_color_score(N);
+    ColorBackProjection head_back_projection;
+    ColorBackProjection torso_back_projection;
+
+    auto particle_roi = [&](const float x, const float y, const float z){
+        const cv::Size ellipse_axes = ellipses->get_ellipse_size(BodyPart::HEAD, cvRound(z));
+        return cv::Rect(cvRound(x - ellipse_axes.width * 0.5), cvRound(y - ellipse_axes.height * 0.5),
+                        ellipse_axes.width, ellipse_axes.height);
+    };
+
+    auto compute_particle_head_color = [&](const size_t i){
+        const ParticleData &particle = *(particles_valid_roi[i].get().d);
+        if (back_projection) {
+            particles_head_color_score[i] = head_back_projection.score(particle_roi(particle.x, particle.y, particle.z).tl(),
+                                                                        ellipses->get_ellipse_spans(BodyPart::HEAD, cvRound(particle.z)));
+        } else {
+            particles_head_color_model[i] = compute_particle_color_model(particle.x, particle.y, particle.z);
+        }
+    };
+
+    if (back_projection && N) {
+        cv::Rect head_region = particle_roi(particles_valid_roi[0].get().d->x, particles_valid_roi[0].get().d->y, particles_valid_roi[0].get().d->z);
+        for (size_t i = 1; i < N; i++) {
+            const ParticleData &particle = *(particles_valid_roi[i].get().d);
+            head_region |= particle_roi(particle.x, particle.y, particle.z);
+        }
+        head_back_projection.compute(frame_hsv, head_region, compute_ratio_histogram(head_color_model, frame_histogram));
+    }
+
 #ifdef USE_INTEL_TBB
     tbb::parallel_for(tbb::blocked_range<size_t>(0, N, N / TBB_PARTITIONS),
-        [this, &frame_hsv, &particles_head_color_model, &compute_particle_color_model, &compute_particle_ellipse_fitting,
-            &gradient_vectors, &gradient_magnitude, &particles_ellipse_fitting](const tbb::blocked_range<size_t> &r) {
+        [this, &frame_hsv, &compute_particle_head_color, &compute_particle_ellipse_fitting,
+            &gradient_vectors, &gradient_magnitude, &particles_ellipse_fitting, &particles_rejected, cascade](const tbb::blocked_range<size_t> &r) {
             for (size_t i = r.begin(); i != r.end(); i++) {
+                if (particles_rejected[i]) {
+                    continue;
+                }
                 const ParticleData &particle = *(particles_valid_roi[i].get().d);
                 /*
                 particles_head_color_model[i] = compute_particle_color_model(particle, frame_hsv);
                 particles_ellipse_fitting[i] = compute_valid_particle_ellipse_fitting(particle, gradient_vectors,
                     gradient_magnitude, *shape_model);
                 */
-                particles_head_color_model[i] = compute_particle_color_model(particle.x, particle.y, particle.z);
+                if (!cascade) {
+                    compute_particle_head_color(i);
+                }
                 particles_ellipse_fitting[i] = compute_particle_ellipse_fitting(particle.x, particle.y, particle.z);
             }
         }
     );
 #else
     for (size_t i = 0; i < N; i++) {
+        if (particles_rejected[i]) {
+            continue;
+        }
         const ParticleData &particle = *(particles_valid_roi[i].get().d);
-        particles_head_color_model[i] = compute_particle_color_model(particle.x, particle.y, particle.z);
+        if (!cascade) {
+            compute_particle_head_color(i);
+        }
         particles_ellipse_fitting[i] = compute_particle_ellipse_fitting(particle.x, particle.y, particle.z);
     }
 #endif
@@ -329,28 +554,67 @@ void CImageParticleFilter<DEPTH_TYPE>::weight_particles_with_model(const mrpt::o
 
 float max_fitting = std::numeric_limits<float>::min();
 float min_fitting = std::numeric_limits<float>::max();;
+size_t n_fitted = 0;
 
 for (size_t i = 0; i < N; i++) {
+    if (particles_rejected[i]) {
+        continue;
+    }
     min_fitting = std::min(min_fitting, particles_ellipse_fitting[i]);
     max_fitting = std::max(max_fitting, particles_ellipse_fitting[i]);
+    n_fitted++;
 }
 
-float inv_range_fitting = 1.0f / (max_fitting - min_fitting);
-
+// with the cascade a single particle, or a few fitting alike, may be left: no range to normalize by, they all
+// fit as well as the best one
+const bool flat_fitting = max_fitting - min_fitting <= 1e-6f;
+float inv_range_fitting = flat_fitting ? 0.0f : 1.0f / (max_fitting - min_fitting);
 
+if (n_fitted) {
 #ifdef USE_INTEL_TBB
     tbb::parallel_for(tbb::blocked_range<size_t>(0, N, N / TBB_PARTITIONS),
-        [this, &particles_ellipse_fitting, &sum_gradient_fitting, &min_fitting, &inv_range_fitting](const tbb::blocked_range<size_t> &r) {
+        [this, &particles_ellipse_fitting, &sum_gradient_fitting, &min_fitting, &inv_range_fitting, flat_fitting](const tbb::blocked_range<size_t> &r) {
             for (size_t i = r.begin(); i != r.end(); i++) {
-                particles_ellipse_fitting[i] = (particles_ellipse_fitting[i] - min_fitting) * inv_range_fitting;
+                particles_ellipse_fitting[i] = flat_fitting ? 1.0f : (particles_ellipse_fitting[i] - min_fitting) * inv_range_fitting;
             }
         }
     );
 #else
     for (size_t i = 0; i < N; i++) {
-        particles_ellipse_fitting[i] = (particles_ellipse_fitting[i] - min_fitting) * inv_range_fitting;
+        particles_ellipse_fitting[i] = flat_fitting ? 1.0f : (particles_ellipse_fitting[i] - min_fitting) * inv_range_fitting;
     }
 #endif
+}
+
+    if (cascade) {
+        for (size_t i = 0; i < N; i++) {
+            if (!particles_rejected[i] && particles_z_score[i] * particles_ellipse_fitting[i] < LIKELIHOOD_CASCADE_SHAPE_BOUND) {
+                particles_rejected[i] = CASCADE_REJECTED_SHAPE;
+            }
+        }
+
+#ifdef USE_INTEL_TBB
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, N, N / TBB_PARTITIONS),
+            [this, &compute_particle_head_color, &particles_rejected](const tbb::blocked_range<size_t> &r) {
+                for (size_t i = r.begin(); i != r.end(); i++) {
+                    if (!particles_rejected[i]) {
+                        compute_particle_head_color(i);
+                    }
+                }
+            }
+        );
+#else
+        for (size_t i = 0; i < N; i++) {
+            if (!particles_rejected[i]) {
+                compute_particle_head_color(i);
+            }
+        }
+#endif
+    }
+
+    likelihood_stats.evaluated = N;
+    likelihood_stats.rejected_depth = std::count(particles_rejected.begin(), particles_rejected.end(), CASCADE_REJECTED_DEPTH);
+    likelihood_stats.rejected_shape = std::count(particles_rejected.begin(), particles_rejected.end(), CASCADE_REJECTED_SHAPE);
 
 /*
 #ifdef USE_INTEL_TBB
@@ -376,8 +640,8 @@ float inv_range_fitting = 1.0f / (max_fitting - min_fitting);
 
     auto calculate_torso_particles = [&](const size_t i) {
         const ParticleData &particle = *(particles_valid_roi[i].get().d);
-        const Eigen::Vector2i torso_particle = translate_2D_vector_in_3D_space(particle.x, particle.y, particle.z, HEAD_TO_TORSE_CENTER_VECTOR,
-                                                            registration->cameraMatrix, registration->lookupX, registration->lookupY);
+        const cv::Point torso_offset = ellipses->get_torso_offset(particle.z);
+        const Eigen::Vector2i torso_particle = Vector2i(int(particle.x) + torso_offset.x, int(particle.y) + torso_offset.y);
 
         const Eigen::Vector3i torso_particle_2D_D = Vector3i(torso_particle[0], torso_particle[1], particle.z);
 
@@ -414,42 +678,84 @@ float inv_range_fitting = 1.0f / (max_fitting - min_fitting);
 
     bool enough_chests_visible = (n_particles_with_chest / float(N)) >= MINIMUM_VISIBLE_CHEST_PERCENTAGE;
 
+    auto compute_particle_torso_color = [&](const size_t i){
+        if (back_projection) {
+            particles_torso_color_score[i] = torso_back_projection.score(particle_roi(torso_particles[i][0], torso_particles[i][1], torso_particles[i][2]).tl(),
+                                                                          ellipses->get_ellipse_spans(BodyPart::HEAD, torso_particles[i][2]));
+        } else {
+            particles_torso_color_model[i] = compute_particle_color_model(torso_particles[i][0], torso_particles[i][1], torso_particles[i][2]);
+        }
+    };
+
+    if (enough_chests_visible && back_projection){
+        cv::Rect torso_region;
+        for (size_t i = 0; i < N; i++) {
+            if(torso_in_frame[i] && !particles_rejected[i]){
+                const cv::Rect torso_roi = particle_roi(torso_particles[i][0], torso_particles[i][1], torso_particles[i][2]);
+                torso_region = torso_region.area() ? (torso_region | torso_roi) : torso_roi;
+            }
+        }
+        torso_back_projection.compute(frame_hsv, torso_region, compute_ratio_histogram(torso_color_model, frame_histogram));
+    }
+
     if (enough_chests_visible){
 #ifdef USE_INTEL_TBB
         tbb::parallel_for(tbb::blocked_range<size_t>(0, N, N / TBB_PARTITIONS),
-            [this, &frame_hsv, &torso_particles, &torso_in_frame, &particles_torso_color_model, &compute_particle_color_model](const tbb::blocked_range<size_t> &r) {
+            [this, &torso_in_frame, &compute_particle_torso_color, &particles_rejected](const tbb::blocked_range<size_t> &r) {
                 for (size_t i = r.begin(); i != r.end(); i++) {
-                    if(torso_in_frame[i]){
-                        particles_torso_color_model[i] = compute_particle_color_model(torso_particles[i][0], torso_particles[i][1], torso_particles[i][2]);
-
+                    if(torso_in_frame[i] && !particles_rejected[i]){
+                        compute_particle_torso_color(i);
                     }
                 }
             }
         );
 #else
         for (size_t i = 0; i < N; i++) {
-            if(torso_in_frame[i]){
-                particles_torso_color_model[i] = compute_particle_color_model(torso_particles[i][0], torso_particles[i][1], torso_particles[i][2]);
+            if(torso_in_frame[i] && !particles_rejected[i]){
+                compute_particle_torso_color(i);
             }
         }
 #endif
     }
 
+    likelihood_stats.cache_lookups = color_model_cache.get_lookups() + ellipse_fitting_cache.get_lookups();
+    likelihood_stats.cache_hits = color_model_cache.get_hits() + ellipse_fitting_cache.get_hits();
+
     //third, weight them
     std::vector<std::tuple<float, float, float, float, float>> scores(N);
+    // likelihoods, turned into log-likelihoods in one batch after the loop
+    std::vector<float> particles_weight(N);
+
+    auto weight_valid_particle = [this, &particles_head_color_model, &particles_ellipse_fitting, &particles_z_score, &particles_rejected, &enough_chests_visible, &torso_in_frame, &particles_torso_color_model,
+                                  &particles_head_color_score, &particles_torso_color_score, back_projection, sqrt_histograms, &scores, &particles_weight] (const size_t i){
+        if (particles_rejected[i]) {
+            scores[i] = std::make_tuple(WEIGHT_INVALID, 0, 0, 0, particles_z_score[i]);
+            particles_weight[i] = WEIGHT_INVALID;
+            return;
+        }
 
-    auto weight_valid_particle = [this, &particles_head_color_model, &particles_ellipse_fitting, &enough_chests_visible, &torso_in_frame, &particles_torso_color_model, &scores] (const size_t i){
-        const float head_hist_distance = cv::compareHist(head_color_model, particles_head_color_model[i], CV_COMP_BHATTACHARYYA);
-        const float head_color_score  = (1 - head_hist_distance);
+        float head_color_score;
+        if (back_projection) {
+            head_color_score = particles_head_color_score[i];
+        } else if (sqrt_histograms) {
+            head_color_score = 1 - bhattacharyya_distance_sqrt(head_color_model_sqrt, particles_head_color_model[i]);
+        } else {
+            head_color_score = 1 - cv::compareHist(head_color_model, particles_head_color_model[i], CV_COMP_BHATTACHARYYA);
+        }
         const float head_fitting_score = particles_ellipse_fitting[i];
 
-        //Z is m: convert to mm
-        const float head_z_score =  1 - (2 * cdf(*depth_normal_distribution, std::abs(particles_valid_roi[i].get().d->z - last_distance)) - 1);
+        const float head_z_score = particles_z_score[i];
         //std::cerr <<  std::abs(particles_valid_roi[i].get().d->z - last_distance) << std::endl;
         float chest_color_score = 1;
 
         if (enough_chests_visible && torso_in_frame[i]){
-            chest_color_score = 1 - cv::compareHist(torso_color_model, particles_torso_color_model[i], CV_COMP_BHATTACHARYYA);
+            if (back_projection) {
+                chest_color_score = particles_torso_color_score[i];
+            } else if (sqrt_histograms) {
+                chest_color_score = 1 - bhattacharyya_distance_sqrt(torso_color_model_sqrt, particles_torso_color_model[i]);
+            } else {
+                chest_color_score = 1 - cv::compareHist(torso_color_model, particles_torso_color_model[i], CV_COMP_BHATTACHARYYA);
+            }
         }
 
         double score = 1;
@@ -464,7 +770,7 @@ float inv_range_fitting = 1.0f / (max_fitting - min_fitting);
         scores[i] = std::make_tuple(score, head_color_score, head_fitting_score, chest_color_score, head_z_score);
         score = std::max(WEIGHT_INVALID, score);
 
-        particles_valid_roi[i].get().log_w += log(score);
+        particles_weight[i] = score;
 
         //printf("%f · %f · %f · %f = %f (%f)\n", head_color_score, head_fitting_score, head_z_score, chest_color_score, score, particles_valid_roi[i].get().log_w);
 
@@ -489,6 +795,11 @@ float inv_range_fitting = 1.0f / (max_fitting - min_fitting);
     }
 #endif
 
+    log_batch(particles_weight.data(), particles_weight.data(), N);
+    for (size_t i = 0; i < N; i++) {
+        particles_valid_roi[i].get().log_w += particles_weight[i];
+    }
+
     const size_t N_invalids = particles_invalid_roi.size();
     //constexpr double w_invalid = log(std::numeric_limits<double>::min());
     constexpr double w_invalid = log(0.001);
@@ -515,10 +826,8 @@ void CImageParticleFilter<DEPTH_TYPE>::prediction_and_update_pfStandardProposal(
     const mrpt::obs::CSensoryFrame * const observation,
     const bayes::CParticleFilter::TParticleFilterOptions&)
 {
-    const int64_t current_time = cv::getTickCount();
-
-    const double dt = (current_time - last_time) / cv::getTickFrequency();
-    last_time = current_time;
+    const double dt = last_time < 0 || frame_time <= last_time ? TRACKING_FIRST_DT : frame_time - last_time;
+    last_time = frame_time;
 
     update_particles_with_transition_model(dt, observation);
 
@@ -566,25 +875,10 @@ float CImageParticleFilter<DEPTH_TYPE>::get_mean(float &x, float &y, float &z, f
     m_particles_filtered.resize(size_t(m_particles_filtered.size() * 0.20));
     */
 
-    double sumW = 0;
-#ifdef USE_INTEL_TBB
-    sumW = tbb::parallel_reduce(
-        tbb::blocked_range<CParticleList::const_iterator>(m_particles_filtered.begin(), m_particles_filtered.end(),
-            m_particles_filtered.size() / TBB_PARTITIONS), 0.f,
-                [](const tbb::blocked_range<CParticleList::const_iterator> &r, double value) -> double {
-                    return std::accumulate(r.begin(), r.end(), value,
-                        [](double value, const CParticleData &p) -> double {
-                            return exp(p.log_w) + value;
-                        }
-                    );
-                },
-            std::plus<double>()
-        );
-#else
-    for (CParticleList::iterator it = m_particles_filtered.begin(); it != m_particles_filtered.end(); it++) {
-        sumW += exp(it->log_w);
-    }
-#endif
+    vector<float> weights;
+    const double max_log_w = get_relative_weights(m_particles_filtered, weights);
+    const float sum_relative = std::accumulate(weights.begin(), weights.end(), 0.f);
+    const double sumW = sum_relative * exp(max_log_w);
 
     //std::cout << "MEAN WEIGHT " << sumW / m_particles.size() << std::endl;
     //ASSERT_(sumW > 0)
@@ -600,18 +894,59 @@ float CImageParticleFilter<DEPTH_TYPE>::get_mean(float &x, float &y, float &z, f
     vy = 0;
     vz = 0;
 
-    const double inv_sumW = 1.0 / sumW;
+    const float inv_sum_relative = 1.f / sum_relative;
 
-    for (CParticleList::const_iterator it = m_particles_filtered.begin(); it != m_particles_filtered.end(); it++) {
-        const double w = exp(it->log_w) * inv_sumW;
-        x += float(w * it->d->x);
-        y += float(w * it->d->y);
-        z += float(w * it->d->z);
+    for (size_t i = 0; i < m_particles_filtered.size(); i++) {
+        const ParticleData &particle = *(m_particles_filtered[i].d);
+        const float w = weights[i] * inv_sum_relative;
+        x += w * particle.x;
+        y += w * particle.y;
+        z += w * particle.z;
 
-        vx += float(w * it->d->vx);
-        vy += float(w * it->d->vy);
-        vz += float(w * it->d->vz);
+        vx += w * particle.vx;
+        vy += w * particle.vy;
+        vz += w * particle.vz;
     }
 
     return sumW / m_particles.size();
 }
+
+template<typename DEPTH_TYPE>
+double CImageParticleFilter<DEPTH_TYPE>::get_relative_weights(const CParticleList &particles, vector<float> &weights) const
+{
+    const size_t M = particles.size();
+    double max_log_w = -std::numeric_limits<double>::infinity();
+    for (size_t i = 0; i < M; i++) {
+        max_log_w = std::max(max_log_w, particles[i].log_w);
+    }
+
+    weights.resize(M);
+    for (size_t i = 0; i < M; i++) {
+        weights[i] = particles[i].log_w - max_log_w;
+    }
+    exp_batch(weights.data(), weights.data(), M);
+    return max_log_w;
+}
+
+template<typename DEPTH_TYPE>
+double CImageParticleFilter<DEPTH_TYPE>::ESS() const
+{
+    // same as CParticleFilterDataImpl::ESS, which the resampling decision calls, with one batch of exps
+    const size_t M = m_particles.size();
+    if (!M) {
+        return 0;
+    }
+
+    vector<float> weights;
+    get_relative_weights(m_particles, weights);
+    const float sum = std::accumulate(weights.begin(), weights.end(), 0.f);
+    const float inv_sum = 1.f / sum;
+
+    float cum = 0;
+    for (size_t i = 0; i < M; i++) {
+        const float w = weights[i] * inv_sum;
+        cum += w * w;
+    }
+
+    return cum == 0 ? 0 : 1.0 / (cum * M);
+}
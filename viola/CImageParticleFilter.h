@@ -4,8 +4,6 @@
 
 #include <limits>
 
-#include <boost/math/distributions/normal.hpp>
-
 IGNORE_WARNINGS_PUSH
 
 //#include <mrpt/gui/CDisplayWindow.h>
@@ -26,6 +24,14 @@ IGNORE_WARNINGS_POP
 #include "EllipseFunctions.h"
 #include "ImageRegistration.h"
 #include "EllipseStash.h"
+#include "OrientationResponseMaps.h"
+#include "TiledImage.h"
+#include "LikelihoodCache.h"
+#include "BackProjection.h"
+#include "DepthLikelihood.h"
+#include "HistogramEngine.h"
+#include "FastMath.h"
+#include "DepthStatistics.h"
 
 using namespace mrpt;
 using namespace mrpt::math;
@@ -34,8 +40,6 @@ using namespace mrpt::obs;
 using namespace mrpt::random;
 using namespace std;
 
-using normal_dist = boost::math::normal_distribution<float>;
-
 extern double TRANSITION_MODEL_STD_XY;
 extern double TRANSITION_MODEL_STD_VXY;
 extern double NUM_PARTICLES;
@@ -55,6 +59,39 @@ struct ParticleData
     bool valid;
 };
 
+// outcome of the cascaded likelihood for a valid particle
+enum CascadeStage : uint8_t
+{
+    CASCADE_ACCEPTED = 0,
+    CASCADE_REJECTED_DEPTH,
+    CASCADE_REJECTED_SHAPE
+};
+
+// terms memoized by the per-frame LikelihoodCache
+enum LikelihoodTerm
+{
+    LIKELIHOOD_TERM_COLOR_MODEL = 0,
+    LIKELIHOOD_TERM_ELLIPSE_FITTING
+};
+
+// per-frame counters of the likelihood evaluation of the valid particles
+struct LikelihoodStats
+{
+    size_t evaluated = 0;
+    size_t rejected_depth = 0;
+    size_t rejected_shape = 0;
+    size_t cache_lookups = 0;
+    size_t cache_hits = 0;
+
+    void print(const int ID) const
+    {
+        const float hit_rate = cache_lookups ? cache_hits / float(cache_lookups) : 0;
+        std::cout << "LIKELIHOOD_STATS " << ID << " EVALUATED " << evaluated
+                  << " REJECTED_DEPTH " << rejected_depth << " REJECTED_SHAPE " << rejected_shape
+                  << " CACHE_HITS " << cache_hits << '/' << cache_lookups << " (" << hit_rate * 100 << "%)" << std::endl;
+    }
+};
+
 template<typename DEPTH_TYPE>
 class CImageParticleFilter :
     public mrpt::bayes::CParticleFilterData<ParticleData>,
@@ -70,7 +107,7 @@ public:
     CHistogram hist_score;
 
     static double WEIGHT_INVALID;
-    CImageParticleFilter(EllipseStash *ellipses, const ImageRegistration * const reg, const normal_dist * const depth_distribution, const int ID);
+    CImageParticleFilter(EllipseStash *ellipses, const ImageRegistration * const reg, const DepthLikelihood * const depth_likelihood, const int ID);
     using ParticleType = typename decltype(m_particles)::value_type;
 
     void update_particles_with_transition_model(const double dt, const mrpt::obs::CSensoryFrame * const observation);
@@ -83,6 +120,7 @@ public:
         const bayes::CParticleFilter::TParticleFilterOptions&);
 
     void split_particles();
+    void sort_particles_by_locality();
 
     void init_particles(const size_t M,
                         const pair<float, float> &x,
@@ -106,10 +144,14 @@ public:
 
     void set_shape_model(const vector<Eigen::Vector2f> &normal_vectors);
     float get_mean(float &x, float &y, float &z, float &vx, float &vy, float &vz) const;
+    double ESS() const override;
     void print_particle_state(void) const;
 
     float last_distance;
-    int64_t last_time;
+    // seconds, set by the caller before every step: wall clock live, recorded frame time in offline replay;
+    // last_time < 0 before the first step
+    double frame_time;
+    double last_time;
 
     int object_times_missing;
 
@@ -122,6 +164,8 @@ public:
 
     float transition_model_std_xy;
     float missing_uncertaincy_multipler;
+
+    LikelihoodStats likelihood_stats;
 protected:
     int64_t last_seen;
     bool object_found;
@@ -129,13 +173,19 @@ protected:
     vector<reference_wrapper<typename decltype(m_particles)::value_type>> particles_valid_roi;
     vector<reference_wrapper<typename decltype(m_particles)::value_type>> particles_invalid_roi;
 
+    // exp(log_w - max log_w) of every particle, returns max log_w
+    double get_relative_weights(const CParticleList &particles, vector<float> &weights) const;
+
     cv::Mat head_color_model;
     cv::Mat torso_color_model;
+    cv::Mat head_color_model_sqrt;
+    cv::Mat torso_color_model_sqrt;
 
     const vector<Eigen::Vector2f> *shape_model;
+    ContourTemplateStash contour_templates;
     EllipseStash *ellipses;
     const ImageRegistration *registration;
-    const boost::math::normal_distribution<float> *depth_normal_distribution;
+    const DepthLikelihood *depth_likelihood;
 };
 
 
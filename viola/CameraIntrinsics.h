@@ -0,0 +1,39 @@
+#pragma once
+
+#include "project_config.h"
+
+IGNORE_WARNINGS_PUSH
+
+#include <mrpt/otherlibs/do_opencv_includes.h>
+
+IGNORE_WARNINGS_POP
+
+// Pinhole intrinsics read once from a 3x3 CV_64F camera matrix, with the inverse focal lengths precomputed.
+struct CameraIntrinsics
+{
+    float fx;
+    float fy;
+    float cx;
+    float cy;
+    float inv_fx;
+    float inv_fy;
+
+    CameraIntrinsics() :
+        fx(1), fy(1), cx(0), cy(0), inv_fx(1), inv_fy(1)
+    {
+        ;
+    };
+
+    CameraIntrinsics(const float fx, const float fy, const float cx, const float cy) :
+        fx(fx), fy(fy), cx(cx), cy(cy), inv_fx(1.0f / fx), inv_fy(1.0f / fy)
+    {
+        ;
+    };
+
+    explicit CameraIntrinsics(const cv::Mat &cameraMatrix) :
+        CameraIntrinsics(cameraMatrix.at<double>(0, 0), cameraMatrix.at<double>(1, 1),
+                         cameraMatrix.at<double>(0, 2), cameraMatrix.at<double>(1, 2))
+    {
+        ;
+    };
+};
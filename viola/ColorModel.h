@@ -8,9 +8,13 @@ IGNORE_WARNINGS_PUSH
 IGNORE_WARNINGS_POP
 
 #include <cassert>
+#include <cmath>
+
+#include <pmmintrin.h>
 
 #include "project_config.h"
 #include "EllipseFunctions.h"
+#include "TiledImage.h"
 
 cv::Mat compute_color_model(const cv::Mat &hsv, const cv::Mat &mask);
 cv::Mat histogram_to_image(const cv::Mat &histogram, const int scale);
@@ -164,6 +168,164 @@ cv::Mat compute_color_model2(const cv::Mat &hsv, const cv::Mat &weights)
     return histogram;
 }
 
+// compute_color_model2 over a region of a tiled HSV frame; same bins and layout as the row-major version.
+cv::Mat compute_color_model2(const TiledImage<cv::Vec3b> &hsv, const cv::Rect &region, const cv::Mat &weights)
+{
+    const int hbins = 31;
+    const int sbins = 32;
+    const float h_bin_width = 180.f / hbins;
+    const float s_bin_width = 256.f / sbins;
+    const float v_bin_width = 256.f / sbins;
+
+    cv::Mat histogram = cv::Mat::zeros(hbins + 1, sbins, CV_32FC1);
+    float *histogram_hs = histogram.ptr<float>(0);
+    float *histogram_v = histogram.ptr<float>(hbins);
+
+    hsv.for_each_run(region, [&](const int i, const int j, const cv::Vec3b *pixels, const int length) {
+        const float *weights_row = weights.ptr<float>(i) + j;
+        for (int k = 0; k < length; k++) {
+            const float w = weights_row[k];
+            if (w) {
+                const cv::Vec3b &pixel = pixels[k];
+                const uint bin_h = pixel[0] / h_bin_width;
+                const uint bin_s = pixel[1] / s_bin_width;
+                const uint bin_v = pixel[2] / v_bin_width;
+                histogram_hs[bin_h * sbins + bin_s] += w;
+                histogram_v[bin_v] += w;
+            }
+        }
+    });
+
+    cv::Scalar sum = cv::sum(histogram);
+    histogram /= sum[0];
+    return histogram;
+}
+
+// Flat indices into the 32x32 histogram of compute_color_model2 for every pixel: H-S bin in the first channel,
+// V bin (row 31) in the second one.
+inline cv::Vec<ushort, 2> color_bin_indices(const cv::Vec3b &pixel)
+{
+    constexpr int hbins = 31;
+    constexpr int sbins = 32;
+    constexpr float h_bin_width = 180.f / hbins;
+    constexpr float s_bin_width = 256.f / sbins;
+    constexpr float v_bin_width = 256.f / sbins;
+    const uint bin_h = pixel[0] / h_bin_width;
+    const uint bin_s = pixel[1] / s_bin_width;
+    const uint bin_v = pixel[2] / v_bin_width;
+    cv::Vec<ushort, 2> bins;
+    bins[0] = bin_h * sbins + bin_s;
+    bins[1] = hbins * sbins + bin_v;
+    return bins;
+}
+
+// Colour bin images of the HSV frame decimated by 2^level (nearest, top-left pixel of every 2^level block) for
+// levels [1, levels); level 0 is left empty, at full resolution the HSV frame is used directly.
+std::vector<cv::Mat> compute_color_bin_pyramid(const cv::Mat &hsv, const int levels)
+{
+    std::vector<cv::Mat> pyramid(levels);
+    for (int level = 1; level < levels; level++) {
+        const int step = 1 << level;
+        cv::Mat &bins = pyramid[level];
+        bins.create((hsv.rows + step - 1) / step, (hsv.cols + step - 1) / step, CV_16UC2);
+
+        auto compute_row = [&](const int i) {
+            const cv::Vec3b *src = hsv.ptr<cv::Vec3b>(i * step);
+            cv::Vec<ushort, 2> *dst = bins.ptr<cv::Vec<ushort, 2>>(i);
+            for (int j = 0; j < bins.cols; j++) {
+                dst[j] = color_bin_indices(src[j * step]);
+            }
+        };
+
+#ifdef USE_INTEL_TBB
+        tbb::parallel_for(tbb::blocked_range<int>(0, bins.rows, bins.rows / TBB_PARTITIONS),
+            [&](const tbb::blocked_range<int> &r) {
+                for (int i = r.begin(); i < r.end(); i++) {
+                    compute_row(i);
+                }
+            }
+        );
+#else
+        for (int i = 0; i < bins.rows; i++) {
+            compute_row(i);
+        }
+#endif
+    }
+    return pyramid;
+}
+
+// compute_color_model2 over a region of a colour bin image
+cv::Mat compute_color_model2_from_bins(const cv::Mat &bins, const cv::Mat &weights)
+{
+    cv::Mat histogram = cv::Mat::zeros(32, 32, CV_32FC1);
+    float *histogram_data = histogram.ptr<float>(0);
+    float sum = 0;
+    for (int i = 0; i < bins.rows; i++) {
+        const cv::Vec<ushort, 2> *bins_row = bins.ptr<cv::Vec<ushort, 2>>(i);
+        const float *weights_row = weights.ptr<float>(i);
+        for (int j = 0; j < bins.cols; j++) {
+            const float w = weights_row[j];
+            histogram_data[bins_row[j][0]] += w;
+            histogram_data[bins_row[j][1]] += w;
+            sum += w;
+        }
+    }
+
+    if (sum > 0) {
+        histogram /= 2 * sum;
+    }
+    return histogram;
+}
+
+// Bhattacharyya scoring on sqrt histograms. Once a histogram is normalized to unit mass the Bhattacharyya
+// coefficient is the dot product of the square roots of the bins, so with both operands stored that way a
+// comparison is one dot product and one sqrt, the same distance compareHist(CV_COMP_BHATTACHARYYA) returns.
+constexpr int COLOR_MODEL_BINS = 32 * 32;
+
+// in place: normalizes the histogram to unit mass and takes the square root of every bin
+void color_model_to_sqrt(cv::Mat &histogram)
+{
+    assert(histogram.isContinuous() && histogram.total() == COLOR_MODEL_BINS && histogram.type() == CV_32FC1);
+    float *bins = histogram.ptr<float>(0);
+    const float sum = cv::sum(histogram)[0];
+    const __m128 inv_sum = _mm_set1_ps(sum > 0 ? 1.f / sum : 0.f);
+    for (int b = 0; b < COLOR_MODEL_BINS; b += 4) {
+        _mm_storeu_ps(bins + b, _mm_sqrt_ps(_mm_mul_ps(_mm_loadu_ps(bins + b), inv_sum)));
+    }
+}
+
+cv::Mat color_model_sqrt(const cv::Mat &model)
+{
+    cv::Mat model_sqrt = model.clone();
+    color_model_to_sqrt(model_sqrt);
+    return model_sqrt;
+}
+
+inline float bhattacharyya_distance_sqrt(const cv::Mat &a_sqrt, const cv::Mat &b_sqrt)
+{
+    assert(a_sqrt.isContinuous() && a_sqrt.total() == COLOR_MODEL_BINS);
+    assert(b_sqrt.isContinuous() && b_sqrt.total() == COLOR_MODEL_BINS);
+    const float *a = a_sqrt.ptr<float>(0);
+    const float *b = b_sqrt.ptr<float>(0);
+
+    // four independent accumulators to hide the latency of the adds
+    __m128 sum0 = _mm_setzero_ps();
+    __m128 sum1 = _mm_setzero_ps();
+    __m128 sum2 = _mm_setzero_ps();
+    __m128 sum3 = _mm_setzero_ps();
+    for (int k = 0; k < COLOR_MODEL_BINS; k += 16) {
+        sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + k), _mm_loadu_ps(b + k)));
+        sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + k + 4), _mm_loadu_ps(b + k + 4)));
+        sum2 = _mm_add_ps(sum2, _mm_mul_ps(_mm_loadu_ps(a + k + 8), _mm_loadu_ps(b + k + 8)));
+        sum3 = _mm_add_ps(sum3, _mm_mul_ps(_mm_loadu_ps(a + k + 12), _mm_loadu_ps(b + k + 12)));
+    }
+    __m128 sum = _mm_add_ps(_mm_add_ps(sum0, sum1), _mm_add_ps(sum2, sum3));
+    sum = _mm_hadd_ps(sum, sum);
+    sum = _mm_hadd_ps(sum, sum);
+    const float coefficient = _mm_cvtss_f32(sum);
+    return std::sqrt(std::max(1.f - coefficient, 0.f));
+}
+
 cv::Mat histogram_to_image(const cv::Mat &histogram, const int scale)
 {
     cv::Mat histImg = cv::Mat::zeros(histogram.rows * scale, histogram.cols * scale, CV_8UC1);
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+
+#include <smmintrin.h>
+
+#include "project_config.h"
+
+IGNORE_WARNINGS_PUSH
+
+#include <mrpt/otherlibs/do_opencv_includes.h>
+
+IGNORE_WARNINGS_POP
+
+// Fills the zero (unmeasured) pixels of registered CV_16UC1 depth frames, which the Kinect v2 returns at depth
+// edges and on dark hair, in two steps:
+//  - temporal: a hole keeps the last depth measured at that pixel for up to max_age frames;
+//  - spatial: the holes left take the median of the valid depths of their (2 * radius + 1)^2 window when at least
+//    min_neighbours of them are valid.
+// The temporal history only records measurements, never filled values, so a hole cannot feed itself. Both steps
+// run 8 pixels at a time; the medians are only computed for the lanes still at 0.
+constexpr int DEPTH_HOLE_FILLER_MAX_RADIUS = 3;
+
+class DepthHoleFiller
+{
+public:
+    DepthHoleFiller(const int max_age, const int radius, const int min_neighbours) :
+        max_age(std::max(0, std::min(max_age, int(UINT16_MAX)))),
+        radius(std::max(0, std::min(radius, DEPTH_HOLE_FILLER_MAX_RADIUS))),
+        min_neighbours(std::max(1, min_neighbours))
+    {
+        ;
+    };
+
+    // depth and filled may be the same Mat
+    void fill(const cv::Mat &depth, cv::Mat &filled)
+    {
+        assert(depth.type() == CV_16UC1);
+        if (last_depth.size() != depth.size()) {
+            last_depth = cv::Mat::zeros(depth.size(), CV_16UC1);
+            age = cv::Mat::zeros(depth.size(), CV_16UC1);
+        }
+        temporal.create(depth.size(), CV_16UC1);
+
+        for_each_row(depth.rows, [&](const int i) {
+            fill_row_temporal(depth.ptr<uint16_t>(i), last_depth.ptr<uint16_t>(i), age.ptr<uint16_t>(i),
+                              temporal.ptr<uint16_t>(i), depth.cols);
+        });
+
+        filled.create(depth.size(), CV_16UC1);
+        for_each_row(depth.rows, [&](const int i) {
+            fill_row_spatial(i, filled.ptr<uint16_t>(i));
+        });
+    };
+
+    void reset()
+    {
+        last_depth.release();
+        age.release();
+    };
+
+protected:
+    template<typename F>
+    static void for_each_row(const int rows, F f)
+    {
+#ifdef USE_INTEL_TBB
+        tbb::parallel_for(tbb::blocked_range<int>(0, rows, std::max(1, rows / TBB_PARTITIONS)),
+            [&](const tbb::blocked_range<int> &r) {
+                for (int i = r.begin(); i < r.end(); i++) {
+                    f(i);
+                }
+            }
+        );
+#else
+        for (int i = 0; i < rows; i++) {
+            f(i);
+        }
+#endif
+    };
+
+    // out = depth if measured, else the last measure while it is at most max_age frames old, else 0
+    void fill_row_temporal(const uint16_t * const depth, uint16_t * const last, uint16_t * const ages,
+                           uint16_t * const out, const int cols) const
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i one = _mm_set1_epi16(1);
+        const __m128i v_max_age = _mm_set1_epi16(max_age);
+        int j = 0;
+        for (; j + 8 <= cols; j += 8) {
+            const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(depth + j));
+            const __m128i hole = _mm_cmpeq_epi16(d, zero);
+            const __m128i l = _mm_blendv_epi8(d, _mm_loadu_si128(reinterpret_cast<const __m128i *>(last + j)), hole);
+            const __m128i a = _mm_and_si128(hole, _mm_adds_epu16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ages + j)), one));
+            const __m128i fresh = _mm_cmpeq_epi16(_mm_min_epu16(a, v_max_age), a);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(last + j), l);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(ages + j), a);
+            // measured pixels have l == d and age 0
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + j), _mm_and_si128(l, fresh));
+        }
+        for (; j < cols; j++) {
+            if (depth[j]) {
+                last[j] = depth[j];
+                ages[j] = 0;
+            } else {
+                ages[j] = std::min(ages[j] + 1, int(UINT16_MAX));
+            }
+            out[j] = ages[j] <= max_age ? last[j] : 0;
+        }
+    };
+
+    inline uint16_t window_median(const int i, const int j) const
+    {
+        uint16_t values[(2 * DEPTH_HOLE_FILLER_MAX_RADIUS + 1) * (2 * DEPTH_HOLE_FILLER_MAX_RADIUS + 1)];
+        const int i_0 = std::max(i - radius, 0);
+        const int i_1 = std::min(i + radius, temporal.rows - 1);
+        const int j_0 = std::max(j - radius, 0);
+        const int j_1 = std::min(j + radius, temporal.cols - 1);
+        int n = 0;
+        for (int y = i_0; y <= i_1; y++) {
+            const uint16_t *row = temporal.ptr<uint16_t>(y);
+            for (int x = j_0; x <= j_1; x++) {
+                if (row[x]) {
+                    values[n++] = row[x];
+                }
+            }
+        }
+        if (n < min_neighbours) {
+            return 0;
+        }
+        std::nth_element(values, values + n / 2, values + n);
+        return values[n / 2];
+    };
+
+    void fill_row_spatial(const int i, uint16_t * const out) const
+    {
+        const uint16_t *in = temporal.ptr<uint16_t>(i);
+        const __m128i zero = _mm_setzero_si128();
+        int j = 0;
+        for (; j + 8 <= temporal.cols; j += 8) {
+            const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + j));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + j), d);
+            // two mask bits per 16 bit lane
+            int holes = radius ? _mm_movemask_epi8(_mm_cmpeq_epi16(d, zero)) : 0;
+            while (holes) {
+                const int k = __builtin_ctz(holes) >> 1;
+                out[j + k] = window_median(i, j + k);
+                holes &= ~(3 << (2 * k));
+            }
+        }
+        for (; j < temporal.cols; j++) {
+            out[j] = in[j] || !radius ? in[j] : window_median(i, j);
+        }
+    };
+
+    int max_age;
+    int radius;
+    int min_neighbours;
+
+    cv::Mat last_depth;
+    cv::Mat age;
+    cv::Mat temporal;
+};
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <smmintrin.h>
+
+#include "project_config.h"
+
+IGNORE_WARNINGS_PUSH
+
+#include <boost/math/distributions/normal.hpp>
+
+IGNORE_WARNINGS_POP
+
+// Depth consistency term of the trackers: the two-sided tail 1 - (2 * cdf(|d|) - 1) of N(0, sigma) at the
+// depth difference d (mm) between a hypothesis and the last estimate. It is sampled once at construction
+// every sigma / DEPTH_LIKELIHOOD_BINS_PER_SIGMA mm up to DEPTH_LIKELIHOOD_RANGE_SIGMAS and served with linear
+// interpolation; beyond the range the tail is below 1e-8 and the score is 0.
+constexpr int DEPTH_LIKELIHOOD_BINS_PER_SIGMA = 256;
+constexpr int DEPTH_LIKELIHOOD_RANGE_SIGMAS = 6;
+
+class DepthLikelihood
+{
+public:
+    DepthLikelihood(const float sigma) :
+        sigma(sigma),
+        step(sigma / DEPTH_LIKELIHOOD_BINS_PER_SIGMA),
+        inv_step(1 / step),
+        table(DEPTH_LIKELIHOOD_BINS_PER_SIGMA * DEPTH_LIKELIHOOD_RANGE_SIGMAS + 2)
+    {
+        const boost::math::normal_distribution<float> distribution(0, sigma);
+        const int last = table.size() - 2;
+        for (int k = 0; k <= last; k++) {
+            table[k] = 1 - (2 * cdf(distribution, k * step) - 1);
+        }
+        // the range ends at 0 so that differences clamped to it score 0
+        table[last] = 0;
+        table[last + 1] = 0;
+        max_index = last;
+    };
+
+    inline float operator()(const float difference) const
+    {
+        const float d = std::min(std::abs(difference) * inv_step, float(max_index));
+        const int k = d;
+        const float t = d - k;
+        return table[k] + t * (table[k + 1] - table[k]);
+    };
+
+    // scores[i] = (*this)(depths[i] - reference)
+    void operator()(const float * const depths, const float reference, float * const scores, const size_t n) const
+    {
+        const __m128 sign_mask = _mm_set1_ps(-0.f);
+        const __m128 v_reference = _mm_set1_ps(reference);
+        const __m128 v_inv_step = _mm_set1_ps(inv_step);
+        const __m128 v_max_index = _mm_set1_ps(max_index);
+        const float *table_data = table.data();
+
+        size_t i = 0;
+        for (; i + 4 <= n; i += 4) {
+            const __m128 difference = _mm_andnot_ps(sign_mask, _mm_sub_ps(_mm_loadu_ps(depths + i), v_reference));
+            const __m128 d = _mm_min_ps(_mm_mul_ps(difference, v_inv_step), v_max_index);
+            const __m128i k = _mm_cvttps_epi32(d);
+            const __m128 t = _mm_sub_ps(d, _mm_cvtepi32_ps(k));
+
+            // no gathers in SSE: load the four pairs of samples by lane
+            alignas(16) int indices[4];
+            _mm_store_si128(reinterpret_cast<__m128i *>(indices), k);
+            const __m128 low = _mm_setr_ps(table_data[indices[0]], table_data[indices[1]],
+                                           table_data[indices[2]], table_data[indices[3]]);
+            const __m128 high = _mm_setr_ps(table_data[indices[0] + 1], table_data[indices[1] + 1],
+                                            table_data[indices[2] + 1], table_data[indices[3] + 1]);
+            _mm_storeu_ps(scores + i, _mm_add_ps(low, _mm_mul_ps(t, _mm_sub_ps(high, low))));
+        }
+
+        for (; i < n; i++) {
+            scores[i] = (*this)(depths[i] - reference);
+        }
+    };
+
+    inline float get_sigma() const
+    {
+        return sigma;
+    };
+
+protected:
+    float sigma;
+    float step;
+    float inv_step;
+    int max_index;
+    std::vector<float> table;
+};
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <smmintrin.h>
+
+#include <opencv2/opencv.hpp>
+
+// Conversions of the Kinect v2 float depth (mm), 16 pixels per iteration with byte shuffles:
+//  - recordings store every float as two CV_8UC3 frames, as video codecs only take bytes: the 1_3 plane keeps its
+//    bytes 0, 1 and 2, the 4 plane keeps byte 3 in its first channel and zeros in the other two;
+//  - the registered frames and the container keep CV_16UC1 mm, rounded to nearest and saturated like convertTo,
+//    +inf and any depth beyond 2^31 included; NaN becomes 0.
+// The pixel loops only touch each byte once, so the conversions run at memory bandwidth; depth_packing_benchmark
+// compares them with the scalar loops.
+
+namespace depth_packing
+{
+
+// pixel p of the 16 in d0..d3 (4 floats each) <-> bytes 3 p .. 3 p + 2 of the 48 in the three plane vectors
+const __m128i PACK_LOW_BYTES = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+const __m128i PACK_HIGH_BYTE = _mm_setr_epi8(3, -1, -1, 7, -1, -1, 11, -1, -1, 15, -1, -1, -1, -1, -1, -1);
+const __m128i UNPACK_LOW_BYTES = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+const __m128i UNPACK_HIGH_BYTE = _mm_setr_epi8(-1, -1, -1, 0, -1, -1, -1, 3, -1, -1, -1, 6, -1, -1, -1, 9);
+
+// four 12 byte groups, in the low bytes of g0..g3, into three full vectors
+inline void store_groups(uint8_t *out, const __m128i g0, const __m128i g1, const __m128i g2, const __m128i g3)
+{
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_or_si128(g0, _mm_slli_si128(g1, 12)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 16), _mm_or_si128(_mm_srli_si128(g1, 4), _mm_slli_si128(g2, 8)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 32), _mm_or_si128(_mm_srli_si128(g2, 8), _mm_slli_si128(g3, 4)));
+}
+
+inline void pack_depth_planes(const float *depth, uint8_t *plane_1_3, uint8_t *plane_4, const size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i d0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(depth + i));
+        const __m128i d1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(depth + i + 4));
+        const __m128i d2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(depth + i + 8));
+        const __m128i d3 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(depth + i + 12));
+        store_groups(plane_1_3 + 3 * i, _mm_shuffle_epi8(d0, PACK_LOW_BYTES), _mm_shuffle_epi8(d1, PACK_LOW_BYTES),
+                     _mm_shuffle_epi8(d2, PACK_LOW_BYTES), _mm_shuffle_epi8(d3, PACK_LOW_BYTES));
+        store_groups(plane_4 + 3 * i, _mm_shuffle_epi8(d0, PACK_HIGH_BYTE), _mm_shuffle_epi8(d1, PACK_HIGH_BYTE),
+                     _mm_shuffle_epi8(d2, PACK_HIGH_BYTE), _mm_shuffle_epi8(d3, PACK_HIGH_BYTE));
+    }
+
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(depth);
+    for (; i < n; i++) {
+        plane_1_3[3 * i + 0] = bytes[4 * i + 0];
+        plane_1_3[3 * i + 1] = bytes[4 * i + 1];
+        plane_1_3[3 * i + 2] = bytes[4 * i + 2];
+        plane_4[3 * i + 0] = bytes[4 * i + 3];
+        plane_4[3 * i + 1] = 0;
+        plane_4[3 * i + 2] = 0;
+    }
+}
+
+inline void unpack_depth_planes(const uint8_t *plane_1_3, const uint8_t *plane_4, float *depth, const size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m128i a0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(plane_1_3 + 3 * i));
+        const __m128i a1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(plane_1_3 + 3 * i + 16));
+        const __m128i a2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(plane_1_3 + 3 * i + 32));
+        const __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(plane_4 + 3 * i));
+        const __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(plane_4 + 3 * i + 16));
+        const __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(plane_4 + 3 * i + 32));
+
+        // the 12 bytes of pixels 4 k .. 4 k + 3 start at byte 12 k
+        const __m128i a[4] = {a0, _mm_alignr_epi8(a1, a0, 12), _mm_alignr_epi8(a2, a1, 8), _mm_srli_si128(a2, 4)};
+        const __m128i b[4] = {b0, _mm_alignr_epi8(b1, b0, 12), _mm_alignr_epi8(b2, b1, 8), _mm_srli_si128(b2, 4)};
+        for (int k = 0; k < 4; k++) {
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(depth + i + 4 * k),
+                             _mm_or_si128(_mm_shuffle_epi8(a[k], UNPACK_LOW_BYTES), _mm_shuffle_epi8(b[k], UNPACK_HIGH_BYTE)));
+        }
+    }
+
+    uint8_t *bytes = reinterpret_cast<uint8_t *>(depth);
+    for (; i < n; i++) {
+        bytes[4 * i + 0] = plane_1_3[3 * i + 0];
+        bytes[4 * i + 1] = plane_1_3[3 * i + 1];
+        bytes[4 * i + 2] = plane_1_3[3 * i + 2];
+        bytes[4 * i + 3] = plane_4[3 * i + 0];
+    }
+}
+
+// from the bit pattern: --fast-math folds std::isnan and x != x to false
+inline bool is_nan(const float x)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return (bits & 0x7fffffff) > 0x7f800000;
+}
+
+// NaN lanes of v set to 0, with integer compares for the same reason
+inline __m128 zero_nan(const __m128 v)
+{
+    const __m128i abs_bits = _mm_and_si128(_mm_castps_si128(v), _mm_set1_epi32(0x7fffffff));
+    const __m128i nan = _mm_cmpgt_epi32(abs_bits, _mm_set1_epi32(0x7f800000));
+    return _mm_andnot_ps(_mm_castsi128_ps(nan), v);
+}
+
+inline void depth_to_mm(const float *depth, uint16_t *mm, const size_t n)
+{
+    // cvtps gives INT_MIN for anything at or beyond 2^31, which packus would take to 0 instead of 65535: clamp first.
+    // NaN is zeroed before the clamp, --fast-math lets minps swap its operands and so return either one for NaN.
+    const __m128 max_mm = _mm_set1_ps(65535.0f);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        // round to nearest even, then saturate
+        const __m128 low_depth = zero_nan(_mm_loadu_ps(depth + i));
+        const __m128 high_depth = zero_nan(_mm_loadu_ps(depth + i + 4));
+        const __m128i low = _mm_cvtps_epi32(_mm_min_ps(low_depth, max_mm));
+        const __m128i high = _mm_cvtps_epi32(_mm_min_ps(high_depth, max_mm));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(mm + i), _mm_packus_epi32(low, high));
+    }
+    for (; i < n; i++) {
+        if (is_nan(depth[i])) {
+            mm[i] = 0;
+        } else {
+            mm[i] = depth[i] >= 65535.0f ? 65535 : cv::saturate_cast<uint16_t>(depth[i]);
+        }
+    }
+}
+
+inline void mm_to_depth(const uint16_t *mm, float *depth, const size_t n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(mm + i));
+        _mm_storeu_ps(depth + i, _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero)));
+        _mm_storeu_ps(depth + i + 4, _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero)));
+    }
+    for (; i < n; i++) {
+        depth[i] = mm[i];
+    }
+}
+
+// runs f over the whole buffers when every Mat is continuous, row by row otherwise
+template<typename F>
+inline void for_each_row(const cv::Mat &a, const cv::Mat &b, const cv::Mat &c, F f)
+{
+    if (a.isContinuous() && b.isContinuous() && c.isContinuous()) {
+        f(0, size_t(a.rows) * a.cols);
+    } else {
+        for (int r = 0; r < a.rows; r++) {
+            f(r, size_t(a.cols));
+        }
+    }
+}
+
+}
+
+// depth: CV_32FC1
+inline void pack_depth(const cv::Mat &depth, cv::Mat &plane_1_3, cv::Mat &plane_4)
+{
+    assert(depth.type() == CV_32FC1);
+    plane_1_3.create(depth.rows, depth.cols, CV_8UC3);
+    plane_4.create(depth.rows, depth.cols, CV_8UC3);
+    depth_packing::for_each_row(depth, plane_1_3, plane_4, [&](const int r, const size_t n) {
+        depth_packing::pack_depth_planes(depth.ptr<float>(r), plane_1_3.ptr<uint8_t>(r), plane_4.ptr<uint8_t>(r), n);
+    });
+}
+
+// plane_1_3, plane_4: CV_8UC3 of the same size
+inline void unpack_depth(const cv::Mat &plane_1_3, const cv::Mat &plane_4, cv::Mat &depth)
+{
+    assert(plane_1_3.type() == CV_8UC3 && plane_4.type() == CV_8UC3 && plane_1_3.size() == plane_4.size());
+    depth.create(plane_1_3.rows, plane_1_3.cols, CV_32FC1);
+    depth_packing::for_each_row(plane_1_3, plane_4, depth, [&](const int r, const size_t n) {
+        depth_packing::unpack_depth_planes(plane_1_3.ptr<uint8_t>(r), plane_4.ptr<uint8_t>(r), depth.ptr<float>(r), n);
+    });
+}
+
+// depth: CV_32FC1 -> CV_16UC1
+inline void depth_to_mm(const cv::Mat &depth, cv::Mat &mm)
+{
+    assert(depth.type() == CV_32FC1);
+    mm.create(depth.rows, depth.cols, CV_16UC1);
+    depth_packing::for_each_row(depth, mm, mm, [&](const int r, const size_t n) {
+        depth_packing::depth_to_mm(depth.ptr<float>(r), mm.ptr<uint16_t>(r), n);
+    });
+}
+
+// mm: CV_16UC1 -> CV_32FC1
+inline void mm_to_depth(const cv::Mat &mm, cv::Mat &depth)
+{
+    assert(mm.type() == CV_16UC1);
+    depth.create(mm.rows, mm.cols, CV_32FC1);
+    depth_packing::for_each_row(mm, depth, depth, [&](const int r, const size_t n) {
+        depth_packing::mm_to_depth(mm.ptr<uint16_t>(r), depth.ptr<float>(r), n);
+    });
+}
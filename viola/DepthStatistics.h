@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+#include "project_config.h"
+
+IGNORE_WARNINGS_PUSH
+
+#include <mrpt/otherlibs/do_opencv_includes.h>
+
+IGNORE_WARNINGS_POP
+
+#include "ModelParameters.h"
+#include "EllipseFunctions.h"
+
+// Integral images of the depth frame and of its valid (non zero) pixel count, built once per frame. The mean
+// depth of any rectangle, ellipse (as row spans) or small window around a pixel is then a handful of lookups and
+// ignores the zeros the sensor returns where it has no measure.
+//
+// Both tables have the cv::integral layout, (rows + 1) x (cols + 1) with a zero first row and column. Sums are
+// doubles: a full HD frame of 8 m readings does not fit 32 bits.
+class DepthStatistics
+{
+public:
+    DepthStatistics()
+    {
+        ;
+    };
+
+    // wraps tables built by compute, e.g. received as observations
+    DepthStatistics(const cv::Mat &depth_sum, const cv::Mat &valid_count) :
+        depth_sum(depth_sum), valid_count(valid_count)
+    {
+        ;
+    };
+
+    template<typename DEPTH_TYPE>
+    void compute(const cv::Mat &depth_frame)
+    {
+        depth_sum.create(depth_frame.rows + 1, depth_frame.cols + 1, CV_64FC1);
+        valid_count.create(depth_frame.rows + 1, depth_frame.cols + 1, CV_32SC1);
+        depth_sum.row(0).setTo(0);
+        valid_count.row(0).setTo(0);
+
+        // rows are independent for the horizontal prefix sums...
+        auto prefix_row = [&](const int i) {
+            const DEPTH_TYPE *depth_row = depth_frame.ptr<DEPTH_TYPE>(i);
+            double *sum_row = depth_sum.ptr<double>(i + 1);
+            int32_t *count_row = valid_count.ptr<int32_t>(i + 1);
+            double sum = 0;
+            int32_t count = 0;
+            sum_row[0] = 0;
+            count_row[0] = 0;
+            for (int j = 0; j < depth_frame.cols; j++) {
+                sum += depth_row[j];
+                count += depth_row[j] > 0;
+                sum_row[j + 1] = sum;
+                count_row[j + 1] = count;
+            }
+        };
+
+        // ...and column blocks for the vertical ones
+        auto prefix_columns = [&](const int j_0, const int j_1) {
+            for (int i = 1; i < depth_frame.rows; i++) {
+                const double *sum_above = depth_sum.ptr<double>(i);
+                const int32_t *count_above = valid_count.ptr<int32_t>(i);
+                double *sum_row = depth_sum.ptr<double>(i + 1);
+                int32_t *count_row = valid_count.ptr<int32_t>(i + 1);
+                for (int j = j_0; j < j_1; j++) {
+                    sum_row[j] += sum_above[j];
+                    count_row[j] += count_above[j];
+                }
+            }
+        };
+
+        const int columns = depth_sum.cols;
+#ifdef USE_INTEL_TBB
+        tbb::parallel_for(tbb::blocked_range<int>(0, depth_frame.rows, std::max(1, depth_frame.rows / TBB_PARTITIONS)),
+            [&](const tbb::blocked_range<int> &r) {
+                for (int i = r.begin(); i < r.end(); i++) {
+                    prefix_row(i);
+                }
+            }
+        );
+        tbb::parallel_for(tbb::blocked_range<int>(0, columns, std::max(1, columns / TBB_PARTITIONS)),
+            [&](const tbb::blocked_range<int> &r) {
+                prefix_columns(r.begin(), r.end());
+            }
+        );
+#else
+        for (int i = 0; i < depth_frame.rows; i++) {
+            prefix_row(i);
+        }
+        prefix_columns(0, columns);
+#endif
+    };
+
+    inline const cv::Mat &get_depth_sum() const
+    {
+        return depth_sum;
+    };
+
+    inline const cv::Mat &get_valid_count() const
+    {
+        return valid_count;
+    };
+
+    inline bool empty() const
+    {
+        return depth_sum.empty();
+    };
+
+    // number of non zero depth pixels of rect, clamped to the frame
+    inline int valid_pixels(const cv::Rect &rect) const
+    {
+        const cv::Rect r = clamp(rect);
+        return r.area() ? box<int32_t>(valid_count, r) : 0;
+    };
+
+    // mean of the non zero depths of rect, clamped to the frame; 0 if there is none
+    inline float mean(const cv::Rect &rect) const
+    {
+        const cv::Rect r = clamp(rect);
+        if (!r.area()) {
+            return 0;
+        }
+        const int32_t count = box<int32_t>(valid_count, r);
+        return count ? box<double>(depth_sum, r) / count : 0;
+    };
+
+    // mean of the non zero depths of the ellipse whose mask has its top-left corner at roi_origin, approximated by
+    // its outer ring of spans; the rows are clamped to the frame
+    float mean(const cv::Point &roi_origin, const EllipseSpans &spans) const
+    {
+        const int frame_rows = depth_sum.rows - 1;
+        const int frame_cols = depth_sum.cols - 1;
+        double sum = 0;
+        int32_t count = 0;
+        for (int i = 0; i < spans.rows; i++) {
+            const int y = roi_origin.y + i;
+            if (y < 0 || y >= frame_rows) {
+                continue;
+            }
+            const int x_0 = std::max(roi_origin.x + spans.begin[i], 0);
+            const int x_1 = std::min(roi_origin.x + spans.end[i], frame_cols);
+            if (x_1 <= x_0) {
+                continue;
+            }
+            const double *sum_above = depth_sum.ptr<double>(y);
+            const double *sum_row = depth_sum.ptr<double>(y + 1);
+            const int32_t *count_above = valid_count.ptr<int32_t>(y);
+            const int32_t *count_row = valid_count.ptr<int32_t>(y + 1);
+            sum += (sum_row[x_1] - sum_row[x_0]) - (sum_above[x_1] - sum_above[x_0]);
+            count += (count_row[x_1] - count_row[x_0]) - (count_above[x_1] - count_above[x_0]);
+        }
+        return count ? sum / count : 0;
+    };
+
+    // depth at a pixel as the mean of the non zero depths of the (2 * radius + 1)^2 window around it; 0 if the
+    // whole window is missing
+    inline float depth_at(const cv::Point &point, const int radius = DEPTH_LOOKUP_RADIUS) const
+    {
+        return mean(cv::Rect(point.x - radius, point.y - radius, 2 * radius + 1, 2 * radius + 1));
+    };
+
+protected:
+    inline cv::Rect clamp(const cv::Rect &rect) const
+    {
+        return rect & cv::Rect(0, 0, depth_sum.cols - 1, depth_sum.rows - 1);
+    };
+
+    template<typename T>
+    static inline T box(const cv::Mat &integral, const cv::Rect &r)
+    {
+        const T *top = integral.ptr<T>(r.y);
+        const T *bottom = integral.ptr<T>(r.y + r.height);
+        return bottom[r.x + r.width] - bottom[r.x] - top[r.x + r.width] + top[r.x];
+    };
+
+    cv::Mat depth_sum;
+    cv::Mat valid_count;
+};
@@ -9,6 +9,7 @@ IGNORE_WARNINGS_PUSH
 IGNORE_WARNINGS_POP
 
 #include "MiscHelpers.h"
+#include "TiledImage.h"
 using namespace Eigen;
 
 cv::Mat create_ellipse_mask(const cv::Point &center, const int axis_x, const int axis_y, const int n_dims);
@@ -223,6 +224,46 @@ inline Vector2f calculate_ellipse_orthonormal(const float axis_x, const float ax
     return normal;
 }
 
+// Row spans of an ellipse weight mask (create_ellipse_weight_mask) split into nested rings: ring k covers the
+// pixels with weight > k / rings, so summing every ring with weight 1 / rings approximates the weighted sum
+// from per-row prefix sums. Span k of row i is [begin[k * rows + i], end[k * rows + i]).
+struct EllipseSpans
+{
+    int rings = 0;
+    int rows = 0;
+    std::vector<int> begin;
+    std::vector<int> end;
+    float total_weight = 0;
+};
+
+EllipseSpans compute_ellipse_spans(const cv::Mat &weight_mask, const int rings)
+{
+    EllipseSpans spans;
+    spans.rings = rings;
+    spans.rows = weight_mask.rows;
+    spans.begin.assign(rings * weight_mask.rows, 0);
+    spans.end.assign(rings * weight_mask.rows, 0);
+
+    for (int k = 0; k < rings; k++) {
+        const float threshold = float(k) / rings;
+        for (int i = 0; i < weight_mask.rows; i++) {
+            const float *row = weight_mask.ptr<float>(i);
+            int j_0 = 0;
+            while (j_0 < weight_mask.cols && !(row[j_0] > threshold)) {
+                j_0++;
+            }
+            int j_1 = weight_mask.cols;
+            while (j_1 > j_0 && !(row[j_1 - 1] > threshold)) {
+                j_1--;
+            }
+            spans.begin[k * spans.rows + i] = j_0;
+            spans.end[k * spans.rows + i] = j_1;
+            spans.total_weight += float(j_1 - j_0) / rings;
+        }
+    }
+    return spans;
+}
+
 std::vector<Vector2f> calculate_ellipse_normals(const float radius_x,
         const float radius_y, const int angle_step)
 {
@@ -353,3 +394,25 @@ float ellipse_contour_test(const cv::Point &center, const float radius_x, const
     return dot_sum / (total_vectors * 4);
 }
 
+// ellipse_contour_test (gradient magnitude aware) over tiled gradient images.
+float ellipse_contour_test(const cv::Point &center, const float radius_x, const float radius_y,
+                           const std::vector<Vector2f> &normal_vectors,
+                           const TiledImage<cv::Vec2f> &gradient_vectors, const TiledImage<float> &gradient_magnitude)
+{
+    const int total_vectors = normal_vectors.size();
+    float dot_sum = 0;
+    for (int i = 0; i < total_vectors; i++) {
+        const float v_x = normal_vectors[i][0];
+        const float v_y = normal_vectors[i][1];
+        const Vector2f samples[] = {Vector2f(v_x, v_y), Vector2f(-v_x, -v_y), Vector2f(-v_y, v_x), Vector2f(v_y, -v_x)};
+        for (const Vector2f &v : samples) {
+            const int pixel_coordinates_x = center.x + cvRound(v[0] * radius_x);
+            const int pixel_coordinates_y = center.y + cvRound(v[1] * radius_y);
+            const cv::Vec2f &gradient = gradient_vectors.at(pixel_coordinates_y, pixel_coordinates_x);
+            const float magnitude = gradient_magnitude.at(pixel_coordinates_y, pixel_coordinates_x);
+            dot_sum += magnitude * std::abs(gradient[0] * v[0] + gradient[1] * v[1]);
+        }
+    }
+
+    return dot_sum / (total_vectors * 4);
+}
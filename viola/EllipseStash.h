@@ -1,6 +1,8 @@
 #pragma once
 #include <tuple>
 #include <map>
+#include <vector>
+#include <cassert>
 
 using namespace std;
 
@@ -8,6 +10,11 @@ using namespace std;
 #include "EllipseFunctions.h"
 #include "ImageRegistration.h"
 #include "ModelParameters.h"
+
+// depths (mm) covered by the head to torso offset table
+constexpr int TORSO_OFFSET_TABLE_DEPTHS = 8192;
+// depths (mm) the ellipses are prepared for, deeper lookups get the farthest ones
+constexpr int ELLIPSE_STASH_DEPTHS = 5000;
 /*
 enum class BodyPart
 {
@@ -50,20 +57,52 @@ enum class BodyPart {
 };
 
 
+// The ellipses of a body part are looked up by depth rounded to mm and clamped to [0, ELLIPSE_STASH_DEPTHS). Once
+// prepare() ran for a part every depth of that range is in its tables, so its lookups never insert and the
+// particle filter workers can share the stash.
 class EllipseStash
 {
 public:
     using EllipseData = std::tuple<cv::Mat, cv::Mat, cv::Mat, int>;
     using EllipseDepthMap = std::map<int, EllipseData>;
+    using PyramidEllipseData = std::pair<int, cv::Mat>;
+    using PyramidEllipseDepthTable = std::vector<PyramidEllipseData>;
+    using EllipseSpansDepthTable = std::vector<EllipseSpans>;
+
+    static inline int stash_depth(const float depth)
+    {
+        return std::min(std::max(cvRound(depth), 0), ELLIPSE_STASH_DEPTHS - 1);
+    };
+
+    // builds what is missing of a part, not thread safe
+    inline void prepare(const BodyPart part)
+    {
+        for (int z = 0; z < ELLIPSE_STASH_DEPTHS; z++) {
+            get_ellipse(part, z);
+        }
+        PyramidEllipseDepthTable &pyramid_table = body_part_pyramid_ellipses[part];
+        EllipseSpansDepthTable &spans_table = body_part_ellipse_spans[part];
+        pyramid_table.resize(ELLIPSE_STASH_DEPTHS);
+        spans_table.resize(ELLIPSE_STASH_DEPTHS);
+        for (int z = 0; z < ELLIPSE_STASH_DEPTHS; z++) {
+            pyramid_table[z] = build_pyramid_ellipse(part, z);
+            spans_table[z] = compute_ellipse_spans(get_ellipse_mask_weights(part, z), LIKELIHOOD_BACK_PROJECTION_RINGS);
+        }
+    };
 
     inline EllipseData &get_ellipse(const BodyPart part, const float depth)
     {
-        const int depth_rounded = cvRound(depth);
-        EllipseDepthMap &part_map = body_part_ellipses[part];
+        const int depth_rounded = stash_depth(depth);
+        std::map<BodyPart, EllipseDepthMap>::iterator part_it = body_part_ellipses.find(part);
+        if (part_it == body_part_ellipses.end()) {
+            part_it = body_part_ellipses.insert(std::make_pair(part, EllipseDepthMap())).first;
+        }
+        EllipseDepthMap &part_map = part_it->second;
         EllipseDepthMap::iterator it = part_map.find(depth_rounded);
         if (it == part_map.end()){
+            // only before prepare(part)
             EllipseData &d = part_map[depth_rounded];
-            d = build_ellipse(part, depth);
+            d = build_ellipse(part, depth_rounded);
 
             //printf("%s MODELO NUEVO %d\n", BodyPart_description[(int)part], depth_rounded);
             return d;
@@ -111,10 +150,51 @@ public:
         return cv::Size(m.cols, m.rows);
     };
 
+    // Pyramid level at which the ellipse of a given depth is evaluated, so that no ellipse covers much more than
+    // LIKELIHOOD_PYRAMID_MAX_PIXELS, and the mask weights decimated to that level. Kept apart from the
+    // serialized EllipseData, built by prepare().
+    inline const PyramidEllipseData &get_pyramid_ellipse(const BodyPart part, const float depth) const
+    {
+        return body_part_pyramid_ellipses.at(part)[stash_depth(depth)];
+    };
+
+    inline int get_pyramid_level(const BodyPart part, const float depth) const
+    {
+        return get_pyramid_ellipse(part, depth).first;
+    };
+
+    inline const cv::Mat &get_pyramid_ellipse_mask_weights(const BodyPart part, const float depth) const
+    {
+        return get_pyramid_ellipse(part, depth).second;
+    };
+
+    // ring spans of the weight mask, for the back-projection colour likelihood, built by prepare()
+    inline const EllipseSpans &get_ellipse_spans(const BodyPart part, const float depth) const
+    {
+        return body_part_ellipse_spans.at(part)[stash_depth(depth)];
+    };
+
+
+    // Pixel offset from a head center to the center of its torso (HEAD_TO_TORSE_CENTER_VECTOR) at a given depth.
+    // The translation has no z component, so after back-projecting, translating and projecting the offset is
+    // f * t / depth on both axes whatever the pixel is: one entry per mm of depth.
+    inline cv::Point get_torso_offset(const float depth) const
+    {
+        const int depth_rounded = std::max(1, cvRound(depth));
+        if (depth_rounded < int(torso_offsets.size())) {
+            return torso_offsets[depth_rounded];
+        }
+        return build_torso_offset(depth_rounded);
+    };
 
     inline EllipseStash(const ImageRegistration &r)
     {
         reg = r;
+        assert(HEAD_TO_TORSE_CENTER_VECTOR[2] == 0);
+        torso_offsets.resize(TORSO_OFFSET_TABLE_DEPTHS);
+        for (int depth = 1; depth < TORSO_OFFSET_TABLE_DEPTHS; depth++) {
+            torso_offsets[depth] = build_torso_offset(depth);
+        }
     }
 
 protected:
@@ -124,12 +204,9 @@ protected:
         const float model_semiaxis_x = (part == BodyPart::TORSO) ? PERSON_TORSO_X_AXIS_METTERS : PERSON_HEAD_X_SEMIAXIS_METTERS;
         const float model_semiaxis_y = (part == BodyPart::TORSO) ? PERSON_TORSO_Y_AXIS_METTERS : PERSON_HEAD_Y_SEMIAXIS_METTERS;
 
-        const float cx = reg.cameraMatrix.at<double>(0, 2);
-        const float cy = reg.cameraMatrix.at<double>(1, 2);
-
         Eigen::Vector2i top_corner, bottom_corner;
-        std::tie(top_corner, bottom_corner) = project_model(Eigen::Vector2f(cx, cy), depth,
-                                          Eigen::Vector2f(model_semiaxis_x, model_semiaxis_y), reg.cameraMatrix,
+        std::tie(top_corner, bottom_corner) = project_model(Eigen::Vector2f(reg.intrinsics.cx, reg.intrinsics.cy), depth,
+                                          Eigen::Vector2f(model_semiaxis_x, model_semiaxis_y), reg.intrinsics,
                                           reg.lookupX, reg.lookupY);
         int n_pixels;
         cv::Rect region = cv::Rect(top_corner[0], top_corner[1], bottom_corner[0] - top_corner[0],
@@ -142,7 +219,45 @@ protected:
         return make_tuple(e1d, e3d, ew1d, n_pixels);
     };
 
+    inline cv::Point build_torso_offset(const int depth) const
+    {
+        const float depth_metters = depth / 1000.0f;
+        return cv::Point(cvRound(reg.intrinsics.fx * HEAD_TO_TORSE_CENTER_VECTOR[0] / depth_metters),
+                         cvRound(reg.intrinsics.fy * HEAD_TO_TORSE_CENTER_VECTOR[1] / depth_metters));
+    };
+
+    inline PyramidEllipseData build_pyramid_ellipse(const BodyPart part, const int depth)
+    {
+        const EllipseData &e = get_ellipse(part, depth);
+        const cv::Mat &weights = get<2>(e);
+        const int n_pixels = get<3>(e);
+
+        int level = 0;
+        while (level < LIKELIHOOD_PYRAMID_LEVELS - 1 && (n_pixels >> (2 * level)) > LIKELIHOOD_PYRAMID_MAX_PIXELS) {
+            level++;
+        }
+
+        if (level == 0) {
+            return make_pair(0, weights);
+        }
+
+        // same sampling as compute_color_bin_pyramid
+        const int step = 1 << level;
+        cv::Mat level_weights((weights.rows + step - 1) / step, (weights.cols + step - 1) / step, CV_32FC1);
+        for (int i = 0; i < level_weights.rows; i++) {
+            const float *src = weights.ptr<float>(i * step);
+            float *dst = level_weights.ptr<float>(i);
+            for (int j = 0; j < level_weights.cols; j++) {
+                dst[j] = src[j * step];
+            }
+        }
+        return make_pair(level, level_weights);
+    };
+
     std::map<BodyPart, EllipseDepthMap> body_part_ellipses;
+    std::map<BodyPart, PyramidEllipseDepthTable> body_part_pyramid_ellipses;
+    std::map<BodyPart, EllipseSpansDepthTable> body_part_ellipse_spans;
+    std::vector<cv::Point> torso_offsets;
     ImageRegistration reg;
 };
 
@@ -175,10 +290,10 @@ public:
                 ifs.close();
             } else {
                 std::cout << "Generating ellipses for body part: " << BodyPart_description[(int)parts[i]] << std::endl;
-                for (int z = 0; z < 5000; z++){
-                    this->get_ellipse(parts[i], z);
-                }
             }
+
+            // fills the depths missing from the file too
+            this->prepare(parts[i]);
         }
     };
 };
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "project_config.h"
+
+IGNORE_WARNINGS_PUSH
+
+#include <dlib/opencv.h>
+#include <dlib/image_processing/frontal_face_detector.h>
+#include <mrpt/otherlibs/do_opencv_includes.h>
+#include <opencv2/ocl/ocl.hpp>
+
+IGNORE_WARNINGS_POP
+
+#include "FacesDetection.h"
+
+struct FaceDetection
+{
+    size_t frame;
+    // time of the frame the faces were detected on, seconds
+    double time;
+    std::vector<cv::Rect> faces;
+    // the frames the faces were detected on, to start the trackers from: with the detection some frames old,
+    // the current ones no longer show the heads where the rects are
+    cv::Mat color_frame;
+    cv::Mat depth_frame;
+};
+
+// Runs the face detection (Haar cascades confirmed by dlib, viola_faces::detect_faces_dual) on its own thread, so
+// the tracking of a frame never waits for it. The tracking loop offers every frame with submit(); a frame is taken
+// only when the worker is idle, at least interval frames came since the last detection, and the depth foreground
+// changed in more than motion_threshold of its pixels since then (or max_interval frames went by, to catch people
+// who came in still). The finished detections are collected with poll() and carry the frame, time and images they
+// were computed on, so the caller can tell how old they are and build the models from the frame they belong to.
+//
+// The stage has its own cascades and dlib detector: they keep per-call state and cannot be shared with the thread
+// submitting the frames.
+class FaceDetectionStage
+{
+public:
+    FaceDetectionStage(const std::string &face_cascade_name, const std::string &eyes_cascade_name, const int interval,
+                       const int max_interval, const float motion_threshold);
+    ~FaceDetectionStage();
+
+    // color_frame: BGR frame the tracking works on; depth_frame: its registered depth, handed back with the faces;
+    // foreground_mask: CV_8UC1, non zero on the foreground. Returns whether the frame was taken.
+    bool submit(const size_t frame, const double time, const cv::Mat &color_frame, const cv::Mat &depth_frame,
+                const cv::Mat &foreground_mask);
+
+    // false once the finished detections are all taken
+    bool poll(FaceDetection &detection);
+
+    void report() const;
+
+protected:
+    void run();
+    bool foreground_changed(const cv::Mat &foreground_mask) const;
+
+    cv::ocl::OclCascadeClassifier face_cascade;
+    cv::ocl::OclCascadeClassifier eyes_cascade;
+    dlib::frontal_face_detector dlib_detector;
+
+    const int interval;
+    const int max_interval;
+    const float motion_threshold;
+    // frame and foreground of the last detection submitted
+    size_t last_frame;
+    bool submitted;
+    cv::Mat last_foreground;
+
+    // the frame being detected, owned by the worker while busy
+    bool busy;
+    bool stopping;
+    FaceDetection job;
+    std::deque<FaceDetection> done;
+    std::mutex mutex;
+    std::condition_variable job_ready;
+    std::thread worker;
+
+    size_t offered;
+    size_t detections;
+    size_t skipped_busy;
+    size_t skipped_still;
+    double detection_seconds;
+};
+
+FaceDetectionStage::FaceDetectionStage(const std::string &face_cascade_name, const std::string &eyes_cascade_name,
+                                       const int interval, const int max_interval, const float motion_threshold) :
+    interval(std::max(1, interval)),
+    max_interval(std::max(interval, max_interval)),
+    motion_threshold(motion_threshold),
+    last_frame(0),
+    submitted(false),
+    busy(false),
+    stopping(false),
+    offered(0),
+    detections(0),
+    skipped_busy(0),
+    skipped_still(0),
+    detection_seconds(0)
+{
+    if (!face_cascade.load(face_cascade_name) || !eyes_cascade.load(eyes_cascade_name)) {
+        std::cout << "The face detection cascades couldn't be loaded." << std::endl;
+        std::cout << face_cascade_name << std::endl;
+        std::cout << eyes_cascade_name << std::endl;
+        exit(-1);
+    }
+    dlib_detector = dlib::get_frontal_face_detector();
+    worker = std::thread(&FaceDetectionStage::run, this);
+}
+
+FaceDetectionStage::~FaceDetectionStage()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    job_ready.notify_all();
+    worker.join();
+}
+
+bool FaceDetectionStage::foreground_changed(const cv::Mat &foreground_mask) const
+{
+    if (foreground_mask.empty() || last_foreground.size() != foreground_mask.size()) {
+        return true;
+    }
+    cv::Mat changed;
+    cv::bitwise_xor(foreground_mask, last_foreground, changed);
+    return cv::countNonZero(changed) > motion_threshold * foreground_mask.total();
+}
+
+bool FaceDetectionStage::submit(const size_t frame, const double time, const cv::Mat &color_frame,
+                                const cv::Mat &depth_frame, const cv::Mat &foreground_mask)
+{
+    offered++;
+    if (submitted) {
+        const size_t since = frame - last_frame;
+        if (since < size_t(interval)) {
+            return false;
+        }
+        if (since < size_t(max_interval) && !foreground_changed(foreground_mask)) {
+            skipped_still++;
+            return false;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (busy) {
+            skipped_busy++;
+            return false;
+        }
+        busy = true;
+        job.frame = frame;
+        job.time = time;
+        job.faces.clear();
+        // the caller keeps drawing on its frames, and the finished detections share theirs with the caller
+        job.color_frame = color_frame.clone();
+        job.depth_frame = depth_frame.clone();
+    }
+    job_ready.notify_one();
+
+    last_frame = frame;
+    submitted = true;
+    foreground_mask.copyTo(last_foreground);
+    return true;
+}
+
+bool FaceDetectionStage::poll(FaceDetection &detection)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (done.empty()) {
+        return false;
+    }
+    detection = std::move(done.front());
+    done.pop_front();
+    return true;
+}
+
+void FaceDetectionStage::run()
+{
+    cv::Mat display_frame;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_ready.wait(lock, [this]() { return busy || stopping; });
+            if (stopping) {
+                return;
+            }
+        }
+
+        const uint64_t t0 = cv::getTickCount();
+        // same region as the tracking loop used: the upper three quarters of the frame
+        cv::ocl::oclMat ocl_color_frame(job.color_frame);
+        cv::ocl::oclMat ocl_gray_frame;
+        cv::ocl::cvtColor(ocl_color_frame, ocl_gray_frame, cv::COLOR_BGR2GRAY);
+        const cv::ocl::oclMat ocl_gray_frame_upper = ocl_gray_frame(cv::Rect(0, 0, ocl_gray_frame.cols, ocl_gray_frame.rows * 0.75));
+        // the boxes it draws are not shown, the caller draws the faces once merged
+        job.color_frame.copyTo(display_frame);
+        std::vector<cv::Rect> faces = viola_faces::detect_faces_dual(ocl_gray_frame_upper, face_cascade, eyes_cascade, 1,
+                                                                     dlib_detector, job.color_frame, display_frame);
+        const double t = (cv::getTickCount() - t0) / cv::getTickFrequency();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        job.faces = std::move(faces);
+        done.push_back(job);
+        busy = false;
+        detections++;
+        detection_seconds += t;
+    }
+}
+
+void FaceDetectionStage::report() const
+{
+    std::cout << "FACE_DETECTION_OFFERED " << offered << std::endl;
+    std::cout << "FACE_DETECTION_RUNS " << detections << std::endl;
+    std::cout << "FACE_DETECTION_SKIPPED_BUSY " << skipped_busy << std::endl;
+    std::cout << "FACE_DETECTION_SKIPPED_STILL " << skipped_still << std::endl;
+    std::cout << "FACE_DETECTION_MEAN_TIME " << (detections ? detection_seconds / detections : 0) << std::endl;
+}
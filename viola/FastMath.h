@@ -0,0 +1,107 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cmath>
+#include <limits>
+
+#include <smmintrin.h>
+
+// Batch float exp/log for the particle weights, 4 lanes at a time
+// Cephes single precision expf/logf reductions and polynomials, as arranged for SSE in
+// sse_mathfun (Julien Pommier, zlib licence).
+//
+// exp_ps: relative error below 2e-7 for x in [-87, 88], inputs are clamped to +-88.376 and the lower end
+//         underflows to 0.
+// log_ps: relative error below 2e-7 for positive normal inputs, -inf for x <= 0 (like log(0)); positive
+//         subnormals are taken as the smallest normal. NaN inputs are outside the domain (the build uses fast-math).
+// The scalar tails of the batches follow the same rules, so a value doesn't depend on its position.
+// Enough for log-weights, whose differences are what matters after normalization.
+
+inline __m128 exp_ps(__m128 x)
+{
+    const __m128 one = _mm_set1_ps(1.f);
+    x = _mm_min_ps(x, _mm_set1_ps(88.3762626647949f));
+    x = _mm_max_ps(x, _mm_set1_ps(-88.3762626647949f));
+
+    // x = n * ln(2) + r, with ln(2) split in two constants to keep r exact
+    const __m128 n = _mm_floor_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)), _mm_set1_ps(0.5f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+
+    __m128 y = _mm_set1_ps(1.9875691500E-4f);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507E-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073E-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894E-2f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, _mm_mul_ps(x, x)), _mm_add_ps(x, one));
+
+    // 2^n built in the exponent bits
+    const __m128i pow2n = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(0x7f)), 23);
+    return _mm_mul_ps(y, _mm_castsi128_ps(pow2n));
+}
+
+inline __m128 log_ps(__m128 x)
+{
+    const __m128 one = _mm_set1_ps(1.f);
+    const __m128 valid = _mm_cmpgt_ps(x, _mm_setzero_ps());
+    x = _mm_max_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x00800000)));
+
+    // x = 2^e * m, m in [0.5, 1)
+    __m128i e_bits = _mm_srli_epi32(_mm_castps_si128(x), 23);
+    x = _mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(~0x7f800000)));
+    x = _mm_or_ps(x, _mm_set1_ps(0.5f));
+    e_bits = _mm_sub_epi32(e_bits, _mm_set1_epi32(0x7f));
+    __m128 e = _mm_add_ps(_mm_cvtepi32_ps(e_bits), one);
+
+    // m in [sqrt(1/2), sqrt(2)): if m < sqrt(1/2) use 2m - 1 and e - 1, otherwise m - 1
+    const __m128 mask = _mm_cmplt_ps(x, _mm_set1_ps(0.707106781186547524f));
+    const __m128 tmp = _mm_and_ps(x, mask);
+    x = _mm_sub_ps(x, one);
+    e = _mm_sub_ps(e, _mm_and_ps(one, mask));
+    x = _mm_add_ps(x, tmp);
+
+    const __m128 z = _mm_mul_ps(x, x);
+    __m128 y = _mm_set1_ps(7.0376836292E-2f);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.1514610310E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.1676998740E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.2420140846E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.4249322787E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-1.6668057665E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(2.0000714765E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(-2.4999993993E-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(3.3333331174E-1f));
+    y = _mm_mul_ps(_mm_mul_ps(y, x), z);
+
+    y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(-2.12194440e-4f)));
+    y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+    x = _mm_add_ps(x, y);
+    x = _mm_add_ps(x, _mm_mul_ps(e, _mm_set1_ps(0.693359375f)));
+    return _mm_blendv_ps(_mm_set1_ps(-std::numeric_limits<float>::infinity()), x, valid);
+}
+
+// out[i] = exp(in[i]); in and out may alias
+inline void exp_batch(const float * const in, float * const out, const size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(out + i, exp_ps(_mm_loadu_ps(in + i)));
+    }
+    for (; i < n; i++) {
+        out[i] = std::exp(in[i]);
+    }
+}
+
+// out[i] = log(in[i]); in and out may alias
+inline void log_batch(const float * const in, float * const out, const size_t n)
+{
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(out + i, log_ps(_mm_loadu_ps(in + i)));
+    }
+    for (; i < n; i++) {
+        out[i] = in[i] > 0 ? std::log(std::max(in[i], std::numeric_limits<float>::min())) :
+                             -std::numeric_limits<float>::infinity();
+    }
+}
@@ -0,0 +1,401 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <opencv2/opencv.hpp>
+
+// Shares the frames of one sensor between processes through a POSIX shared memory object (/dev/shm/<name>):
+//
+//   FrameBusHeader
+//   slots x (FrameBusSlot, colour CV_8UC3, depth CV_32FC1 mm), each slot FRAME_BUS_ALIGNMENT aligned
+//
+// One FrameBusWriter publishes frame k into slot k % slots under a seqlock: the slot sequence is 2 k + 1 while the
+// frame is written and 2 k + 2 once it is complete, then the published count becomes k + 1 and the futex word is
+// bumped to wake the readers. Readers never write to the bus, so any number of them can map it read-only: they
+// take the newest published frame and check its sequence before (and after, for copies) using it. A reader that is
+// slots - 1 frames behind sees its frame overwritten, which the sequence tells.
+//
+// The writer unlinks the object when it closes; the readers keep their mapping until they close theirs.
+
+constexpr char FRAME_BUS_MAGIC[4] = {'K', '2', 'F', 'B'};
+constexpr uint32_t FRAME_BUS_VERSION = 1;
+constexpr size_t FRAME_BUS_SLOTS = 4;
+constexpr size_t FRAME_BUS_ALIGNMENT = 4096;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "the bus atomics are shared between processes and must be lock free");
+
+struct FrameBusHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t slots;
+    uint32_t reserved;
+    int32_t color_width;
+    int32_t color_height;
+    int32_t depth_width;
+    int32_t depth_height;
+    uint64_t slot_bytes;
+    char serial[32];
+
+    // frames published, the newest is published - 1
+    std::atomic<uint64_t> published;
+    // bumped after every frame and on close, the readers wait on it
+    std::atomic<uint32_t> futex;
+    std::atomic<uint32_t> closed;
+};
+
+struct FrameBusSlot
+{
+    // 2 k + 1 while frame k is written, 2 k + 2 once complete
+    std::atomic<uint64_t> sequence;
+    uint64_t index;
+    uint64_t timestamp_us;
+};
+
+namespace frame_bus
+{
+
+inline size_t align(const size_t bytes)
+{
+    return (bytes + FRAME_BUS_ALIGNMENT - 1) / FRAME_BUS_ALIGNMENT * FRAME_BUS_ALIGNMENT;
+}
+
+inline size_t color_bytes(const FrameBusHeader &header)
+{
+    return size_t(header.color_width) * header.color_height * 3;
+}
+
+inline size_t depth_bytes(const FrameBusHeader &header)
+{
+    return size_t(header.depth_width) * header.depth_height * sizeof(float);
+}
+
+// shm_open names start with a slash
+inline std::string shm_name(const std::string &name)
+{
+    return name.empty() || name[0] != '/' ? '/' + name : name;
+}
+
+inline void futex_wake(std::atomic<uint32_t> &word)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// returns when word differs from value, on a wake up or after timeout_ms
+inline void futex_wait(const std::atomic<uint32_t> &word, const uint32_t value, const int timeout_ms)
+{
+    const timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+    syscall(SYS_futex, reinterpret_cast<const uint32_t *>(&word), FUTEX_WAIT, value, &timeout, nullptr, 0);
+}
+
+}
+
+class FrameBusWriter
+{
+public:
+    FrameBusWriter() :
+        header(nullptr), size(0)
+    {
+        ;
+    };
+
+    ~FrameBusWriter()
+    {
+        close();
+    };
+
+    FrameBusWriter(const FrameBusWriter &) = delete;
+    FrameBusWriter &operator=(const FrameBusWriter &) = delete;
+
+    // replaces any bus of the same name; its readers keep the old one until they reopen
+    bool open(const std::string &name, const std::string &serial, const cv::Size &color_size, const cv::Size &depth_size,
+              const size_t slots = FRAME_BUS_SLOTS)
+    {
+        close();
+        this->name = frame_bus::shm_name(name);
+        shm_unlink(this->name.c_str());
+        const int fd = shm_open(this->name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0) {
+            std::cerr << "Can't create the frame bus " << this->name << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        FrameBusHeader layout;
+        layout.color_width = color_size.width;
+        layout.color_height = color_size.height;
+        layout.depth_width = depth_size.width;
+        layout.depth_height = depth_size.height;
+        const size_t slot_bytes = frame_bus::align(sizeof(FrameBusSlot)) + frame_bus::align(frame_bus::color_bytes(layout)) +
+                                  frame_bus::align(frame_bus::depth_bytes(layout));
+        size = frame_bus::align(sizeof(FrameBusHeader)) + slots * slot_bytes;
+        void *mapping = MAP_FAILED;
+        if (!ftruncate(fd, size)) {
+            mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            std::cerr << "Can't map the frame bus " << this->name << ": " << strerror(errno) << std::endl;
+            shm_unlink(this->name.c_str());
+            size = 0;
+            return false;
+        }
+
+        // the object is zero filled, so the sequences start at 0: no frame
+        header = new (mapping) FrameBusHeader;
+        std::memcpy(header->magic, FRAME_BUS_MAGIC, sizeof(FRAME_BUS_MAGIC));
+        header->version = FRAME_BUS_VERSION;
+        header->slots = slots;
+        header->reserved = 0;
+        header->color_width = color_size.width;
+        header->color_height = color_size.height;
+        header->depth_width = depth_size.width;
+        header->depth_height = depth_size.height;
+        header->slot_bytes = slot_bytes;
+        std::strncpy(header->serial, serial.c_str(), sizeof(header->serial) - 1);
+        header->published.store(0);
+        header->futex.store(0);
+        header->closed.store(0);
+        return true;
+    };
+
+    // wakes the readers up, they see the bus closed
+    void close()
+    {
+        if (header) {
+            header->closed.store(1, std::memory_order_release);
+            header->futex.fetch_add(1, std::memory_order_release);
+            frame_bus::futex_wake(header->futex);
+            munmap(header, size);
+            shm_unlink(name.c_str());
+        }
+        header = nullptr;
+        size = 0;
+    };
+
+    // color: CV_8UC3, depth: CV_32FC1, of the sizes of the bus
+    void publish(const cv::Mat &color, const cv::Mat &depth, const uint64_t timestamp_us)
+    {
+        assert(header && color.type() == CV_8UC3 && depth.type() == CV_32FC1);
+        assert(color.cols == header->color_width && color.rows == header->color_height);
+        assert(depth.cols == header->depth_width && depth.rows == header->depth_height);
+
+        const uint64_t k = header->published.load(std::memory_order_relaxed);
+        FrameBusSlot &slot = get_slot(k);
+        slot.sequence.store(2 * k + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.index = k;
+        slot.timestamp_us = timestamp_us;
+        copy_rows(color, get_color(slot));
+        copy_rows(depth, get_depth(slot));
+        slot.sequence.store(2 * k + 2, std::memory_order_release);
+
+        header->published.store(k + 1, std::memory_order_release);
+        header->futex.fetch_add(1, std::memory_order_release);
+        frame_bus::futex_wake(header->futex);
+    };
+
+    bool is_open() const
+    {
+        return header;
+    };
+
+protected:
+    FrameBusSlot &get_slot(const uint64_t k)
+    {
+        uint8_t *slots = reinterpret_cast<uint8_t *>(header) + frame_bus::align(sizeof(FrameBusHeader));
+        return *reinterpret_cast<FrameBusSlot *>(slots + (k % header->slots) * header->slot_bytes);
+    };
+
+    uint8_t *get_color(FrameBusSlot &slot)
+    {
+        return reinterpret_cast<uint8_t *>(&slot) + frame_bus::align(sizeof(FrameBusSlot));
+    };
+
+    uint8_t *get_depth(FrameBusSlot &slot)
+    {
+        return get_color(slot) + frame_bus::align(frame_bus::color_bytes(*header));
+    };
+
+    static void copy_rows(const cv::Mat &image, uint8_t *out)
+    {
+        const size_t row_bytes = image.cols * image.elemSize();
+        if (image.isContinuous()) {
+            std::memcpy(out, image.data, row_bytes * image.rows);
+            return;
+        }
+        for (int i = 0; i < image.rows; i++) {
+            std::memcpy(out + i * row_bytes, image.ptr(i), row_bytes);
+        }
+    };
+
+    std::string name;
+    FrameBusHeader *header;
+    size_t size;
+};
+
+class FrameBusReader
+{
+public:
+    FrameBusReader() :
+        header(nullptr), size(0)
+    {
+        ;
+    };
+
+    ~FrameBusReader()
+    {
+        close();
+    };
+
+    FrameBusReader(const FrameBusReader &) = delete;
+    FrameBusReader &operator=(const FrameBusReader &) = delete;
+
+    bool open(const std::string &name)
+    {
+        close();
+        const std::string shm_name = frame_bus::shm_name(name);
+        const int fd = shm_open(shm_name.c_str(), O_RDONLY, 0);
+        if (fd < 0) {
+            std::cerr << "Can't open the frame bus " << shm_name << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        struct stat bus_stat;
+        if (fstat(fd, &bus_stat) || size_t(bus_stat.st_size) < sizeof(FrameBusHeader)) {
+            std::cerr << shm_name << " is not a frame bus." << std::endl;
+            ::close(fd);
+            return false;
+        }
+        size = bus_stat.st_size;
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            std::cerr << "Can't map the frame bus " << shm_name << '.' << std::endl;
+            size = 0;
+            return false;
+        }
+        header = static_cast<const FrameBusHeader *>(mapping);
+        if (std::memcmp(header->magic, FRAME_BUS_MAGIC, sizeof(FRAME_BUS_MAGIC)) || header->version != FRAME_BUS_VERSION ||
+            frame_bus::align(sizeof(FrameBusHeader)) + header->slots * header->slot_bytes > size) {
+            std::cerr << shm_name << " is not a frame bus." << std::endl;
+            close();
+            return false;
+        }
+        return true;
+    };
+
+    void close()
+    {
+        if (header) {
+            munmap(const_cast<FrameBusHeader *>(header), size);
+        }
+        header = nullptr;
+        size = 0;
+    };
+
+    // waits up to timeout_ms for a frame newer than after (published count); returns the published count, which is
+    // after on a time out and when the bus is closed
+    uint64_t wait(const uint64_t after, const int timeout_ms) const
+    {
+        const uint32_t futex = header->futex.load(std::memory_order_acquire);
+        const uint64_t published = header->published.load(std::memory_order_acquire);
+        if (published > after || is_closed()) {
+            return published;
+        }
+        frame_bus::futex_wait(header->futex, futex, timeout_ms);
+        return header->published.load(std::memory_order_acquire);
+    };
+
+    // zero copy views of frame k, read-only; false if it was overwritten. They stay valid while is_intact(k).
+    bool view(const uint64_t k, cv::Mat &color, cv::Mat &depth, uint64_t &timestamp_us) const
+    {
+        const FrameBusSlot &slot = get_slot(k);
+        if (slot.sequence.load(std::memory_order_acquire) != 2 * k + 2) {
+            return false;
+        }
+        timestamp_us = slot.timestamp_us;
+        color = cv::Mat(header->color_height, header->color_width, CV_8UC3, const_cast<uint8_t *>(get_color(slot)));
+        depth = cv::Mat(header->depth_height, header->depth_width, CV_32FC1, const_cast<uint8_t *>(get_depth(slot)));
+        return is_intact(k);
+    };
+
+    // owned copies of frame k; false if it was overwritten, before or while copying
+    bool copy(const uint64_t k, cv::Mat &color, cv::Mat &depth, uint64_t &timestamp_us) const
+    {
+        cv::Mat color_view, depth_view;
+        if (!view(k, color_view, depth_view, timestamp_us)) {
+            return false;
+        }
+        color_view.copyTo(color);
+        depth_view.copyTo(depth);
+        return is_intact(k);
+    };
+
+    // after reading the views: the reads are ordered before the sequence check
+    bool is_intact(const uint64_t k) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return get_slot(k).sequence.load(std::memory_order_relaxed) == 2 * k + 2;
+    };
+
+    uint64_t get_published() const
+    {
+        return header->published.load(std::memory_order_acquire);
+    };
+
+    bool is_closed() const
+    {
+        return header->closed.load(std::memory_order_acquire);
+    };
+
+    bool is_open() const
+    {
+        return header;
+    };
+
+    std::string get_serial() const
+    {
+        return std::string(header->serial, strnlen(header->serial, sizeof(header->serial)));
+    };
+
+    size_t get_slots() const
+    {
+        return header->slots;
+    };
+
+protected:
+    const FrameBusSlot &get_slot(const uint64_t k) const
+    {
+        const uint8_t *slots = reinterpret_cast<const uint8_t *>(header) + frame_bus::align(sizeof(FrameBusHeader));
+        return *reinterpret_cast<const FrameBusSlot *>(slots + (k % header->slots) * header->slot_bytes);
+    };
+
+    const uint8_t *get_color(const FrameBusSlot &slot) const
+    {
+        return reinterpret_cast<const uint8_t *>(&slot) + frame_bus::align(sizeof(FrameBusSlot));
+    };
+
+    const uint8_t *get_depth(const FrameBusSlot &slot) const
+    {
+        return get_color(slot) + frame_bus::align(frame_bus::color_bytes(*header));
+    };
+
+    const FrameBusHeader *header;
+    size_t size;
+};
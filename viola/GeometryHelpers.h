@@ -8,7 +8,10 @@ IGNORE_WARNINGS_PUSH
 
 IGNORE_WARNINGS_POP
 
+#include <smmintrin.h>
+
 #include "project_config.h"
+#include "CameraIntrinsics.h"
 
 using namespace Eigen;
 
@@ -33,15 +36,12 @@ std::vector<Vector3f> points_3D_reprojection(const std::vector<Vector2f> &points
 template<typename DEPTH_DATA_TYPE>
 cv::Mat depth_3D_reprojection(const cv::Mat &depth, const float inv_fx, const float inv_fy, const float cx, const float cy);
 
-template<typename DEPTH_TYPE>
-cv::Mat depth_3D_reprojection(const cv::Mat &depth, const cv::Mat &cameraMatrix);
-
 template<typename DEPTH_DATA_TYPE>
 inline std::tuple<Vector2i, Vector2i> project_model(const Vector2f &model_center, const cv::Mat &depth, const Vector2f &model_semi_axes,
-    const cv::Mat &cameraMatrix, const cv::Mat &lookupX, const cv::Mat &lookupY);
+    const CameraIntrinsics &intrinsics, const cv::Mat &lookupX, const cv::Mat &lookupY);
 
 std::tuple<Vector2i, Vector2i> project_model(const Vector2f &model_center, const float depth, const Vector2f &model_semi_axes,
-    const cv::Mat &cameraMatrix, const cv::Mat &lookupX, const cv::Mat &lookupY);
+    const CameraIntrinsics &intrinsics, const cv::Mat &lookupX, const cv::Mat &lookupY);
 
 inline Vector3f pixel_depth_to_3D_coordiantes(const float x, const float y, const float depth,
     const double inv_fx, const double inv_fy, const float cx, const float cy)
@@ -63,22 +63,14 @@ inline Vector3f pixel_depth_to_3D_coordiantes(const Vector2f &v, const float dep
     return pixel_depth_to_3D_coordiantes(v[0], v[1], depth, inv_fx, inv_fy, cx, cy);
 }
 
-inline Vector3f pixel_depth_to_3D_coordiantes(const float x, const float y, const float z, const cv::Mat &cameraMatrix)
+inline Vector3f pixel_depth_to_3D_coordiantes(const float x, const float y, const float depth, const CameraIntrinsics &intrinsics)
 {
-    const float inv_fx = 1.0f / cameraMatrix.at<double>(0, 0);
-    const float inv_fy = 1.0f / cameraMatrix.at<double>(1, 1);
-    const float cx = cameraMatrix.at<double>(0, 2);
-    const float cy = cameraMatrix.at<double>(1, 2);
-    return pixel_depth_to_3D_coordiantes(x, y, z, inv_fx, inv_fy, cx, cy);
+    return pixel_depth_to_3D_coordiantes(x, y, depth, intrinsics.inv_fx, intrinsics.inv_fy, intrinsics.cx, intrinsics.cy);
 }
 
-inline Vector3f pixel_depth_to_3D_coordiantes(const Vector3f &v, const cv::Mat &cameraMatrix)
+inline Vector3f pixel_depth_to_3D_coordiantes(const Vector3f &v, const CameraIntrinsics &intrinsics)
 {
-    const float inv_fx = 1.0f / cameraMatrix.at<double>(0, 0);
-    const float inv_fy = 1.0f / cameraMatrix.at<double>(1, 1);
-    const float cx = cameraMatrix.at<double>(0, 2);
-    const float cy = cameraMatrix.at<double>(1, 2);
-    return pixel_depth_to_3D_coordiantes(v[0], v[1], v[2], inv_fx, inv_fy, cx, cy);
+    return pixel_depth_to_3D_coordiantes(v[0], v[1], v[2], intrinsics);
 }
 
 inline std::vector<Vector3f> pixel_depth_to_3D_coordiantes(const std::vector<Vector3f> &xyd_vectors,
@@ -108,23 +100,15 @@ inline std::vector<Vector3f> pixel_depth_to_3D_coordiantes(const std::vector<Vec
     return coordinates_3D;
 }
 
-inline std::vector<Vector3f> pixel_depth_to_3D_coordiantes(const std::vector<Vector3f> &xyd_vectors, const cv::Mat &cameraMatrix)
+inline std::vector<Vector3f> pixel_depth_to_3D_coordiantes(const std::vector<Vector3f> &xyd_vectors, const CameraIntrinsics &intrinsics)
 {
-    const float inv_fx = 1.0f / cameraMatrix.at<double>(0, 0);
-    const float inv_fy = 1.0f / cameraMatrix.at<double>(1, 1);
-    const float cx = cameraMatrix.at<double>(0, 2);
-    const float cy = cameraMatrix.at<double>(1, 2);
-    return pixel_depth_to_3D_coordiantes(xyd_vectors, inv_fx, inv_fy, cx, cy);
+    return pixel_depth_to_3D_coordiantes(xyd_vectors, intrinsics.inv_fx, intrinsics.inv_fy, intrinsics.cx, intrinsics.cy);
 }
 
 template<typename DEPTH_TYPE>
-cv::Mat depth_3D_reprojection(const cv::Mat &depth, const cv::Mat &cameraMatrix)
+cv::Mat depth_3D_reprojection(const cv::Mat &depth, const CameraIntrinsics &intrinsics)
 {
-    const float inv_fx = 1.0f / cameraMatrix.at<double>(0, 0);
-    const float inv_fy = 1.0f / cameraMatrix.at<double>(1, 1);
-    const float cx = cameraMatrix.at<double>(0, 2);
-    const float cy = cameraMatrix.at<double>(1, 2);
-    return depth_3D_reprojection<DEPTH_TYPE>(depth, inv_fx, inv_fy, cx, cy);
+    return depth_3D_reprojection<DEPTH_TYPE>(depth, intrinsics.inv_fx, intrinsics.inv_fy, intrinsics.cx, intrinsics.cy);
 }
 
 template<typename DEPTH_TYPE>
@@ -252,19 +236,65 @@ inline Vector2i point_3D_projection(const Vector3f &v, const float fx, const flo
     return Vector2i(cvRound(fx * v[0] * inv_z + cx), cvRound(fy * v[1] * inv_z + cy));
 }
 
+inline Vector2i point_3D_projection(const Vector3f &v, const CameraIntrinsics &intrinsics)
+{
+    return point_3D_projection(v, intrinsics.fx, intrinsics.fy, intrinsics.cx, intrinsics.cy);
+}
+
+  ///////////////////////////////////////
+ // Batch (SoA) reprojection with SSE //
+///////////////////////////////////////
+
+// (u, v, depth * depth_scale) to camera coordinates into the caller's buffers; NaN where |depth * depth_scale| < 0.001.
+// The build uses fast-math, under which isnan is folded to false: callers tell the invalid pixels by their depth.
+inline void pixels_3D_reprojection(const float * const u, const float * const v, const float * const depth, const size_t n,
+    const CameraIntrinsics &intrinsics, float * const X, float * const Y, float * const Z, const float depth_scale = 1)
+{
+    const __m128 inv_fx = _mm_set1_ps(intrinsics.inv_fx);
+    const __m128 inv_fy = _mm_set1_ps(intrinsics.inv_fy);
+    const __m128 cx = _mm_set1_ps(intrinsics.cx);
+    const __m128 cy = _mm_set1_ps(intrinsics.cy);
+    const __m128 scale = _mm_set1_ps(depth_scale);
+    const __m128 min_z = _mm_set1_ps(0.001f);
+    const __m128 sign_mask = _mm_set1_ps(-0.f);
+    const __m128 nan = _mm_set1_ps(bad_value_float);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m128 z = _mm_mul_ps(_mm_loadu_ps(depth + i), scale);
+        const __m128 valid = _mm_cmpge_ps(_mm_andnot_ps(sign_mask, z), min_z);
+        const __m128 x = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(u + i), cx), z), inv_fx);
+        const __m128 y = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(v + i), cy), z), inv_fy);
+        _mm_storeu_ps(X + i, _mm_blendv_ps(nan, x, valid));
+        _mm_storeu_ps(Y + i, _mm_blendv_ps(nan, y, valid));
+        _mm_storeu_ps(Z + i, _mm_blendv_ps(nan, z, valid));
+    }
+
+    for (; i < n; i++) {
+        const float z = depth[i] * depth_scale;
+        if (unlikely(!(std::abs(z) >= 0.001f))) {
+            X[i] = Y[i] = Z[i] = bad_value_float;
+            continue;
+        }
+        X[i] = (u[i] - intrinsics.cx) * z * intrinsics.inv_fx;
+        Y[i] = (v[i] - intrinsics.cy) * z * intrinsics.inv_fy;
+        Z[i] = z;
+    }
+}
+
 
 template<typename DEPTH_TYPE>
 inline std::tuple<Vector2i, Vector2i> project_model(const Vector2f &model_center, const cv::Mat &depth,
-    const Vector2f &model_semi_axes, const cv::Mat &cameraMatrix, const cv::Mat &lookupX, const cv::Mat &lookupY)
+    const Vector2f &model_semi_axes, const CameraIntrinsics &intrinsics, const cv::Mat &lookupX, const cv::Mat &lookupY)
 {
     return project_model(model_center, depth.at<DEPTH_TYPE>(model_center[1], model_center[0]),
-        model_semi_axes, cameraMatrix, lookupX, lookupY);
+        model_semi_axes, intrinsics, lookupX, lookupY);
 }
 
 
 std::tuple<Vector2i, Vector2i>
 project_model(const Vector2f &model_center, const float depth, const Vector2f &model_semi_axes,
-    const cv::Mat &cameraMatrix, const cv::Mat &lookupX, const cv::Mat &lookupY)
+    const CameraIntrinsics &intrinsics, const cv::Mat &lookupX, const cv::Mat &lookupY)
 {
     if (unlikely(std::abs(depth) < 0.001)){
         return bad_point_pair_2D_int;
@@ -274,13 +304,8 @@ project_model(const Vector2f &model_center, const float depth, const Vector2f &m
     const Vector3f model_left_top_corner_3d = model_center_3d+ Vector3f(-model_semi_axes[0], -model_semi_axes[1], 0);
     const Vector3f model_left_bottom_corner_3d = model_center_3d + Vector3f(model_semi_axes[0], model_semi_axes[1], 0);
 
-    const float fx = cameraMatrix.at<double>(0, 0);
-    const float fy = cameraMatrix.at<double>(1, 1);
-    const float cx = cameraMatrix.at<double>(0, 2);
-    const float cy = cameraMatrix.at<double>(1, 2);
-
-    const Vector2i top_corner = point_3D_projection(model_left_top_corner_3d, fx, fy, cx, cy);
-    const Vector2i bottom_corner = point_3D_projection(model_left_bottom_corner_3d, fx, fy, cx, cy);
+    const Vector2i top_corner = point_3D_projection(model_left_top_corner_3d, intrinsics);
+    const Vector2i bottom_corner = point_3D_projection(model_left_bottom_corner_3d, intrinsics);
 
     //std::cout << "model " << model_center_3d[0] << ' ' << model_center_3d[1] << std::endl;
 
@@ -296,7 +321,7 @@ project_model(const Vector2f &model_center, const float depth, const Vector2f &m
 }
 
 Vector2i project_vector(const Vector2f &origin, const float depth, const Vector3f &vector,
-    const cv::Mat &cameraMatrix, const cv::Mat &lookupX, const cv::Mat &lookupY)
+    const CameraIntrinsics &intrinsics, const cv::Mat &lookupX, const cv::Mat &lookupY)
 {
     if (unlikely(std::abs(depth) < 0.001)){
         return bad_point_2D_int;
@@ -305,12 +330,7 @@ Vector2i project_vector(const Vector2f &origin, const float depth, const Vector3
     const Vector3f center_3d = point_3D_reprojection(origin, depth, lookupX, lookupY);
     const Vector3f point_3d = center_3d + vector;
 
-    const float fx = cameraMatrix.at<double>(0, 0);
-    const float fy = cameraMatrix.at<double>(1, 1);
-    const float cx = cameraMatrix.at<double>(0, 2);
-    const float cy = cameraMatrix.at<double>(1, 2);
-
-    const Vector2i projected_point = point_3D_projection(point_3d, fx, fy, cx, cy);
+    const Vector2i projected_point = point_3D_projection(point_3d, intrinsics);
 
     return projected_point;
 }
@@ -325,12 +345,8 @@ Vector2i translate_2D_vector_in_3D_space(const int x, const int y, const float d
 }
 
 Vector2i translate_2D_vector_in_3D_space(const int x, const int y, const float depth, const Vector3f &translation,
-    const cv::Mat &cameraMatrix, const cv::Mat &lookupX, const cv::Mat &lookupY)
+    const CameraIntrinsics &intrinsics, const cv::Mat &lookupX, const cv::Mat &lookupY)
 {
-    const float fx = cameraMatrix.at<double>(0, 0);
-    const float fy = cameraMatrix.at<double>(1, 1);
-    const float cx = cameraMatrix.at<double>(0, 2);
-    const float cy = cameraMatrix.at<double>(1, 2);
-
-    return translate_2D_vector_in_3D_space(x, y, depth, translation, fx, fy, cx, cy, lookupX, lookupY);
+    return translate_2D_vector_in_3D_space(x, y, depth, translation, intrinsics.fx, intrinsics.fy, intrinsics.cx, intrinsics.cy,
+                                           lookupX, lookupY);
 }
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+#include "project_config.h"
+
+IGNORE_WARNINGS_PUSH
+
+#include <mrpt/otherlibs/do_opencv_includes.h>
+
+IGNORE_WARNINGS_POP
+
+#include <smmintrin.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// Single pass weighted accumulation of the colour model of compute_color_model2: the joint H-S histogram (31x32)
+// and the V histogram (row 31) are filled together into one 32x32 layout.
+//
+// Bin indices are computed 16 pixels at a time: the packed HSV bytes are deinterleaved with pshufb, the hue bin
+// is floor(h * 31 / 180) = (h * 31 * 5826) >> 20 (exact for h < 256) and the S and V bins are shifts. The adds
+// themselves are scattered, so consecutive pixels go to HISTOGRAM_ENGINE_SUBHISTOGRAMS interleaved copies of the
+// histogram that are summed at the end; neighbouring pixels usually share bins, and with a single copy every add
+// would wait for the store of the previous one.
+//
+// Weights are either CV_32FC1 or fixed point CV_16UC1 (see to_fixed_point_weights), accumulated in integers.
+//
+// The bin indices take one AVX2 pass instead of two SSE ones when the build targets AVX2 (the USE_AVX2 CMake
+// option, -mavx2): the choice is made at compile time on __AVX2__, such a binary needs an AVX2 CPU.
+
+constexpr int HISTOGRAM_ENGINE_BINS = 32 * 32;
+constexpr int HISTOGRAM_ENGINE_SUBHISTOGRAMS = 4;
+// 12 bits keep the 32 bit accumulators safe up to ~1M pixels
+constexpr int HISTOGRAM_ENGINE_FIXED_POINT_BITS = 12;
+
+inline cv::Mat to_fixed_point_weights(const cv::Mat &weights)
+{
+    cv::Mat fixed_point;
+    weights.convertTo(fixed_point, CV_16UC1, (1 << HISTOGRAM_ENGINE_FIXED_POINT_BITS) - 1);
+    return fixed_point;
+}
+
+namespace histogram_engine
+{
+
+inline void pixel_bins(const uchar * const pixel, uint16_t &bin_hs, uint16_t &bin_v)
+{
+    bin_hs = ((((pixel[0] * 31) * 5826) >> 20) << 5) | (pixel[1] >> 3);
+    bin_v = 992 + (pixel[2] >> 3);
+}
+
+// pshufb masks gathering channel c of 16 packed 3 byte pixels from each of the 3 16 byte loads
+struct DeinterleaveMasks
+{
+    __m128i mask[3][3];
+
+    DeinterleaveMasks()
+    {
+        for (int c = 0; c < 3; c++) {
+            for (int load = 0; load < 3; load++) {
+                alignas(16) int8_t bytes[16];
+                for (int k = 0; k < 16; k++) {
+                    const int source = k * 3 + c - load * 16;
+                    bytes[k] = (source >= 0 && source < 16) ? source : -1;
+                }
+                mask[c][load] = _mm_load_si128(reinterpret_cast<const __m128i *>(bytes));
+            }
+        }
+    }
+};
+
+inline void deinterleave_hsv(const uchar * const pixels, __m128i &h, __m128i &s, __m128i &v)
+{
+    static const DeinterleaveMasks masks;
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixels));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixels + 16));
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixels + 32));
+    __m128i *channels[] = {&h, &s, &v};
+    for (int ch = 0; ch < 3; ch++) {
+        *channels[ch] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a, masks.mask[ch][0]),
+                                                  _mm_shuffle_epi8(b, masks.mask[ch][1])),
+                                     _mm_shuffle_epi8(c, masks.mask[ch][2]));
+    }
+}
+
+// bin indices of 16 packed HSV pixels
+inline void pixel_bins_16_sse(const uchar * const pixels, uint16_t * const bins_hs, uint16_t * const bins_v)
+{
+    __m128i h, s, v;
+    deinterleave_hsv(pixels, h, s, v);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c31 = _mm_set1_epi16(31);
+    const __m128i c5826 = _mm_set1_epi16(5826);
+    const __m128i c992 = _mm_set1_epi16(992);
+    const __m128i halves_h[] = {_mm_cvtepu8_epi16(h), _mm_unpackhi_epi8(h, zero)};
+    const __m128i halves_s[] = {_mm_cvtepu8_epi16(s), _mm_unpackhi_epi8(s, zero)};
+    const __m128i halves_v[] = {_mm_cvtepu8_epi16(v), _mm_unpackhi_epi8(v, zero)};
+    for (int half = 0; half < 2; half++) {
+        const __m128i bin_h = _mm_srli_epi16(_mm_mulhi_epu16(_mm_mullo_epi16(halves_h[half], c31), c5826), 4);
+        const __m128i hs = _mm_or_si128(_mm_slli_epi16(bin_h, 5), _mm_srli_epi16(halves_s[half], 3));
+        const __m128i bv = _mm_add_epi16(_mm_srli_epi16(halves_v[half], 3), c992);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(bins_hs + half * 8), hs);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(bins_v + half * 8), bv);
+    }
+}
+
+#ifdef __AVX2__
+inline void pixel_bins_16_avx2(const uchar * const pixels, uint16_t * const bins_hs, uint16_t * const bins_v)
+{
+    __m128i h, s, v;
+    deinterleave_hsv(pixels, h, s, v);
+    const __m256i h16 = _mm256_cvtepu8_epi16(h);
+    const __m256i s16 = _mm256_cvtepu8_epi16(s);
+    const __m256i v16 = _mm256_cvtepu8_epi16(v);
+    const __m256i bin_h = _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_mullo_epi16(h16, _mm256_set1_epi16(31)),
+                                                               _mm256_set1_epi16(5826)), 4);
+    const __m256i hs = _mm256_or_si256(_mm256_slli_epi16(bin_h, 5), _mm256_srli_epi16(s16, 3));
+    const __m256i bv = _mm256_add_epi16(_mm256_srli_epi16(v16, 3), _mm256_set1_epi16(992));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(bins_hs), hs);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(bins_v), bv);
+}
+#endif
+
+inline void pixel_bins_16(const uchar * const pixels, uint16_t * const bins_hs, uint16_t * const bins_v)
+{
+#ifdef __AVX2__
+    pixel_bins_16_avx2(pixels, bins_hs, bins_v);
+#else
+    pixel_bins_16_sse(pixels, bins_hs, bins_v);
+#endif
+}
+
+template<typename WEIGHT_TYPE, typename ACCUMULATOR_TYPE>
+void accumulate(const cv::Mat &hsv, const cv::Mat &weights, ACCUMULATOR_TYPE (&histograms)[HISTOGRAM_ENGINE_SUBHISTOGRAMS][HISTOGRAM_ENGINE_BINS])
+{
+    static_assert(HISTOGRAM_ENGINE_SUBHISTOGRAMS == 4, "the scatter loop is unrolled by 4");
+    alignas(32) uint16_t bins_hs[16];
+    alignas(32) uint16_t bins_v[16];
+
+    for (int i = 0; i < hsv.rows; i++) {
+        const uchar *hsv_row = hsv.ptr<uchar>(i);
+        const WEIGHT_TYPE *weights_row = weights.ptr<WEIGHT_TYPE>(i);
+        int j = 0;
+        for (; j + 16 <= hsv.cols; j += 16) {
+            pixel_bins_16(hsv_row + j * 3, bins_hs, bins_v);
+            const WEIGHT_TYPE *w = weights_row + j;
+            for (int k = 0; k < 16; k += 4) {
+                histograms[0][bins_hs[k]] += w[k];
+                histograms[1][bins_hs[k + 1]] += w[k + 1];
+                histograms[2][bins_hs[k + 2]] += w[k + 2];
+                histograms[3][bins_hs[k + 3]] += w[k + 3];
+                histograms[0][bins_v[k]] += w[k];
+                histograms[1][bins_v[k + 1]] += w[k + 1];
+                histograms[2][bins_v[k + 2]] += w[k + 2];
+                histograms[3][bins_v[k + 3]] += w[k + 3];
+            }
+        }
+        for (; j < hsv.cols; j++) {
+            uint16_t bin_hs, bin_v;
+            pixel_bins(hsv_row + j * 3, bin_hs, bin_v);
+            histograms[j & 3][bin_hs] += weights_row[j];
+            histograms[j & 3][bin_v] += weights_row[j];
+        }
+    }
+}
+
+}
+
+// compute_color_model2(hsv, weights) in one pass; weights of the size of hsv, CV_32FC1 or CV_16UC1 fixed point
+inline cv::Mat compute_color_model_fused(const cv::Mat &hsv, const cv::Mat &weights)
+{
+    assert(hsv.type() == CV_8UC3 && hsv.size() == weights.size());
+    cv::Mat histogram(32, 32, CV_32FC1);
+    float *histogram_data = histogram.ptr<float>(0);
+    float sum = 0;
+
+    if (weights.type() == CV_16UC1) {
+        alignas(16) uint32_t histograms[HISTOGRAM_ENGINE_SUBHISTOGRAMS][HISTOGRAM_ENGINE_BINS];
+        std::memset(histograms, 0, sizeof(histograms));
+        histogram_engine::accumulate<uint16_t>(hsv, weights, histograms);
+        uint64_t total = 0;
+        for (int b = 0; b < HISTOGRAM_ENGINE_BINS; b++) {
+            const uint32_t bin = histograms[0][b] + histograms[1][b] + histograms[2][b] + histograms[3][b];
+            histogram_data[b] = bin;
+            total += bin;
+        }
+        sum = total;
+    } else {
+        assert(weights.type() == CV_32FC1);
+        alignas(16) float histograms[HISTOGRAM_ENGINE_SUBHISTOGRAMS][HISTOGRAM_ENGINE_BINS];
+        std::memset(histograms, 0, sizeof(histograms));
+        histogram_engine::accumulate<float>(hsv, weights, histograms);
+        __m128 total = _mm_setzero_ps();
+        for (int b = 0; b < HISTOGRAM_ENGINE_BINS; b += 4) {
+            const __m128 bins = _mm_add_ps(_mm_add_ps(_mm_load_ps(histograms[0] + b), _mm_load_ps(histograms[1] + b)),
+                                           _mm_add_ps(_mm_load_ps(histograms[2] + b), _mm_load_ps(histograms[3] + b)));
+            _mm_storeu_ps(histogram_data + b, bins);
+            total = _mm_add_ps(total, bins);
+        }
+        alignas(16) float totals[4];
+        _mm_store_ps(totals, total);
+        sum = totals[0] + totals[1] + totals[2] + totals[3];
+    }
+
+    if (sum > 0) {
+        histogram *= 1.f / sum;
+    }
+    return histogram;
+}
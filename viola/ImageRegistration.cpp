@@ -165,10 +165,11 @@ void ImageRegistration::createLookup()
 void ImageRegistration::createLookup(const size_t width, const size_t height, const cv::Mat camera)
 {
     cameraMatrix = camera;
-    const float inv_fx = 1.0f / cameraMatrix.at<double>(0, 0);
-    const float inv_fy = 1.0f / cameraMatrix.at<double>(1, 1);
-    const float cx = cameraMatrix.at<double>(0, 2);
-    const float cy = cameraMatrix.at<double>(1, 2);
+    intrinsics = CameraIntrinsics(cameraMatrix);
+    const float inv_fx = intrinsics.inv_fx;
+    const float inv_fy = intrinsics.inv_fy;
+    const float cx = intrinsics.cx;
+    const float cy = intrinsics.cy;
 
     lookupY = cv::Mat(1, height, CV_32F);
     lookupX = cv::Mat(1, width, CV_32F);
@@ -6,6 +6,8 @@
 
 #include <depth_registration.h>
 
+#include "CameraIntrinsics.h"
+
 #define K2_DEFAULT_NS          "kinect2"
 #define K2_CALIB_COLOR         "calib_color.yaml"
 #define K2_CALIB_IR            "calib_ir.yaml"
@@ -30,6 +32,7 @@ public:
     cv::Mat cameraMatrixColor, distortionColor, cameraMatrixIr, distortionIr;
     cv::Mat cameraMatrixLowRes;
     cv::Mat cameraMatrix;
+    CameraIntrinsics intrinsics;
     cv::Mat rotation, translation;
     cv::Mat map1Color, map2Color, map1Ir, map2Ir, map1LowRes, map2LowRes;
     cv::Mat lookupX, lookupY;
@@ -1,5 +1,10 @@
 #pragma once
+#include <atomic>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
 #include <string>
+#include <thread>
 using namespace std;
 
 #include "Kinect2Feed.h"
@@ -14,11 +19,19 @@ IGNORE_WARNINGS_PUSH
 
 IGNORE_WARNINGS_POP
 
+// Sync mode: grab releases the previous frames and waits for the next ones; the Mats alias libfreenect2's buffers.
+//
+// Async mode: a capture thread waits for the frames and copies them into a triple buffer of owned frames, so the
+// capture latency overlaps the processing. grab takes the newest complete frame without waiting (except for the
+// very first one): if none arrived since the last grab it returns the same frame again (stale), and frames that
+// arrive while another one is still untaken replace it (dropped).
+//
+// In both modes the grab Mats are valid until the next grab; grab_copy clones.
 class Kinect2Camera : public Kinect2Feed
 {
 public:
-    Kinect2Camera();
-    Kinect2Camera(const string &serial);
+    Kinect2Camera(const bool async = false);
+    Kinect2Camera(const string &serial, const bool async = false);
 
     ~Kinect2Camera();
 
@@ -30,22 +43,66 @@ public:
     void grab(cv::Mat &color, cv::Mat &depth) override;
     void grab_copy(cv::Mat &color, cv::Mat &depth) override;
 
+    // async mode counters
+    size_t get_captured_frames() const;
+    size_t get_stale_frames() const;
+    size_t get_dropped_frames() const;
+
 protected:
+    // the middle slot is the newest complete frame, FRESH while the consumer hasn't taken it
+    static constexpr int FRESH = 4;
+
+    void capture();
+
     libfreenect2::Freenect2Device *dev;
     libfreenect2::Freenect2 freenect2;
     libfreenect2::SyncMultiFrameListener *listener;
     libfreenect2::FrameMap frames_kinect2;
     libfreenect2::PacketPipeline *pipeline;
+
+    const bool async;
+    std::thread capture_thread;
+    std::atomic<bool> capturing;
+    Kinect2Frame slots[3];
+    // front: handed out by grab, back: being written by the capture thread; only the middle one is exchanged
+    int front;
+    int back;
+    std::atomic<int> middle;
+    bool taken;
+    std::mutex first_frame_mutex;
+    std::condition_variable first_frame;
+
+    std::atomic<size_t> captured;
+    std::atomic<size_t> dropped;
+    size_t stale;
 };
 
-Kinect2Camera::Kinect2Camera(const string &serial) :
-    Kinect2Feed(serial)
+Kinect2Camera::Kinect2Camera(const string &serial, const bool async) :
+    Kinect2Feed(serial),
+    async(async),
+    capturing(false),
+    front(0),
+    back(1),
+    middle(2),
+    taken(false),
+    captured(0),
+    dropped(0),
+    stale(0)
 {
     open(serial);
 }
 
-Kinect2Camera::Kinect2Camera() :
-    Kinect2Feed()
+Kinect2Camera::Kinect2Camera(const bool async) :
+    Kinect2Feed(),
+    async(async),
+    capturing(false),
+    front(0),
+    back(1),
+    middle(2),
+    taken(false),
+    captured(0),
+    dropped(0),
+    stale(0)
 {
     open();
 }
@@ -103,19 +160,82 @@ void Kinect2Camera::open(const string &serial_number)
     dev->setIrAndDepthFrameListener(listener);
     dev->start();
     opened = true;
+
+    if (async) {
+        capturing = true;
+        capture_thread = std::thread(&Kinect2Camera::capture, this);
+    }
 }
 
 void Kinect2Camera::close()
 {
+    if (capture_thread.joinable()) {
+        {
+            // under the lock, a grab() waiting for the first frame can't miss it
+            std::lock_guard<std::mutex> lock(first_frame_mutex);
+            capturing = false;
+            first_frame.notify_all();
+        }
+        capture_thread.join();
+        std::cout << "KINECT2_CAPTURED_FRAMES " << captured << std::endl;
+        std::cout << "KINECT2_STALE_FRAMES " << stale << std::endl;
+        std::cout << "KINECT2_DROPPED_FRAMES " << dropped << std::endl;
+    }
     if(opened){
         listener->release(frames_kinect2);
         dev->stop();
         dev->close();
+        opened = false;
+    }
+}
+
+void Kinect2Camera::capture()
+{
+    libfreenect2::FrameMap frames;
+    while (capturing) {
+        // timed out so that close() is not left waiting for a frame (libfreenect2 >= 0.2)
+        if (!listener->waitForNewFrame(frames, 100)) {
+            continue;
+        }
+        Kinect2Frame &frame = slots[back];
+        const libfreenect2::Frame *rgb = frames[libfreenect2::Frame::Color];
+        cv::Mat(rgb->height, rgb->width, CV_8UC3, rgb->data).copyTo(frame.color);
+        const libfreenect2::Frame *depth = frames[libfreenect2::Frame::Depth];
+        cv::Mat(depth->height, depth->width, CV_32FC1, depth->data).copyTo(frame.depth);
+        listener->release(frames);
+        frame.index = captured;
+        frame.timestamp_us = cv::getTickCount() * 1e6 / cv::getTickFrequency();
+
+        const int previous = middle.exchange(back | FRESH, std::memory_order_acq_rel);
+        if (previous & FRESH) {
+            dropped++;
+        }
+        back = previous & ~FRESH;
+        if (captured++ == 0) {
+            std::lock_guard<std::mutex> lock(first_frame_mutex);
+            first_frame.notify_all();
+        }
     }
 }
 
 void Kinect2Camera::grab(cv::Mat &color_mat, cv::Mat &depth_mat)
 {
+    if (async) {
+        if (!taken) {
+            std::unique_lock<std::mutex> lock(first_frame_mutex);
+            first_frame.wait(lock, [this]() { return captured > 0 || !capturing; });
+        }
+        if (middle.load(std::memory_order_acquire) & FRESH) {
+            front = middle.exchange(front, std::memory_order_acq_rel) & ~FRESH;
+            taken = true;
+        } else {
+            stale += taken;
+        }
+        color_mat = slots[front].color;
+        depth_mat = slots[front].depth;
+        return;
+    }
+
     listener->release(frames_kinect2);
     listener->waitForNewFrame(frames_kinect2);
 
@@ -136,3 +256,18 @@ void Kinect2Camera::grab_copy(cv::Mat &color_mat, cv::Mat &depth_mat)
     color_mat = color_mat_shared.clone();
     depth_mat = depth_mat_shared.clone();
 }
+
+size_t Kinect2Camera::get_captured_frames() const
+{
+    return captured;
+}
+
+size_t Kinect2Camera::get_stale_frames() const
+{
+    return stale;
+}
+
+size_t Kinect2Camera::get_dropped_frames() const
+{
+    return dropped;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "DepthPacking.h"
+#include "Kinect2Feed.h"
+#include "RGBDContainer.h"
+
+#include <string>
+
+using namespace std;
+
+// Plays an RGBDContainer recording frame by frame: every grab returns the next frame, with the depth as
+// CV_32FC1 mm like Kinect2Camera. Past the last frame the Mats are empty.
+class Kinect2ContainerReader : public Kinect2Feed
+{
+public:
+    Kinect2ContainerReader(const string &serial_number, const string &file_name);
+
+    void grab(cv::Mat &color, cv::Mat &depth) override;
+    void grab_copy(cv::Mat &color, cv::Mat &depth) override;
+
+    void seek_frame(const size_t frame);
+    void seek_ms(const double ms);
+
+    size_t get_frame() const;
+    size_t get_frames() const;
+    // of the last grabbed frame
+    uint64_t get_timestamp_us() const;
+
+protected:
+    RGBDContainerReader container;
+    size_t next_frame;
+    uint64_t timestamp_us;
+    cv::Mat depth_mm;
+};
+
+Kinect2ContainerReader::Kinect2ContainerReader(const string &serial_number, const string &file_name) :
+    Kinect2Feed(serial_number),
+    next_frame(0),
+    timestamp_us(0)
+{
+    if (!container.open(file_name)) {
+        std::cout << "The recording couldn't be opened." << std::endl;
+        std::cout << file_name << std::endl;
+        exit(-1);
+    }
+}
+
+void Kinect2ContainerReader::grab(cv::Mat &color, cv::Mat &depth)
+{
+    opened = true;
+    if (!container.read(next_frame, color, depth_mm)) {
+        color.release();
+        depth.release();
+        return;
+    }
+    timestamp_us = container.get_timestamp(next_frame);
+    mm_to_depth(depth_mm, depth);
+    next_frame++;
+}
+
+void Kinect2ContainerReader::grab_copy(cv::Mat &color, cv::Mat &depth)
+{
+    grab(color, depth);
+}
+
+void Kinect2ContainerReader::seek_frame(const size_t frame)
+{
+    next_frame = std::min(frame, container.get_frames());
+}
+
+void Kinect2ContainerReader::seek_ms(const double ms)
+{
+    const uint64_t first_timestamp = container.get_frames() ? container.get_timestamp(0) : 0;
+    next_frame = container.find_frame(first_timestamp + uint64_t(std::max(ms, 0.0) * 1000));
+}
+
+size_t Kinect2ContainerReader::get_frame() const
+{
+    return next_frame;
+}
+
+size_t Kinect2ContainerReader::get_frames() const
+{
+    return container.get_frames();
+}
+
+uint64_t Kinect2ContainerReader::get_timestamp_us() const
+{
+    return timestamp_us;
+}
@@ -2,14 +2,26 @@
 
 #include <opencv2/opencv.hpp>
 
+#include <cstdint>
 #include <string>
 using namespace std;
 
+// a colour and depth pair owned by its holder
+struct Kinect2Frame
+{
+    cv::Mat color;
+    cv::Mat depth;
+    size_t index;
+    // recordings: index / frame rate; camera: reception time
+    uint64_t timestamp_us;
+};
+
 class Kinect2Feed 
 {
 public:
     Kinect2Feed();
     Kinect2Feed(const string &serial);
+    virtual ~Kinect2Feed();
     
     virtual void close();
 
@@ -41,6 +53,11 @@ Kinect2Feed::Kinect2Feed(const string &serial) :
     ;
 }
 
+Kinect2Feed::~Kinect2Feed()
+{
+    ;
+}
+
 void Kinect2Feed::close()
 {
     ;    
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "FrameBus.h"
+#include "Kinect2Feed.h"
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+// the readers check now and then whether the writer closed without waking them
+constexpr int FRAME_BUS_WAIT_MS = 500;
+
+// Plays the frames another process publishes on a FrameBus, so several processes can share one sensor. grab waits
+// for a frame newer than the last one grabbed and hands out zero copy, read-only views of the newest one: they stay
+// valid until the writer laps the ring, slots - 1 frames later, which is_intact() tells. grab_copy copies the
+// newest frame, moving on to the next one if it is overwritten while copying. Frames published between two grabs
+// are skipped and counted. Once the writer closes the bus the Mats are empty.
+class Kinect2FrameBusFeed : public Kinect2Feed
+{
+public:
+    Kinect2FrameBusFeed(const string &bus_name);
+
+    void grab(cv::Mat &color, cv::Mat &depth) override;
+    void grab_copy(cv::Mat &color, cv::Mat &depth) override;
+    void close() override;
+
+    // the last grabbed frame hasn't been overwritten yet
+    bool is_intact() const;
+    uint64_t get_timestamp_us() const;
+    size_t get_skipped_frames() const;
+
+protected:
+    // waits for a frame newer than the last one, false once the bus is closed
+    bool next();
+
+    FrameBusReader bus;
+    uint64_t published;
+    uint64_t frame;
+    uint64_t timestamp_us;
+    size_t skipped;
+};
+
+Kinect2FrameBusFeed::Kinect2FrameBusFeed(const string &bus_name) :
+    Kinect2Feed(),
+    published(0),
+    frame(0),
+    timestamp_us(0),
+    skipped(0)
+{
+    if (!bus.open(bus_name)) {
+        std::cout << "The frame bus couldn't be opened." << std::endl;
+        std::cout << bus_name << std::endl;
+        exit(-1);
+    }
+    device_serial_number = bus.get_serial();
+    // the frames already published are not skipped ones: the first grab starts at the newest
+    published = bus.get_published();
+    published -= published > 0;
+    opened = true;
+}
+
+void Kinect2FrameBusFeed::close()
+{
+    bus.close();
+    opened = false;
+}
+
+bool Kinect2FrameBusFeed::next()
+{
+    while (bus.is_open()) {
+        const uint64_t newest = bus.wait(published, FRAME_BUS_WAIT_MS);
+        if (newest > published) {
+            skipped += newest - published - 1;
+            published = newest;
+            frame = newest - 1;
+            return true;
+        }
+        if (bus.is_closed()) {
+            break;
+        }
+    }
+    return false;
+}
+
+void Kinect2FrameBusFeed::grab(cv::Mat &color, cv::Mat &depth)
+{
+    while (next()) {
+        if (bus.view(frame, color, depth, timestamp_us)) {
+            return;
+        }
+    }
+    color.release();
+    depth.release();
+}
+
+void Kinect2FrameBusFeed::grab_copy(cv::Mat &color, cv::Mat &depth)
+{
+    while (next()) {
+        if (bus.copy(frame, color, depth, timestamp_us)) {
+            return;
+        }
+    }
+    color.release();
+    depth.release();
+}
+
+bool Kinect2FrameBusFeed::is_intact() const
+{
+    return bus.is_open() && bus.is_intact(frame);
+}
+
+uint64_t Kinect2FrameBusFeed::get_timestamp_us() const
+{
+    return timestamp_us;
+}
+
+size_t Kinect2FrameBusFeed::get_skipped_frames() const
+{
+    return skipped;
+}
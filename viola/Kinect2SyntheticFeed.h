@@ -0,0 +1,438 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <vector>
+
+#include "project_config.h"
+
+IGNORE_WARNINGS_PUSH
+
+#include <mrpt/otherlibs/do_opencv_includes.h>
+
+IGNORE_WARNINGS_POP
+
+#include "Kinect2Feed.h"
+#include "Kinect2VideoReader.h"
+#include "CameraIntrinsics.h"
+#include "ModelParameters.h"
+
+// torso ellipsoid of the synthetic people, below the head; it contains the chest patch of the person model
+constexpr float SYNTHETIC_TORSO_X_SEMIAXIS_METTERS = 0.20;
+constexpr float SYNTHETIC_TORSO_Y_SEMIAXIS_METTERS = 0.25;
+constexpr float SYNTHETIC_TORSO_Z_SEMIAXIS_METTERS = 0.12;
+constexpr float SYNTHETIC_HEAD_TO_TORSO_METTERS = 0.40;
+// frames whose ground truth is kept for get_ground_truth
+constexpr size_t SYNTHETIC_GROUND_TRUTH_HISTORY = 64;
+
+// A person as a head and a torso ellipsoid. Millimetres, camera coordinates (y down, z forward). Every coordinate of
+// the head centre moves at its velocity, bouncing between its bounds, plus a sinusoidal sway.
+struct SyntheticPerson
+{
+    cv::Vec3b head_color;
+    cv::Vec3b torso_color;
+    cv::Point3f head_semiaxes;
+    cv::Point3f torso_semiaxes;
+    // from the head centre to the torso centre
+    cv::Point3f torso_offset;
+
+    cv::Point3f start;
+    cv::Point3f velocity;
+    cv::Point3f lower_bound;
+    cv::Point3f upper_bound;
+    cv::Point3f sway_amplitude;
+    float sway_period;
+    float sway_phase;
+
+    SyntheticPerson() :
+        head_color(60, 90, 150),
+        torso_color(150, 60, 40),
+        head_semiaxes(PERSON_HEAD_X_SEMIAXIS_METTERS * 1000, PERSON_HEAD_Y_SEMIAXIS_METTERS * 1000,
+                      PERSON_HEAD_X_SEMIAXIS_METTERS * 1000),
+        torso_semiaxes(SYNTHETIC_TORSO_X_SEMIAXIS_METTERS * 1000, SYNTHETIC_TORSO_Y_SEMIAXIS_METTERS * 1000,
+                       SYNTHETIC_TORSO_Z_SEMIAXIS_METTERS * 1000),
+        torso_offset(0, SYNTHETIC_HEAD_TO_TORSO_METTERS * 1000, 0),
+        start(0, 0, 2500),
+        velocity(0, 0, 0),
+        lower_bound(-1e6, -1e6, 500),
+        upper_bound(1e6, 1e6, 1e6),
+        sway_amplitude(0, 0, 0),
+        sway_period(1),
+        sway_phase(0)
+    {
+        ;
+    };
+
+    // back and forth between the bounds
+    static inline float bounce(const float start, const float velocity, const float lower, const float upper, const double t)
+    {
+        const double range = upper - lower;
+        if (range <= 0) {
+            return lower;
+        }
+        double p = std::fmod(start - lower + velocity * t, 2 * range);
+        p = p < 0 ? p + 2 * range : p;
+        return lower + (p <= range ? p : 2 * range - p);
+    };
+
+    cv::Point3f head_center(const double t) const
+    {
+        const double sway = std::sin(2 * M_PI * t / sway_period + sway_phase);
+        return cv::Point3f(bounce(start.x, velocity.x, lower_bound.x, upper_bound.x, t) + sway_amplitude.x * sway,
+                           bounce(start.y, velocity.y, lower_bound.y, upper_bound.y, t) + sway_amplitude.y * sway,
+                           bounce(start.z, velocity.z, lower_bound.z, upper_bound.z, t) + sway_amplitude.z * sway);
+    };
+};
+
+struct SyntheticScene
+{
+    cv::Size size;
+    CameraIntrinsics intrinsics;
+    double framerate;
+    // 0: endless
+    size_t frames;
+
+    // wall at background_depth mm (0: no depth measured), tiled with the two colours
+    float background_depth;
+    cv::Vec3b background_colors[2];
+    int background_tile;
+    // gaussian depth noise, mm
+    float depth_noise_std;
+    uint32_t seed;
+
+    std::vector<SyntheticPerson> people;
+
+    SyntheticScene(const cv::Size &size, const CameraIntrinsics &intrinsics, const double framerate = 30, const size_t frames = 0) :
+        size(size),
+        intrinsics(intrinsics),
+        framerate(framerate),
+        frames(frames),
+        background_depth(5000),
+        background_tile(64),
+        depth_noise_std(0),
+        seed(1)
+    {
+        background_colors[0] = cv::Vec3b(170, 170, 160);
+        background_colors[1] = cv::Vec3b(120, 125, 130);
+    };
+
+    // n people walking across the field of view between 1.2 m and 4.5 m, crossing in front of each other
+    void add_walking_people(const size_t n)
+    {
+        std::mt19937 generator(seed + people.size());
+        std::uniform_real_distribution<float> unit(0, 1);
+        for (size_t i = 0; i < n; i++) {
+            SyntheticPerson person;
+            person.head_color = cv::Vec3b(40 + 60 * unit(generator), 70 + 60 * unit(generator), 110 + 80 * unit(generator));
+            person.torso_color = cv::Vec3b(255 * unit(generator), 255 * unit(generator), 255 * unit(generator));
+
+            const float z = 1200 + 3300 * unit(generator);
+            // horizontal bounds that keep the head in the frame at the nearest depth the person reaches
+            const float z_near = std::max(1200.f, z - 500);
+            const float half_width = (size.width * 0.5f - size.width * 0.08f) * intrinsics.inv_fx * z_near;
+            person.lower_bound = cv::Point3f(-half_width, -1e6, 1200);
+            person.upper_bound = cv::Point3f(half_width, 1e6, 4500);
+            // heads a bit above the optical axis, so the torsos stay in the frame
+            person.start = cv::Point3f((2 * unit(generator) - 1) * half_width, -(0.05f + 0.1f * unit(generator)) * z, z);
+            person.velocity = cv::Point3f((2 * unit(generator) - 1) * 900, 0, (2 * unit(generator) - 1) * 250);
+            person.sway_amplitude = cv::Point3f(15, 20, 0);
+            person.sway_period = 0.8f + 0.6f * unit(generator);
+            person.sway_phase = 2 * M_PI * unit(generator);
+            people.push_back(person);
+        }
+    };
+};
+
+struct SyntheticGroundTruth
+{
+    int id;
+    // mm, camera coordinates
+    cv::Point3f head_center;
+    cv::Point head_pixel;
+    // depth of the front of the head
+    float head_depth;
+    // head pixels not occluded by other people, over the head pixels
+    float head_visible;
+};
+
+// Kinect2Feed rendering a SyntheticScene: colour and depth (CV_32FC1, mm) as seen from one pinhole camera, so the
+// frames come registered, at the scene size and intrinsics. Every pixel is ray cast against the ellipsoids whose
+// bounding box it falls in, the nearest hit wins and is Lambert shaded. The frame time is frame / framerate,
+// independent of the rendering speed.
+//
+// grab and grab_frame render the next frame; grab Mats are valid until the next grab. The ground truth of the last
+// SYNTHETIC_GROUND_TRUTH_HISTORY frames is kept by frame index.
+class Kinect2SyntheticFeed : public Kinect2Feed
+{
+public:
+    Kinect2SyntheticFeed(const SyntheticScene &scene);
+
+    void grab(cv::Mat &color, cv::Mat &depth) override;
+    void grab_copy(cv::Mat &color, cv::Mat &depth) override;
+    // nullptr past the last frame of the scene
+    std::shared_ptr<const Kinect2Frame> grab_frame();
+
+    // false if the frame is not in the history
+    bool get_ground_truth(const size_t frame, std::vector<SyntheticGroundTruth> &ground_truth) const;
+
+    const SyntheticScene &get_scene() const;
+
+protected:
+    struct Ellipsoid
+    {
+        cv::Point3f center;
+        cv::Point3f semiaxes;
+        cv::Vec3b color;
+        uint16_t label;
+    };
+
+    void render(const size_t frame_index, Kinect2Frame &frame, std::vector<SyntheticGroundTruth> &ground_truth);
+    // returns the pixels whose ray hits the ellipsoid, occluded or not
+    int render_ellipsoid(const Ellipsoid &ellipsoid, Kinect2Frame &frame);
+    cv::Rect project_bounds(const Ellipsoid &ellipsoid) const;
+
+    SyntheticScene scene;
+    cv::Mat background_color;
+    cv::Mat background_depth;
+    // ellipsoid label of every pixel, 0 for the background
+    cv::Mat labels;
+
+    size_t next_frame;
+    std::vector<std::shared_ptr<Kinect2Frame>> pool;
+    std::shared_ptr<const Kinect2Frame> grabbed;
+
+    std::deque<std::pair<size_t, std::vector<SyntheticGroundTruth>>> ground_truth_history;
+    mutable std::mutex ground_truth_mutex;
+};
+
+Kinect2SyntheticFeed::Kinect2SyntheticFeed(const SyntheticScene &scene) :
+    Kinect2Feed("synthetic"),
+    scene(scene),
+    next_frame(0)
+{
+    background_color.create(scene.size, CV_8UC3);
+    background_depth.create(scene.size, CV_32FC1);
+    const int tile = std::max(1, scene.background_tile);
+    for (int i = 0; i < scene.size.height; i++) {
+        cv::Vec3b *color_row = background_color.ptr<cv::Vec3b>(i);
+        float *depth_row = background_depth.ptr<float>(i);
+        for (int j = 0; j < scene.size.width; j++) {
+            color_row[j] = scene.background_colors[((i / tile) + (j / tile)) & 1];
+            depth_row[j] = scene.background_depth;
+        }
+    }
+    labels.create(scene.size, CV_16UC1);
+}
+
+const SyntheticScene &Kinect2SyntheticFeed::get_scene() const
+{
+    return scene;
+}
+
+cv::Rect Kinect2SyntheticFeed::project_bounds(const Ellipsoid &ellipsoid) const
+{
+    const CameraIntrinsics &k = scene.intrinsics;
+    // the silhouette is inside the box of the semiaxes projected at the nearest depth of the ellipsoid
+    const float z_near = ellipsoid.center.z - ellipsoid.semiaxes.z;
+    if (z_near <= 1) {
+        return cv::Rect();
+    }
+    const float inv_z_near = 1.0f / z_near;
+    const float inv_z_far = 1.0f / (ellipsoid.center.z + ellipsoid.semiaxes.z);
+    // the leftmost point is the nearest one if it is left of the axis, the farthest otherwise, and so on
+    const auto project = [&](const float coordinate, const float f, const float c, const bool lower) {
+        return f * coordinate * ((coordinate < 0) == lower ? inv_z_near : inv_z_far) + c;
+    };
+    const float x_0 = project(ellipsoid.center.x - ellipsoid.semiaxes.x, k.fx, k.cx, true);
+    const float x_1 = project(ellipsoid.center.x + ellipsoid.semiaxes.x, k.fx, k.cx, false);
+    const float y_0 = project(ellipsoid.center.y - ellipsoid.semiaxes.y, k.fy, k.cy, true);
+    const float y_1 = project(ellipsoid.center.y + ellipsoid.semiaxes.y, k.fy, k.cy, false);
+    const cv::Rect box(cvFloor(x_0), cvFloor(y_0), cvCeil(x_1) - cvFloor(x_0) + 1, cvCeil(y_1) - cvFloor(y_0) + 1);
+    return box & cv::Rect(0, 0, scene.size.width, scene.size.height);
+}
+
+int Kinect2SyntheticFeed::render_ellipsoid(const Ellipsoid &ellipsoid, Kinect2Frame &frame)
+{
+    const cv::Rect box = project_bounds(ellipsoid);
+    if (!box.area()) {
+        return 0;
+    }
+    const CameraIntrinsics &k = scene.intrinsics;
+    const cv::Point3f inv_s2(1.0f / (ellipsoid.semiaxes.x * ellipsoid.semiaxes.x),
+                             1.0f / (ellipsoid.semiaxes.y * ellipsoid.semiaxes.y),
+                             1.0f / (ellipsoid.semiaxes.z * ellipsoid.semiaxes.z));
+    const cv::Point3f &c = ellipsoid.center;
+    const float c_term = c.x * c.x * inv_s2.x + c.y * c.y * inv_s2.y + c.z * c.z * inv_s2.z - 1;
+    std::atomic<int> hits(0);
+
+    // ray (dx, dy, 1) t: a t^2 + b t + c_term = 0, the depth of the nearest hit is the smaller root
+    auto render_row = [&](const int i) {
+        const float dy = (i - k.cy) * k.inv_fy;
+        cv::Vec3b *color_row = frame.color.ptr<cv::Vec3b>(i);
+        float *depth_row = frame.depth.ptr<float>(i);
+        uint16_t *label_row = labels.ptr<uint16_t>(i);
+        int row_hits = 0;
+        for (int j = box.x; j < box.x + box.width; j++) {
+            const float dx = (j - k.cx) * k.inv_fx;
+            const float a = dx * dx * inv_s2.x + dy * dy * inv_s2.y + inv_s2.z;
+            const float b = -2 * (dx * c.x * inv_s2.x + dy * c.y * inv_s2.y + c.z * inv_s2.z);
+            const float discriminant = b * b - 4 * a * c_term;
+            if (discriminant < 0) {
+                continue;
+            }
+            row_hits++;
+            const float z = (-b - std::sqrt(discriminant)) / (2 * a);
+            // behind another ellipsoid or the wall
+            if (z <= 0 || (depth_row[j] > 0 && z >= depth_row[j])) {
+                continue;
+            }
+            // Lambert shading with the light at the camera
+            const cv::Point3f n((dx * z - c.x) * inv_s2.x, (dy * z - c.y) * inv_s2.y, (z - c.z) * inv_s2.z);
+            const float cosine = -(n.x * dx + n.y * dy + n.z) /
+                                 std::sqrt((n.x * n.x + n.y * n.y + n.z * n.z) * (dx * dx + dy * dy + 1));
+            const float shade = 0.35f + 0.65f * std::max(0.f, cosine);
+            color_row[j] = cv::Vec3b(cv::saturate_cast<uchar>(ellipsoid.color[0] * shade),
+                                     cv::saturate_cast<uchar>(ellipsoid.color[1] * shade),
+                                     cv::saturate_cast<uchar>(ellipsoid.color[2] * shade));
+            depth_row[j] = z;
+            label_row[j] = ellipsoid.label;
+        }
+        hits += row_hits;
+    };
+
+#ifdef USE_INTEL_TBB
+    tbb::parallel_for(tbb::blocked_range<int>(box.y, box.y + box.height, std::max(1, box.height / TBB_PARTITIONS)),
+        [&](const tbb::blocked_range<int> &r) {
+            for (int i = r.begin(); i < r.end(); i++) {
+                render_row(i);
+            }
+        }
+    );
+#else
+    for (int i = box.y; i < box.y + box.height; i++) {
+        render_row(i);
+    }
+#endif
+    return hits;
+}
+
+void Kinect2SyntheticFeed::render(const size_t frame_index, Kinect2Frame &frame, std::vector<SyntheticGroundTruth> &ground_truth)
+{
+    const double t = frame_index / scene.framerate;
+    frame.index = frame_index;
+    frame.timestamp_us = uint64_t(t * 1e6 + 0.5);
+    background_color.copyTo(frame.color);
+    background_depth.copyTo(frame.depth);
+    labels.setTo(0);
+
+    // labels 2 i + 1 for the head of person i, 2 i + 2 for the torso
+    const size_t n = scene.people.size();
+    std::vector<int> head_hits(n);
+    ground_truth.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        const SyntheticPerson &person = scene.people[i];
+        const cv::Point3f head_center = person.head_center(t);
+        const Ellipsoid head{head_center, person.head_semiaxes, person.head_color, uint16_t(2 * i + 1)};
+        const Ellipsoid torso{head_center + person.torso_offset, person.torso_semiaxes, person.torso_color, uint16_t(2 * i + 2)};
+        head_hits[i] = render_ellipsoid(head, frame);
+        render_ellipsoid(torso, frame);
+
+        SyntheticGroundTruth &truth = ground_truth[i];
+        truth.id = i;
+        truth.head_center = head_center;
+        truth.head_pixel = cv::Point(cvRound(scene.intrinsics.fx * head_center.x / head_center.z + scene.intrinsics.cx),
+                                     cvRound(scene.intrinsics.fy * head_center.y / head_center.z + scene.intrinsics.cy));
+        truth.head_depth = head_center.z - person.head_semiaxes.z;
+    }
+
+    // the heads left once everybody is drawn
+    for (size_t i = 0; i < n; i++) {
+        const SyntheticPerson &person = scene.people[i];
+        const Ellipsoid head{ground_truth[i].head_center, person.head_semiaxes, person.head_color, uint16_t(2 * i + 1)};
+        const cv::Rect box = project_bounds(head);
+        int visible = 0;
+        for (int y = box.y; y < box.y + box.height; y++) {
+            const uint16_t *label_row = labels.ptr<uint16_t>(y);
+            for (int x = box.x; x < box.x + box.width; x++) {
+                visible += label_row[x] == head.label;
+            }
+        }
+        ground_truth[i].head_visible = head_hits[i] ? float(visible) / head_hits[i] : 0;
+    }
+
+    if (scene.depth_noise_std > 0) {
+        cv::Mat noise(scene.size, CV_32FC1);
+        cv::RNG rng(uint64_t(scene.seed) * 0x9E3779B97F4A7C15ull + frame_index);
+        rng.fill(noise, cv::RNG::NORMAL, 0, scene.depth_noise_std);
+        cv::Mat measured = frame.depth > 0;
+        cv::add(frame.depth, noise, frame.depth, measured);
+    }
+}
+
+std::shared_ptr<const Kinect2Frame> Kinect2SyntheticFeed::grab_frame()
+{
+    if (scene.frames && next_frame >= scene.frames) {
+        return nullptr;
+    }
+
+    // a frame nobody holds any more is rendered into again
+    std::shared_ptr<Kinect2Frame> frame;
+    for (const std::shared_ptr<Kinect2Frame> &candidate : pool) {
+        if (candidate.use_count() == 1) {
+            frame = candidate;
+            break;
+        }
+    }
+    if (!frame) {
+        frame = std::make_shared<Kinect2Frame>();
+        frame->color.create(scene.size, CV_8UC3);
+        frame->depth.create(scene.size, CV_32FC1);
+        pool.push_back(frame);
+    }
+
+    std::vector<SyntheticGroundTruth> ground_truth;
+    render(next_frame, *frame, ground_truth);
+    {
+        std::lock_guard<std::mutex> lock(ground_truth_mutex);
+        ground_truth_history.emplace_back(next_frame, std::move(ground_truth));
+        if (ground_truth_history.size() > SYNTHETIC_GROUND_TRUTH_HISTORY) {
+            ground_truth_history.pop_front();
+        }
+    }
+    next_frame++;
+    return frame;
+}
+
+bool Kinect2SyntheticFeed::get_ground_truth(const size_t frame, std::vector<SyntheticGroundTruth> &ground_truth) const
+{
+    std::lock_guard<std::mutex> lock(ground_truth_mutex);
+    for (const auto &entry : ground_truth_history) {
+        if (entry.first == frame) {
+            ground_truth = entry.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Kinect2SyntheticFeed::grab(cv::Mat &color, cv::Mat &depth)
+{
+    opened = true;
+    grabbed.reset();
+    grabbed = grab_frame();
+    color = grabbed ? grabbed->color : cv::Mat();
+    depth = grabbed ? grabbed->depth : cv::Mat();
+}
+
+void Kinect2SyntheticFeed::grab_copy(cv::Mat &color, cv::Mat &depth)
+{
+    grab(color, depth);
+    color = color.clone();
+    depth = depth.clone();
+}
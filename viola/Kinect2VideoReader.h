@@ -1,17 +1,41 @@
 #pragma once
 
+#include "DepthPacking.h"
 #include "Kinect2Feed.h"
+#include "RecordingIndex.h"
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
 #include <string>
 #include <thread>
 #include <mutex>
+#include <vector>
 
 using namespace std;
 
+// frames decoded ahead of the consumer
+constexpr size_t VIDEO_READER_RING_SLOTS = 8;
+
+// Plays the three videos of a recording: <base>_color, and the float depth split in <base>_depth_1_3 and
+// <base>_depth_4. The colour and the depth streams are decoded ahead by their own threads into a ring of
+// VIDEO_READER_RING_SLOTS frames whose buffers are allocated once. Frames are handed out as shared_ptr views of
+// their slot, and a slot is decoded into again only once the consumer is past it and no view of it is alive.
+//
+// AVI recordings are indexed once (RecordingIndex.h, saved as <base>_index.bin): the streams of intra-only codecs
+// are then decoded frame by frame straight from the mapped files, so the three streams stay on the same frame
+// and seeking is exact and immediate. The other streams seek their capture to the keyframe before and decode forward.
+//
+// grab_frame and grab_next return the next frame in order. With update() running in its own thread, grab returns
+// the frame due at the wall clock time elapsed since the first grab, and the late frames are skipped without
+// seeking. grab and grab_next Mats are valid until the next grab, like Kinect2Camera's; grab_copy clones.
 class Kinect2VideoReader : public Kinect2Feed
 {
 public:
     Kinect2VideoReader(const string &serial_number, const string &file_base_name, const string &file_extension);
+    ~Kinect2VideoReader();
     void skip_n_frames(const size_t n);
     void skip_n_seconds(const double n);
 
@@ -20,32 +44,85 @@ public:
     void grab(cv::Mat &color, cv::Mat &depth);
     void grab_next(cv::Mat &color, cv::Mat &depth);
     void grab_copy(cv::Mat &color, cv::Mat &depth);
+    // nullptr at the end of the recording
+    std::shared_ptr<const Kinect2Frame> grab_frame();
 
     void update();
+
+    double get_framerate() const;
+    size_t get_frames() const;
 protected:
-    double t0, t1;
+    enum Stream
+    {
+        COLOR = 0,
+        DEPTH_1_3 = 1,
+        DEPTH_4 = 2
+    };
+
+    struct Slot
+    {
+        std::shared_ptr<Kinect2Frame> frame;
+        // index + 1 of the frame decoded in the slot by each stream, 0 for none
+        size_t color_frame;
+        size_t depth_frame;
+    };
+
     cv::VideoCapture rgb;
     cv::VideoCapture depth_1_3;
     cv::VideoCapture depth_4;
     float inv_framerate;
-    cv::Mat current_rgb, current_depth;
+    // frame count of the colour capture, read before the decoders take it over
+    size_t capture_frames;
+    // empty for other containers or if the videos can't be indexed
+    RecordingIndex index;
+
+    std::vector<Slot> ring;
+    // first frame not handed out yet, and frames decoded by each stream
+    size_t next_frame;
+    size_t color_decoded;
+    size_t depth_decoded;
+    bool color_eof;
+    bool depth_eof;
+    bool decoding;
+    std::mutex ring_mutex;
+    std::condition_variable ring_changed;
+    std::thread color_decoder;
+    std::thread depth_decoder;
+
+    // frame due published by update, and the frame pinned by the last grab
+    std::shared_ptr<const Kinect2Frame> current;
+    std::shared_ptr<const Kinect2Frame> grabbed;
+    std::mutex frames_mutex;
+    std::atomic<bool> stopping;
 
-    void update_frames();
+    void start_decoders();
+    void stop_decoders();
+    void seek_frame(const size_t frame);
+    void seek_capture(cv::VideoCapture &capture, const Stream stream, const size_t frame);
+    // decodes frame k of stream, from the index when it can
+    bool read(cv::VideoCapture &capture, const Stream stream, const size_t k, cv::Mat &image);
 
-    void get_depth_frame(cv::Mat &frame);
-    void get_rgb_frame(cv::Mat &frame);
+    template<typename F>
+    void decode_stream(size_t &decoded, bool &eof, size_t Slot::*decoded_frame, F decode);
 
-    std::mutex frames_mutex;
+    void get_depth_frame(const cv::Mat &depth3, const cv::Mat &depth4, cv::Mat &frame);
 };
 
 Kinect2VideoReader::Kinect2VideoReader(const string &serial_number, const string &file_base_name, const string &file_extension) :
     Kinect2Feed(serial_number),
-    t0(0),
-    t1(0),
     rgb(file_base_name + std::string("_color.") + file_extension),
     depth_1_3(file_base_name + std::string("_depth_1_3.") + file_extension),
     depth_4(file_base_name + std::string("_depth_4.") + file_extension),
-    inv_framerate(1.0/rgb.get(CV_CAP_PROP_FPS))
+    inv_framerate(1.0/rgb.get(CV_CAP_PROP_FPS)),
+    capture_frames(rgb.get(CV_CAP_PROP_FRAME_COUNT)),
+    ring(VIDEO_READER_RING_SLOTS),
+    next_frame(0),
+    color_decoded(0),
+    depth_decoded(0),
+    color_eof(false),
+    depth_eof(false),
+    decoding(false),
+    stopping(false)
 {
     if (!rgb.isOpened() || !depth_1_3.isOpened() || !depth_4.isOpened()){
         std::cout << "One of the videos couldn't be opened." << std::endl;
@@ -54,140 +131,287 @@ Kinect2VideoReader::Kinect2VideoReader(const string &serial_number, const string
         std::cout << file_base_name + std::string("_depth_4.") + file_extension << std::endl;
         exit(-1);
     }
+
+    if (file_extension == "avi" &&
+        !index.open(std::vector<std::string>{file_base_name + std::string("_color.") + file_extension,
+                                             file_base_name + std::string("_depth_1_3.") + file_extension,
+                                             file_base_name + std::string("_depth_4.") + file_extension},
+                    file_base_name + std::string("_index.bin"))) {
+        std::cout << "The recording couldn't be indexed, seeking through the decoders." << std::endl;
+    }
+
+    for (Slot &slot : ring) {
+        slot.frame = std::make_shared<Kinect2Frame>();
+        slot.color_frame = 0;
+        slot.depth_frame = 0;
+    }
+    start_decoders();
 }
 
+Kinect2VideoReader::~Kinect2VideoReader()
+{
+    stopping = true;
+    stop_decoders();
+}
 
 void Kinect2VideoReader::close()
 {
-    t0 = t1;
+    stopping = true;
 }
 
-void Kinect2VideoReader::skip_n_frames(const size_t n)
+double Kinect2VideoReader::get_framerate() const
 {
-    const double next_frame = rgb.get(CV_CAP_PROP_POS_FRAMES);
-    rgb.set(CV_CAP_PROP_POS_FRAMES, next_frame + n);
-    depth_1_3.set(CV_CAP_PROP_POS_FRAMES, next_frame + n);
-    depth_4.set(CV_CAP_PROP_POS_FRAMES, next_frame + n);
+    return 1.0 / inv_framerate;
 }
 
-void Kinect2VideoReader::skip_n_seconds(const double n)
+size_t Kinect2VideoReader::get_frames() const
 {
-    const double current_ms_time_rgb = rgb.get(CV_CAP_PROP_POS_MSEC);
-    const double current_ms_time_depth_1_3 = depth_1_3.get(CV_CAP_PROP_POS_MSEC);
-    const double current_ms_time_depth_4 = depth_4.get(CV_CAP_PROP_POS_MSEC);
+    // rgb belongs to the colour decoder thread
+    return index.empty() ? capture_frames : index.get_frames();
+}
 
-    const double next_ms_time_rgb = current_ms_time_rgb + n * 1000;
-    const double next_ms_time_depth_1_3 = current_ms_time_depth_1_3 + n * 1000;
-    const double next_ms_time_depth_4 = current_ms_time_depth_4 + n * 1000;
+bool Kinect2VideoReader::read(cv::VideoCapture &capture, const Stream stream, const size_t k, cv::Mat &image)
+{
+    if (!index.empty() && index.stream(stream).direct()) {
+        return k < index.get_frames() && index.stream(stream).decode(k, image);
+    }
+    return capture.read(image) && !image.empty();
+}
 
-    rgb.set(CV_CAP_PROP_POS_MSEC, next_ms_time_rgb);
-    depth_1_3.set(CV_CAP_PROP_POS_MSEC, next_ms_time_depth_1_3);
-    depth_4.set(CV_CAP_PROP_POS_MSEC, next_ms_time_depth_4);
+template<typename F>
+void Kinect2VideoReader::decode_stream(size_t &decoded, bool &eof, size_t Slot::*decoded_frame, F decode)
+{
+    while (true) {
+        Kinect2Frame *frame;
+        size_t k;
+        {
+            std::unique_lock<std::mutex> lock(ring_mutex);
+            k = decoded;
+            Slot &slot = ring[k % ring.size()];
+            // views are released without notification, hence the timed wait
+            while (decoding && !(k < next_frame + ring.size() && slot.frame.use_count() == 1)) {
+                ring_changed.wait_for(lock, std::chrono::milliseconds(2));
+            }
+            if (!decoding) {
+                return;
+            }
+            frame = slot.frame.get();
+        }
+
+        const bool decoded_ok = decode(*frame, k);
+
+        {
+            std::lock_guard<std::mutex> lock(ring_mutex);
+            if (decoded_ok) {
+                ring[k % ring.size()].*decoded_frame = k + 1;
+                frame->index = k;
+                frame->timestamp_us = index.empty() ? uint64_t(k * double(inv_framerate) * 1e6 + 0.5) :
+                                                      index.stream(COLOR).get_timestamp_us(k);
+                decoded++;
+            } else {
+                eof = true;
+            }
+        }
+        ring_changed.notify_all();
+        if (!decoded_ok) {
+            return;
+        }
+    }
 }
 
-void Kinect2VideoReader::update_frames()
+void Kinect2VideoReader::start_decoders()
 {
-    frames_mutex.lock();
-    get_rgb_frame(current_rgb);
-    get_depth_frame(current_depth);
-    frames_mutex.unlock();
+    decoding = true;
+    color_decoder = std::thread([this]() {
+        decode_stream(color_decoded, color_eof, &Slot::color_frame, [this](Kinect2Frame &frame, const size_t k) {
+            return read(rgb, COLOR, k, frame.color);
+        });
+    });
+    depth_decoder = std::thread([this]() {
+        cv::Mat depth3, depth4;
+        decode_stream(depth_decoded, depth_eof, &Slot::depth_frame, [&](Kinect2Frame &frame, const size_t k) {
+            if (!read(depth_1_3, DEPTH_1_3, k, depth3) || !read(depth_4, DEPTH_4, k, depth4)) {
+                return false;
+            }
+            get_depth_frame(depth3, depth4, frame.depth);
+            return true;
+        });
+    });
 }
 
-void Kinect2VideoReader::get_rgb_frame(cv::Mat &frame)
+void Kinect2VideoReader::stop_decoders()
 {
-    rgb >> frame;
+    {
+        std::lock_guard<std::mutex> lock(ring_mutex);
+        decoding = false;
+    }
+    ring_changed.notify_all();
+    if (color_decoder.joinable()) {
+        color_decoder.join();
+    }
+    if (depth_decoder.joinable()) {
+        depth_decoder.join();
+    }
 }
 
-void Kinect2VideoReader::get_depth_frame(cv::Mat &depthf)
+void Kinect2VideoReader::seek_frame(const size_t frame)
 {
-    cv::Mat depth3;
-    cv::Mat depth4;
+    stop_decoders();
+    seek_capture(rgb, COLOR, frame);
+    seek_capture(depth_1_3, DEPTH_1_3, frame);
+    seek_capture(depth_4, DEPTH_4, frame);
+    {
+        std::lock_guard<std::mutex> lock(ring_mutex);
+        next_frame = frame;
+        color_decoded = frame;
+        depth_decoded = frame;
+        color_eof = false;
+        depth_eof = false;
+        for (Slot &slot : ring) {
+            // frames still held from before the seek keep their buffers, the slot gets new ones: the slot of the
+            // new position may be the one of a frame the consumer holds while waiting for it
+            if (slot.frame.use_count() > 1) {
+                slot.frame = std::make_shared<Kinect2Frame>();
+            }
+            slot.color_frame = 0;
+            slot.depth_frame = 0;
+        }
+    }
+    start_decoders();
+}
 
-    depth_1_3 >> depth3;
-    depth_4 >> depth4;
+void Kinect2VideoReader::seek_capture(cv::VideoCapture &capture, const Stream stream, const size_t frame)
+{
+    if (index.empty()) {
+        capture.set(CV_CAP_PROP_POS_FRAMES, frame);
+        return;
+    }
+    const RecordingStream &indexed = index.stream(stream);
+    if (indexed.direct()) {
+        return;
+    }
+    // keyframes are exact seek targets, the frames up to the requested one are decoded and dropped
+    const size_t keyframe = indexed.keyframe_before(frame);
+    capture.set(CV_CAP_PROP_POS_FRAMES, keyframe);
+    for (size_t k = keyframe; k < frame; k++) {
+        capture.grab();
+    }
+}
 
-    depthf = cv::Mat(depth3.rows, depth3.cols, CV_32FC1);
+void Kinect2VideoReader::skip_n_frames(const size_t n)
+{
+    seek_frame(next_frame + n);
+}
 
-    size_t n_bytes = depth3.rows * depth3.cols;
+void Kinect2VideoReader::skip_n_seconds(const double n)
+{
+    const double frame = next_frame + n / inv_framerate;
+    seek_frame(frame > 0 ? size_t(frame + 0.5) : 0);
+}
 
-    uchar *depthf_ptr = depthf.data;
-    uchar *depth3_ptr = depth3.data;
-    uchar *depth4_ptr = depth4.data;
-    #pragma omp parallel for
-    for (size_t i = 0; i < n_bytes; i++){
-      *(depthf_ptr + 4 * i + 0) = *(depth3_ptr + 3 * i + 0);
-      *(depthf_ptr + 4 * i + 1) = *(depth3_ptr + 3 * i + 1);
-      *(depthf_ptr + 4 * i + 2) = *(depth3_ptr + 3 * i + 2);
-      *(depthf_ptr + 4 * i + 3) = *(depth4_ptr + 3 * i + 0);
+std::shared_ptr<const Kinect2Frame> Kinect2VideoReader::grab_frame()
+{
+    std::unique_lock<std::mutex> lock(ring_mutex);
+    const size_t k = next_frame;
+    const Slot &slot = ring[k % ring.size()];
+    auto ready = [&]() {
+        return slot.color_frame == k + 1 && slot.depth_frame == k + 1;
+    };
+    auto ended = [&]() {
+        return (color_eof && color_decoded <= k) || (depth_eof && depth_decoded <= k);
+    };
+    ring_changed.wait(lock, [&]() {
+        return !decoding || ready() || ended();
+    });
+    if (!ready()) {
+        return nullptr;
     }
+    next_frame++;
+    const std::shared_ptr<const Kinect2Frame> frame = slot.frame;
+    lock.unlock();
+    ring_changed.notify_all();
+    return frame;
+}
+
+void Kinect2VideoReader::get_depth_frame(const cv::Mat &depth3, const cv::Mat &depth4, cv::Mat &depthf)
+{
+    unpack_depth(depth3, depth4, depthf);
 }
 
 
 void Kinect2VideoReader::grab_copy(cv::Mat &color, cv::Mat &depth)
 {
     grab(color, depth);
+    color = color.clone();
+    depth = depth.clone();
 }
 
-/*
-void Kinect2VideoReader::grab(cv::Mat &color, cv::Mat &depth)
+// plays the recording at its frame rate from the first grab on
+void Kinect2VideoReader::update()
 {
-    t1 = cv::getTickCount();
-
-    if (!opened){
-        t0 = t1;
-        opened = true;
-        update_frames();
-    }
-
-    const double dt = (t1 - t0) / cv::getTickFrequency();
-    //skip_n_seconds(dt);
-    //std::cout << dt << std::endl;
-    if (dt >= inv_framerate){
-        update_frames();
-        t0 = t1;
+    std::shared_ptr<const Kinect2Frame> frame = grab_frame();
+    {
+        std::lock_guard<std::mutex> lock(frames_mutex);
+        current = frame;
     }
 
-    color = current_rgb.clone();
-    depth = current_depth.clone();
-}
-*/
+    size_t played = 1;
+    uint64_t t0 = cv::getTickCount();
+    while (!stopping) {
+        if (!opened) {
+            t0 = cv::getTickCount();
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            continue;
+        }
 
-void Kinect2VideoReader::update()
-{
-    update_frames();
-    t0 = cv::getTickCount();
-    while (true) {
-        t1 = cv::getTickCount();
-        if(opened){
-            const double dt = (t1 - t0) / cv::getTickFrequency();
-            skip_n_seconds(dt);
-            if (dt >= inv_framerate){
-                update_frames();
-                t1 = cv::getTickCount();
-                t0 = t1;
+        const double elapsed = (cv::getTickCount() - t0) / cv::getTickFrequency();
+        const size_t due = size_t(elapsed / inv_framerate) + 1;
+        frame.reset();
+        bool ended = false;
+        while (played < due) {
+            std::shared_ptr<const Kinect2Frame> next = grab_frame();
+            if (!next) {
+                ended = true;
+                break;
             }
-        } else {
-            t0 = t1;
+            frame = next;
+            played++;
+        }
+        if (frame) {
+            std::lock_guard<std::mutex> lock(frames_mutex);
+            current = frame;
+        }
+        if (ended) {
+            break;
         }
-        std::this_thread::sleep_for (std::chrono::milliseconds(20));
+
+        const double next_frame_time = played * inv_framerate - (cv::getTickCount() - t0) / cv::getTickFrequency();
+        std::this_thread::sleep_for(std::chrono::microseconds(int64_t(std::max(next_frame_time, 0.0) * 1e6)));
     }
 }
 
 void Kinect2VideoReader::grab(cv::Mat &color, cv::Mat &depth)
 {
     opened = true;
-    frames_mutex.lock();
-    color = current_rgb.clone();
-    depth = current_depth.clone();
-    frames_mutex.unlock();
+    std::shared_ptr<const Kinect2Frame> frame;
+    {
+        std::lock_guard<std::mutex> lock(frames_mutex);
+        frame = current;
+    }
+    // without update() playing, frames are taken in order
+    if (!frame) {
+        frame = grab_frame();
+    }
+
+    grabbed = frame;
+    color = frame ? frame->color : cv::Mat();
+    depth = frame ? frame->depth : cv::Mat();
 }
 
 void Kinect2VideoReader::grab_next(cv::Mat &color, cv::Mat &depth)
 {
     opened = true;
-    update_frames();
-    frames_mutex.lock();
-    color = current_rgb.clone();
-    depth = current_depth.clone();
-    frames_mutex.unlock();
+    grabbed = grab_frame();
+    color = grabbed ? grabbed->color : cv::Mat();
+    depth = grabbed ? grabbed->depth : cv::Mat();
 }
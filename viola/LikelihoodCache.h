@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+
+#include "project_config.h"
+
+#ifdef USE_INTEL_TBB
+#include <tbb/concurrent_unordered_map.h>
+#endif
+
+// Memoization of a likelihood term over a quantized particle state. After resampling many particles share the
+// same pixel and depth, so within a frame they can share the same histogram or contour score. Meant to live
+// for one frame of one tracker; lookups can run from the TBB workers.
+
+// key: term (8 bits) | depth in mm (16 bits) | y (16 bits) | x (16 bits)
+inline uint64_t likelihood_cache_key(const int term, const int x, const int y, const int z)
+{
+    return (uint64_t(term & 0xff) << 48) | (uint64_t(z & 0xffff) << 32) | (uint64_t(y & 0xffff) << 16) | uint64_t(x & 0xffff);
+}
+
+template<typename V>
+class LikelihoodCache
+{
+public:
+    LikelihoodCache() : hits(0), lookups(0) {};
+
+    // two workers missing on the same key at the same time both compute the value and the first insert wins.
+    template<typename F>
+    V get_or_compute(const uint64_t key, F compute)
+    {
+        lookups++;
+        typename CacheMap::const_iterator it = cache.find(key);
+        if (it != cache.end()) {
+            hits++;
+            return it->second;
+        }
+        return cache.insert(std::make_pair(key, compute())).first->second;
+    };
+
+    inline size_t get_hits() const
+    {
+        return hits;
+    };
+
+    inline size_t get_lookups() const
+    {
+        return lookups;
+    };
+
+protected:
+#ifdef USE_INTEL_TBB
+    using CacheMap = tbb::concurrent_unordered_map<uint64_t, V>;
+#else
+    using CacheMap = std::unordered_map<uint64_t, V>;
+#endif
+
+    CacheMap cache;
+    std::atomic<size_t> hits;
+    std::atomic<size_t> lookups;
+};
@@ -16,6 +16,8 @@
 #pragma GCC diagnostic pop
 
 #include <string>
+#include <vector>
+#include <cassert>
 
 std::string type2str(int type)
 {
@@ -159,6 +161,70 @@ inline bool point_in_mat(const int x, const int y, const cv::Mat& mat)
     return (x >= 0) && (x < mat.cols) && (y >= 0) && (y < mat.rows);
 }
 
+// inserts a zero between every bit of the lower 16 bits: abcd -> 0a0b0c0d
+inline uint32_t morton_spread_bits(uint32_t v)
+{
+    v &= 0x0000ffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+// Z-order (Morton) index of a 2D coordinate, x takes the even bits and y the odd ones.
+inline uint32_t morton_encode_2D(const uint32_t x, const uint32_t y)
+{
+    return morton_spread_bits(x) | (morton_spread_bits(y) << 1);
+}
+
+// stable LSD radix sort (8 bit digits) of values by their keys; digits shared by every key are skipped.
+template<typename T>
+void radix_sort_by_key(std::vector<T> &values, const std::vector<uint32_t> &keys)
+{
+    assert(values.size() == keys.size());
+    const size_t N = keys.size();
+    if (N < 2) {
+        return;
+    }
+
+    std::vector<uint32_t> order(N);
+    std::vector<uint32_t> order_aux(N);
+    for (size_t i = 0; i < N; i++) {
+        order[i] = i;
+    }
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        size_t offsets[256] = {0};
+        for (size_t i = 0; i < N; i++) {
+            offsets[(keys[i] >> shift) & 0xff]++;
+        }
+
+        if (offsets[(keys[0] >> shift) & 0xff] == N) {
+            continue;
+        }
+
+        size_t sum = 0;
+        for (int d = 0; d < 256; d++) {
+            const size_t count = offsets[d];
+            offsets[d] = sum;
+            sum += count;
+        }
+
+        for (size_t i = 0; i < N; i++) {
+            order_aux[offsets[(keys[order[i]] >> shift) & 0xff]++] = order[i];
+        }
+        order.swap(order_aux);
+    }
+
+    std::vector<T> sorted;
+    sorted.reserve(N);
+    for (size_t i = 0; i < N; i++) {
+        sorted.push_back(values[order[i]]);
+    }
+    values.swap(sorted);
+}
+
 
 int handle_OpenCV_error( int status, const char* func_name, const char* err_msg, const char* file_name, int line, void* userdata )
 {
@@ -14,6 +14,99 @@ constexpr float LIKEHOOD_UPDATE = 0.9;
 
 constexpr float ELLIPSE_FITTING_ANGLE_STEP = 2;
 
+// SHAPE LIKELIHOOD
+// evaluate the contour fitting of the particles on LINE-MOD like orientation response maps, weighted by the
+// gradient magnitude quantized into RESPONSE_MAP_MAGNITUDE_LEVELS levels like ellipse_contour_test
+bool LIKELIHOOD_USE_RESPONSE_MAPS = true;
+// neighbourhood (pixels) over which the quantized gradient orientations are spread
+constexpr int RESPONSE_MAP_SPREAD_T = 5;
+
+// MEMORY LAYOUT
+// sample the contour fitting on 8x8 tiled, Z-ordered copies of the gradient frames; only when
+// LIKELIHOOD_USE_RESPONSE_MAPS is off, the contour fitting reads the response maps otherwise (the HSV frame is
+// tiled by the TILED colour histogram backend)
+bool LIKELIHOOD_USE_TILED_FRAMES = true;
+// evaluate the valid particles sorted by image cell and depth instead of in resampling order
+bool LIKELIHOOD_SORT_PARTICLES = true;
+
+// CASCADED LIKELIHOOD
+// evaluate depth, then contour fitting, and skip the colour histograms of the particles already below the bounds
+bool LIKELIHOOD_CASCADE = false;
+// minimum depth score
+float LIKELIHOOD_CASCADE_DEPTH_BOUND = 0.05;
+// minimum depth score * normalized contour fitting
+float LIKELIHOOD_CASCADE_SHAPE_BOUND = 0.01;
+
+// share the likelihood terms of the particles that fall on the same pixel and depth within a frame
+bool LIKELIHOOD_MEMOIZE = true;
+
+// SCALE ADAPTIVE LIKELIHOOD
+// evaluate the colour histograms of close (large) ellipses on a decimated colour bin pyramid
+bool LIKELIHOOD_USE_COLOR_PYRAMID = true;
+constexpr int LIKELIHOOD_PYRAMID_LEVELS = 4;
+// the pyramid level of every depth is the first one at which the ellipse has at most this many pixels
+constexpr int LIKELIHOOD_PYRAMID_MAX_PIXELS = 4096;
+
+// COLOR LIKELIHOOD
+// HISTOGRAM: Bhattacharyya between the model and a histogram per particle
+// BACK_PROJECTION: ellipse weighted mean of the ratio histogram back-projected once per frame and tracker
+enum class ColorLikelihood
+{
+    HISTOGRAM,
+    BACK_PROJECTION
+};
+ColorLikelihood LIKELIHOOD_COLOR_MODE = ColorLikelihood::HISTOGRAM;
+// nested rings approximating the ellipse weights in the back-projection sums
+constexpr int LIKELIHOOD_BACK_PROJECTION_RINGS = 4;
+// HISTOGRAM mode: keep the models and the particle histograms as sqrt bins, Bhattacharyya is then a dot product
+bool LIKELIHOOD_SQRT_HISTOGRAMS = true;
+// HISTOGRAM mode: accumulation of the particle histograms at full resolution, that is every ellipse the colour
+// pyramid doesn't take (all of them without LIKELIHOOD_USE_COLOR_PYRAMID)
+// ROW_MAJOR: compute_color_model2 on the HSV frame
+// TILED: compute_color_model2 on an 8x8 tiled, Z-ordered copy of the HSV frame
+// SIMD_ENGINE: single pass SIMD kernel of HistogramEngine.h on the HSV frame
+enum class ColorHistogramBackend
+{
+    ROW_MAJOR,
+    TILED,
+    SIMD_ENGINE
+};
+ColorHistogramBackend LIKELIHOOD_HISTOGRAM_BACKEND = ColorHistogramBackend::SIMD_ENGINE;
+
+// DEPTH HOLE FILLING (DepthHoleFiller.h), on the registered depth frames
+// frames a zero pixel keeps its last measured depth, 0 disables the temporal fill
+int DEPTH_HOLE_FILLING_MAX_AGE = 3;
+// radius of the median window of the remaining holes, 0 disables the spatial fill
+int DEPTH_HOLE_FILLING_RADIUS = 1;
+// valid depths required in the window to take its median
+int DEPTH_HOLE_FILLING_MIN_NEIGHBOURS = 3;
+
+// OFFLINE REPLAY (OfflineReplay.h)
+// every frame of a recording is processed in order as fast as possible, with the recorded frame times as the
+// tracking dt and a fixed random seed, so runs on the same recording are comparable
+// frames whose faces are detected ahead, in parallel with the tracking of the current one; 0 detects in line
+int OFFLINE_FACE_DETECTION_LOOKAHEAD = 3;
+constexpr unsigned int OFFLINE_REPLAY_RANDOM_SEED = 1;
+// dt of the first tracking step, which has no previous frame
+constexpr double TRACKING_FIRST_DT = 1.0 / 30;
+
+// LIVE CAPTURE (Kinect2Camera.h)
+// frames are received by their own thread and the tracking takes the newest one without waiting for the camera
+bool KINECT2_ASYNC_CAPTURE = true;
+
+// FACE DETECTION (FaceDetectionStage.h)
+// live, the faces are detected on their own thread at most every FACE_DETECTION_INTERVAL frames, and only if the
+// depth foreground changed in more than FACE_DETECTION_MOTION_THRESHOLD of its pixels since the last detection or
+// FACE_DETECTION_MAX_INTERVAL frames went by
+int FACE_DETECTION_INTERVAL = 3;
+int FACE_DETECTION_MAX_INTERVAL = 30;
+float FACE_DETECTION_MOTION_THRESHOLD = 0.002f;
+// seconds, detections older than this when they finish start no tracker
+constexpr double FACE_DETECTION_MAX_AGE = 0.5;
+// the trackers of late detections start from the detection frame; per second of detection age, the distance under
+// which a detected head is taken for one already tracked grows by this much, as the tracked heads moved since
+constexpr float FACE_DETECTION_TRACKED_SPEED = 1000;
+
 // PERSON MODEL
 constexpr float PERSON_TORSO_X_AXIS_METTERS = 0.30;
 constexpr float PERSON_TORSO_Y_AXIS_METTERS = 0.20;
@@ -46,6 +139,9 @@ constexpr float DEPTH_SIGMA = 1000;
 
 constexpr float HEAD_TO_CHEST_Z_MAX_DIFFERENCE_MM = 350;
 
+// single pixel depth reads are the mean of the valid depths of a (2 * radius + 1)^2 window, see DepthStatistics.h
+constexpr int DEPTH_LOOKUP_RADIUS = 2;
+
 using DEPTH_TYPE = uint16_t;
 
 constexpr float MINIMUM_VISIBLE_CHEST_PERCENTAGE = 0.95;
@@ -1,14 +1,13 @@
 #pragma once
 
 #include <opencv2/opencv.hpp>
-#include <boost/math/distributions/normal.hpp>
 #include "StateEstimation.h"
 #include "Tracker.h"
 
 template <typename DEPTH_TYPE>
 struct MultiTracker {
     const ImageRegistration *reg;
-    const boost::math::normal_distribution<float> depth_distribution;
+    const DepthLikelihood depth_likelihood;
 
     std::vector<CImageParticleFilter<DEPTH_TYPE>> trackers;
     std::vector<StateEstimation> states;
@@ -17,7 +16,7 @@ struct MultiTracker {
 
     MultiTracker(const ImageRegistration *ir) :
         reg(ir),
-        depth_distribution(0, DEPTH_SIGMA),
+        depth_likelihood(DEPTH_SIGMA),
         ellipse_normals(calculate_ellipse_normals(MODEL_SEMIAXIS_X_METTERS, MODEL_SEMIAXIS_Y_METTERS,
                         ELLIPSE_FITTING_ANGLE_STEP))
     {
@@ -29,8 +28,13 @@ struct MultiTracker {
         return trackers.size();
     };
 
+    // detection_time: seconds, time of the frame the head was detected on when it is older than the current one
+    // (FaceDetectionStage.h), so the first prediction spans the frames since; < 0 if detected on the current frame.
+    // hsv_frame and depth_statistics are then those of the detection frame, and detection_age (seconds) the time
+    // the tracked heads had to move away from where they were on it.
     void insert_tracker(const cv::Point &center, const float center_depth,
-                        const cv::Mat &hsv_frame, const cv::Mat &depth_frame, EllipseStash &ellipses)
+                        const cv::Mat &hsv_frame, const DepthStatistics &depth_statistics, EllipseStash &ellipses,
+                        const double detection_time = -1, const double detection_age = 0)
     {
         static int ID = 0;
 
@@ -62,7 +66,7 @@ struct MultiTracker {
             return false;
         };
 
-        if (already_tracked(500)) {
+        if (already_tracked(500 + FACE_DETECTION_TRACKED_SPEED * detection_age)) {
             //cerr << "ALREADY TRACKED\n";
             return;
         }
@@ -82,8 +86,8 @@ struct MultiTracker {
             return;
         }
 
-        Eigen::Vector2i torso_center = translate_2D_vector_in_3D_space(center.x, center.y, center_depth, HEAD_TO_TORSE_CENTER_VECTOR,
-                                                                reg->cameraMatrix, reg->lookupX, reg->lookupY);
+        const cv::Point torso_offset = ellipses.get_torso_offset(center_depth);
+        Eigen::Vector2i torso_center = Eigen::Vector2i(center.x + torso_offset.x, center.y + torso_offset.y);
 
 
         const cv::Size ellipse_axes = ellipses.get_ellipse_size(BodyPart::TORSO, center_depth);
@@ -97,25 +101,26 @@ struct MultiTracker {
             return;
         }
 
-        //if the torso region fits inside the frame, it fits into the depth frame as well, so no need to test bounds
-        const double torso_measured_depth = depth_frame.at<DEPTH_TYPE>(torso_center[1], torso_center[0]);
+        const double torso_measured_depth = depth_statistics.depth_at(cv::Point(torso_center[0], torso_center[1]));
 
         if (std::abs(torso_measured_depth - center_depth) > HEAD_TO_CHEST_Z_MAX_DIFFERENCE_MM) {
             // torso occluded -> do not track
             return;
         }
 
-        trackers.push_back(CImageParticleFilter<DEPTH_TYPE>(&ellipses, reg, &depth_distribution, ID));
+        trackers.push_back(CImageParticleFilter<DEPTH_TYPE>(&ellipses, reg, &depth_likelihood, ID));
         states.push_back(StateEstimation());
         new_states.push_back(StateEstimation());
-        init_tracking(center, center_depth, hsv_frame, depth_frame, ellipse_normals,
+        init_tracking(center, center_depth, hsv_frame, depth_statistics, ellipse_normals,
                                   trackers.back(), states.back(), ellipses, *reg);
+        trackers.back().last_time = detection_time;
         ID++;
     };
 
-    void tracking(const cv::Mat &hsv_frame, const cv::Mat &depth_frame,
+    // frame_time: seconds, the transition model dt is the difference between consecutive ones
+    void tracking(const cv::Mat &hsv_frame, const DepthStatistics &depth_statistics,
                   const cv::Mat &gradient_vectors, const CSensoryFrame &observation,
-                  CParticleFilter &PF, EllipseStash &ellipses, const ImageRegistration &reg)
+                  CParticleFilter &PF, EllipseStash &ellipses, const ImageRegistration &reg, const double frame_time)
     {
         const size_t N = trackers.size();
         std::cout << "TRACKERS " << N << std::endl;
@@ -124,14 +129,15 @@ struct MultiTracker {
             StateEstimation &estimated_new_state = new_states[i];
             const StateEstimation &estimated_state = states[i];
             static CParticleFilter::TParticleFilterStats stats;
+            particles.frame_time = frame_time;
             do_tracking(PF, particles, observation, stats);
+            particles.likelihood_stats.print(particles.ID);
             //printf("RADIUS0 %d %d %f - %d %d %f\n", estimated_state.radius_x, estimated_state.radius_y, estimated_state.z, estimated_new_state.radius_x, estimated_new_state.radius_y, estimated_new_state.z);
             build_state_model(particles, estimated_state, estimated_new_state, hsv_frame,
-                depth_frame, ellipses, reg);
+                depth_statistics, ellipses, reg);
 
-            score_visual_model(estimated_state, estimated_new_state, gradient_vectors, ellipse_normals, depth_distribution, particles.get_object_found(), i);
+            score_visual_model(estimated_state, estimated_new_state, gradient_vectors, ellipse_normals, depth_likelihood, particles.get_object_found(), i);
             //printf("RADIUS1 %d %d %f - %d %d %f\n", estimated_state.radius_x, estimated_state.radius_y, estimated_state.z, estimated_new_state.radius_x, estimated_new_state.radius_y, estimated_new_state.z);
-            particles.last_time = cv::getTickCount();
         }
     };
 
@@ -198,11 +204,12 @@ struct MultiTracker {
         return deleted_states;
     }
 
-    void tracking_step(const cv::Mat &hsv_frame, const cv::Mat &depth_frame, const cv::Mat &gradient_vectors,
-            const CSensoryFrame &observation, CParticleFilter &PF, EllipseStash &ellipses, const ImageRegistration &reg)
+    void tracking_step(const cv::Mat &hsv_frame, const DepthStatistics &depth_statistics, const cv::Mat &gradient_vectors,
+            const CSensoryFrame &observation, CParticleFilter &PF, EllipseStash &ellipses, const ImageRegistration &reg,
+            const double frame_time)
     {
 
-        tracking(hsv_frame, depth_frame, gradient_vectors, observation, PF, ellipses, reg);
+        tracking(hsv_frame, depth_statistics, gradient_vectors, observation, PF, ellipses, reg, frame_time);
         update(ellipses);
         delete_missing();
     }
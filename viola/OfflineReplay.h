@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "project_config.h"
+
+IGNORE_WARNINGS_PUSH
+
+#include <dlib/opencv.h>
+#include <dlib/image_processing/frontal_face_detector.h>
+#include <mrpt/otherlibs/do_opencv_includes.h>
+#include <opencv2/ocl/ocl.hpp>
+
+IGNORE_WARNINGS_POP
+
+#include "FacesDetection.h"
+#include "ImageRegistration.h"
+#include "Kinect2VideoReader.h"
+
+struct OfflineFrame
+{
+    size_t index;
+    // recorded frame time, seconds
+    double time;
+    cv::Mat registered_color;
+    cv::Mat registered_depth;
+    // registered colour at the tracking size, and a copy of it with the face detection boxes drawn
+    cv::Mat color_frame;
+    cv::Mat color_display_frame;
+    std::vector<cv::Rect> faces;
+};
+
+// Feeds every frame of a recording (or of any frame source) in order, as fast as the consumer takes them, for reproducible offline runs.
+// Registration and face detection only depend on the frame, so they run ahead of the consumer: up to lookahead
+// frames are prepared by their own tasks while the current one is tracked. Every task in flight has its own set
+// of cascades and dlib detector, as these keep per-call state and cannot be shared between threads. The OpenCL
+// depth registration writes buffers of its own through a single command queue, so the tasks register one at a
+// time; the registered frames are the same whatever the lookahead (offline_replay_check).
+//
+// Sources without an ImageRegistration give frames registered already (the synthetic feed), with CV_32FC1 depth.
+//
+// report() prints the frames handed out per second since construction; call it once the last one is processed.
+class OfflineReplay
+{
+public:
+    // tracking_size: size the tracking works at, the registered colour is resized to it; empty keeps it as is
+    OfflineReplay(Kinect2VideoReader &recording, const ImageRegistration &reg, const std::string &face_cascade_name,
+                  const std::string &eyes_cascade_name, const int lookahead, const cv::Size &tracking_size = cv::Size());
+    // source: next frame, nullptr at the end; reg: nullptr if the frames are registered
+    OfflineReplay(const std::function<std::shared_ptr<const Kinect2Frame>()> &source, const ImageRegistration *reg,
+                  const std::string &face_cascade_name, const std::string &eyes_cascade_name, const int lookahead,
+                  const cv::Size &tracking_size = cv::Size());
+    ~OfflineReplay();
+
+    // false at the end of the recording
+    bool next(OfflineFrame &frame);
+
+    void report() const;
+
+protected:
+    struct FaceDetectors
+    {
+        cv::ocl::OclCascadeClassifier face_cascade;
+        cv::ocl::OclCascadeClassifier eyes_cascade;
+        dlib::frontal_face_detector dlib_detector;
+    };
+
+    void schedule();
+    OfflineFrame prepare(std::shared_ptr<const Kinect2Frame> frame, FaceDetectors &face_detectors) const;
+
+    std::function<std::shared_ptr<const Kinect2Frame>()> source;
+    const ImageRegistration *reg;
+    const cv::Size tracking_size;
+    // frame k is prepared with face_detectors[k % size]: the frame handed out and lookahead more are in flight
+    std::vector<FaceDetectors> face_detectors;
+    // reg is shared by the tasks in flight
+    mutable std::mutex registration_mutex;
+    std::deque<std::future<OfflineFrame>> pending;
+    size_t scheduled;
+    bool ended;
+
+    size_t frames;
+    uint64_t t0;
+};
+
+OfflineReplay::OfflineReplay(Kinect2VideoReader &recording, const ImageRegistration &reg,
+                             const std::string &face_cascade_name, const std::string &eyes_cascade_name,
+                             const int lookahead, const cv::Size &tracking_size) :
+    // the frames in flight stay pinned in the reader ring until registered
+    OfflineReplay([&recording]() { return recording.grab_frame(); }, &reg, face_cascade_name, eyes_cascade_name,
+                  std::min(lookahead, int(VIDEO_READER_RING_SLOTS) - 2), tracking_size)
+{
+    ;
+}
+
+OfflineReplay::OfflineReplay(const std::function<std::shared_ptr<const Kinect2Frame>()> &source,
+                             const ImageRegistration *reg, const std::string &face_cascade_name,
+                             const std::string &eyes_cascade_name, const int lookahead, const cv::Size &tracking_size) :
+    source(source),
+    reg(reg),
+    tracking_size(tracking_size),
+    face_detectors(std::max(0, lookahead) + 1),
+    scheduled(0),
+    ended(false),
+    frames(0),
+    t0(cv::getTickCount())
+{
+    for (FaceDetectors &detectors : face_detectors) {
+        if (!detectors.face_cascade.load(face_cascade_name) || !detectors.eyes_cascade.load(eyes_cascade_name)) {
+            std::cout << "The face detection cascades couldn't be loaded." << std::endl;
+            std::cout << face_cascade_name << std::endl;
+            std::cout << eyes_cascade_name << std::endl;
+            exit(-1);
+        }
+        detectors.dlib_detector = dlib::get_frontal_face_detector();
+    }
+
+    for (size_t i = 0; i < face_detectors.size(); i++) {
+        schedule();
+    }
+}
+
+OfflineReplay::~OfflineReplay()
+{
+    for (std::future<OfflineFrame> &frame : pending) {
+        frame.wait();
+    }
+}
+
+void OfflineReplay::schedule()
+{
+    if (ended) {
+        return;
+    }
+    std::shared_ptr<const Kinect2Frame> frame = source();
+    if (!frame) {
+        ended = true;
+        return;
+    }
+    FaceDetectors &detectors = face_detectors[scheduled % face_detectors.size()];
+    const std::launch policy = face_detectors.size() > 1 ? std::launch::async : std::launch::deferred;
+    pending.push_back(std::async(policy, &OfflineReplay::prepare, this, frame, std::ref(detectors)));
+    scheduled++;
+}
+
+OfflineFrame OfflineReplay::prepare(std::shared_ptr<const Kinect2Frame> frame, FaceDetectors &detectors) const
+{
+    OfflineFrame offline_frame;
+    offline_frame.index = frame->index;
+    offline_frame.time = frame->timestamp_us * 1e-6;
+    if (reg) {
+        std::lock_guard<std::mutex> lock(registration_mutex);
+        reg->register_images(frame->color, frame->depth, offline_frame.registered_color, offline_frame.registered_depth);
+    } else {
+        // the source renders into the frame again once released
+        offline_frame.registered_color = frame->color.clone();
+        depth_to_mm(frame->depth, offline_frame.registered_depth);
+    }
+    frame.reset();
+
+    if (tracking_size.area() && tracking_size != offline_frame.registered_color.size()) {
+        cv::resize(offline_frame.registered_color, offline_frame.color_frame, tracking_size, 0, 0, cv::INTER_AREA);
+    } else {
+        offline_frame.color_frame = offline_frame.registered_color;
+    }
+    offline_frame.color_display_frame = offline_frame.color_frame.clone();
+
+    // same region as the live detection: the upper three quarters of the frame
+    cv::ocl::oclMat ocl_color_frame(offline_frame.color_frame);
+    cv::ocl::oclMat ocl_gray_frame;
+    cv::ocl::cvtColor(ocl_color_frame, ocl_gray_frame, cv::COLOR_BGR2GRAY);
+    const cv::ocl::oclMat ocl_gray_frame_upper_half = ocl_gray_frame(cv::Rect(0, 0, ocl_gray_frame.cols, ocl_gray_frame.rows * 0.75));
+    offline_frame.faces = viola_faces::detect_faces_dual(ocl_gray_frame_upper_half, detectors.face_cascade,
+        detectors.eyes_cascade, 1, detectors.dlib_detector, offline_frame.color_frame, offline_frame.color_display_frame);
+
+    return offline_frame;
+}
+
+bool OfflineReplay::next(OfflineFrame &frame)
+{
+    if (pending.empty()) {
+        return false;
+    }
+    frame = pending.front().get();
+    pending.pop_front();
+    // its detectors are free again
+    schedule();
+    frames++;
+    return true;
+}
+
+void OfflineReplay::report() const
+{
+    const double seconds = (cv::getTickCount() - t0) / cv::getTickFrequency();
+    std::cout << "OFFLINE_REPLAY_FRAMES " << frames << std::endl;
+    std::cout << "OFFLINE_REPLAY_TIME " << seconds << std::endl;
+    std::cout << "OFFLINE_REPLAY_FPS " << (seconds > 0 ? frames / seconds : 0) << std::endl;
+}
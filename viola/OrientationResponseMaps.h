@@ -0,0 +1,319 @@
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include "project_config.h"
+
+IGNORE_WARNINGS_PUSH
+
+#include <mrpt/otherlibs/do_opencv_includes.h>
+
+IGNORE_WARNINGS_POP
+
+#include <tmmintrin.h>
+
+#include "EllipseFunctions.h"
+
+using namespace Eigen;
+
+// LINE-MOD style shape likelihood
+// @article{hinterstoisser2012gradient,
+//   title={Gradient Response Maps for Real-Time Detection of Textureless Objects},
+//   author={Hinterstoisser, Stefan and Cagniart, Cedric and Ilic, Slobodan and Sturm, Peter and Navab, Nassir and Fua, Pascal and Lepetit, Vincent},
+//   journal={IEEE Transactions on Pattern Analysis and Machine Intelligence},
+//   year={2012}
+// }
+//
+// The gradient orientation of every pixel is quantized into 8 undirected bins (a bit each), spread over a
+// neighbourhood and turned into one response map per orientation. The maps are stored one after another in
+// a single (8 * rows) x cols CV_8UC1 matrix, so the response of orientation o at pixel (x, y) lives at
+// data[o * rows * cols + y * cols + x] and an ellipse contour becomes a sum of lookups at fixed offsets.
+//
+// ellipse_contour_test weights every sample by the gradient magnitude, so that weak texture edges count less
+// than the head contour. The magnitude is quantized too, into RESPONSE_MAP_MAGNITUDE_LEVELS levels of the frame
+// maximum, each with its own orientation bitmask spread separately: the response of a pixel is the best
+// |cos| * level weight of the gradients in its neighbourhood.
+
+constexpr int RESPONSE_MAP_ORIENTATIONS = 8;
+constexpr int RESPONSE_MAP_MAGNITUDE_LEVELS = 4;
+constexpr int RESPONSE_MAP_MAX_SCORE = 255;
+
+inline int quantize_orientation(const float v_x, const float v_y)
+{
+    // undirected orientation in [0, 180)
+    float angle = cv::fastAtan2(v_y, v_x);
+    if (angle >= 180.f) {
+        angle -= 180.f;
+    }
+    const int bin = int(angle * (RESPONSE_MAP_ORIENTATIONS / 180.f));
+    return std::min(bin, RESPONSE_MAP_ORIENTATIONS - 1);
+}
+
+// One bit per pixel, the orientation bin of its gradient, in the plane of its magnitude level: a
+// (RESPONSE_MAP_MAGNITUDE_LEVELS * rows) x cols CV_8UC1 matrix, 0 where the gradient is too weak.
+cv::Mat quantize_gradient_orientations(const cv::Mat &gradient_vectors, const cv::Mat &gradient_magnitude)
+{
+    const int rows = gradient_vectors.rows;
+    cv::Mat quantized = cv::Mat::zeros(rows * RESPONSE_MAP_MAGNITUDE_LEVELS, gradient_vectors.cols, CV_8UC1);
+
+    double max_magnitude = 0;
+    cv::minMaxLoc(gradient_magnitude, nullptr, &max_magnitude);
+    if (!(max_magnitude > 0)) {
+        return quantized;
+    }
+    const float level_scale = RESPONSE_MAP_MAGNITUDE_LEVELS / max_magnitude;
+
+    auto quantize_row = [&](const int i) {
+        const cv::Vec2f *vectors_row = gradient_vectors.ptr<cv::Vec2f>(i);
+        const float *magnitude_row = gradient_magnitude.ptr<float>(i);
+        for (int j = 0; j < gradient_vectors.cols; j++) {
+            // sobel_operator zeroes the magnitude of weak gradients and leaves NaN vectors on flat areas.
+            if (magnitude_row[j] > 0 && !std::isnan(vectors_row[j][0])) {
+                const int level = std::min(int(magnitude_row[j] * level_scale), RESPONSE_MAP_MAGNITUDE_LEVELS - 1);
+                quantized.ptr<uchar>(level * rows + i)[j] = uchar(1 << quantize_orientation(vectors_row[j][0], vectors_row[j][1]));
+            }
+        }
+    };
+
+#ifdef USE_INTEL_TBB
+    tbb::parallel_for(tbb::blocked_range<int>(0, rows, std::max(1, rows / TBB_PARTITIONS)),
+        [&](const tbb::blocked_range<int> &r) {
+            for (int i = r.begin(); i < r.end(); i++) {
+                quantize_row(i);
+            }
+        }
+    );
+#else
+    for (int i = 0; i < rows; i++) {
+        quantize_row(i);
+    }
+#endif
+    return quantized;
+}
+
+// OR of the orientation bits over a T x T neighbourhood centered on every pixel (separable: rows, then cols).
+cv::Mat spread_orientations(const cv::Mat &quantized, const int T)
+{
+    const int rows = quantized.rows;
+    const int cols = quantized.cols;
+    const int half_T = T / 2;
+
+    cv::Mat spread_rows = cv::Mat::zeros(rows, cols, CV_8UC1);
+    cv::Mat spread = cv::Mat::zeros(rows, cols, CV_8UC1);
+
+    for (int i = 0; i < rows; i++) {
+        const uchar *src = quantized.ptr<uchar>(i);
+        uchar *dst = spread_rows.ptr<uchar>(i);
+        for (int d = -half_T; d <= half_T; d++) {
+            const int j_0 = std::max(0, -d);
+            const int j_1 = std::min(cols, cols - d);
+            for (int j = j_0; j < j_1; j++) {
+                dst[j] |= src[j + d];
+            }
+        }
+    }
+
+    for (int i = 0; i < rows; i++) {
+        uchar *dst = spread.ptr<uchar>(i);
+        const int i_0 = std::max(0, i - half_T);
+        const int i_1 = std::min(rows - 1, i + half_T);
+        for (int k = i_0; k <= i_1; k++) {
+            const uchar *src = spread_rows.ptr<uchar>(k);
+            for (int j = 0; j < cols; j++) {
+                dst[j] |= src[j];
+            }
+        }
+    }
+
+    return spread;
+}
+
+// spread_orientations of every magnitude level plane, so bits of different levels are never merged
+cv::Mat spread_orientation_levels(const cv::Mat &quantized, const int T)
+{
+    const int rows = quantized.rows / RESPONSE_MAP_MAGNITUDE_LEVELS;
+    cv::Mat spread(quantized.rows, quantized.cols, CV_8UC1);
+
+    auto spread_level = [&](const int level) {
+        cv::Mat spread_plane = spread.rowRange(level * rows, (level + 1) * rows);
+        spread_orientations(quantized.rowRange(level * rows, (level + 1) * rows), T).copyTo(spread_plane);
+    };
+
+#ifdef USE_INTEL_TBB
+    tbb::parallel_for(0, RESPONSE_MAP_MAGNITUDE_LEVELS, spread_level);
+#else
+    for (int level = 0; level < RESPONSE_MAP_MAGNITUDE_LEVELS; level++) {
+        spread_level(level);
+    }
+#endif
+    return spread;
+}
+
+// The best similarity |cos| between orientation o and any orientation present in a spread bitmask, scaled by
+// the weight of the magnitude level, is looked up in two 16-entry tables (low and high nibble of the mask),
+// which is exactly what pshufb is built for.
+struct ResponseLookupTables
+{
+    uchar low[RESPONSE_MAP_MAGNITUDE_LEVELS][RESPONSE_MAP_ORIENTATIONS][16];
+    uchar high[RESPONSE_MAP_MAGNITUDE_LEVELS][RESPONSE_MAP_ORIENTATIONS][16];
+
+    ResponseLookupTables()
+    {
+        const float bin_angle = M_PI / RESPONSE_MAP_ORIENTATIONS;
+        for (int level = 0; level < RESPONSE_MAP_MAGNITUDE_LEVELS; level++) {
+            // level l holds the magnitudes in [l, l + 1) / levels of the frame maximum
+            const float level_weight = (level + 1) / float(RESPONSE_MAP_MAGNITUDE_LEVELS);
+            for (int o = 0; o < RESPONSE_MAP_ORIENTATIONS; o++) {
+                for (int mask = 0; mask < 16; mask++) {
+                    float best_low = 0;
+                    float best_high = 0;
+                    for (int b = 0; b < 4; b++) {
+                        if (mask & (1 << b)) {
+                            best_low = std::max(best_low, std::abs(std::cos((o - b) * bin_angle)));
+                            best_high = std::max(best_high, std::abs(std::cos((o - b - 4) * bin_angle)));
+                        }
+                    }
+                    low[level][o][mask] = uchar(cvRound(best_low * level_weight * RESPONSE_MAP_MAX_SCORE));
+                    high[level][o][mask] = uchar(cvRound(best_high * level_weight * RESPONSE_MAP_MAX_SCORE));
+                }
+            }
+        }
+    }
+};
+
+// spread: the spread orientation bitmasks of the magnitude levels, stacked
+cv::Mat compute_response_maps(const cv::Mat &spread)
+{
+    static const ResponseLookupTables lut;
+
+    const int rows = spread.rows / RESPONSE_MAP_MAGNITUDE_LEVELS;
+    const int cols = spread.cols;
+    const size_t plane_size = size_t(rows) * cols;
+
+    cv::Mat response_maps(rows * RESPONSE_MAP_ORIENTATIONS, cols, CV_8UC1);
+    const cv::Mat spread_continuous = spread.isContinuous() ? spread : spread.clone();
+    const uchar *src = spread_continuous.ptr<uchar>(0);
+
+    auto compute_plane = [&](const int o) {
+        uchar *dst = response_maps.ptr<uchar>(0) + o * plane_size;
+        const __m128i low_nibble = _mm_set1_epi8(0x0f);
+        __m128i lut_low[RESPONSE_MAP_MAGNITUDE_LEVELS];
+        __m128i lut_high[RESPONSE_MAP_MAGNITUDE_LEVELS];
+        for (int level = 0; level < RESPONSE_MAP_MAGNITUDE_LEVELS; level++) {
+            lut_low[level] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lut.low[level][o]));
+            lut_high[level] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lut.high[level][o]));
+        }
+        size_t k = 0;
+        for (; k + 16 <= plane_size; k += 16) {
+            __m128i response = _mm_setzero_si128();
+            for (int level = 0; level < RESPONSE_MAP_MAGNITUDE_LEVELS; level++) {
+                const __m128i masks = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + level * plane_size + k));
+                const __m128i masks_low = _mm_and_si128(masks, low_nibble);
+                const __m128i masks_high = _mm_and_si128(_mm_srli_epi16(masks, 4), low_nibble);
+                response = _mm_max_epu8(response, _mm_max_epu8(_mm_shuffle_epi8(lut_low[level], masks_low),
+                                                               _mm_shuffle_epi8(lut_high[level], masks_high)));
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + k), response);
+        }
+        for (; k < plane_size; k++) {
+            uchar response = 0;
+            for (int level = 0; level < RESPONSE_MAP_MAGNITUDE_LEVELS; level++) {
+                const uchar mask = src[level * plane_size + k];
+                response = std::max(response, std::max(lut.low[level][o][mask & 0x0f], lut.high[level][o][mask >> 4]));
+            }
+            dst[k] = response;
+        }
+    };
+
+#ifdef USE_INTEL_TBB
+    tbb::parallel_for(0, RESPONSE_MAP_ORIENTATIONS, compute_plane);
+#else
+    for (int o = 0; o < RESPONSE_MAP_ORIENTATIONS; o++) {
+        compute_plane(o);
+    }
+#endif
+
+    return response_maps;
+}
+
+inline cv::Mat compute_orientation_response_maps(const cv::Mat &gradient_vectors, const cv::Mat &gradient_magnitude, const int T)
+{
+    return compute_response_maps(spread_orientation_levels(quantize_gradient_orientations(gradient_vectors, gradient_magnitude), T));
+}
+
+// Contour samples of ellipse_contour_test for a given pair of radii, as linear offsets from the center pixel
+// into a response map plane plus the orientation plane each sample has to be looked up in.
+struct ContourTemplate
+{
+    std::vector<int> offsets;
+    std::vector<int> plane_offsets;
+};
+
+class ContourTemplateStash
+{
+public:
+    using ContourTemplateMap = std::map<std::pair<int, int>, ContourTemplate>;
+
+    // not thread safe: fill it before entering a parallel region.
+    inline const ContourTemplate &get_template(const cv::Size &ellipse_axes, const std::vector<Vector2f> &normal_vectors,
+                                               const cv::Mat &response_maps)
+    {
+        const int cols = response_maps.cols;
+        const int plane_size = (response_maps.rows / RESPONSE_MAP_ORIENTATIONS) * cols;
+        if (cols != stride || plane_size != plane_stride) {
+            templates.clear();
+            stride = cols;
+            plane_stride = plane_size;
+        }
+
+        const std::pair<int, int> key(ellipse_axes.width, ellipse_axes.height);
+        ContourTemplateMap::iterator it = templates.find(key);
+        if (it == templates.end()) {
+            ContourTemplate &t = templates[key];
+            t = build_template(ellipse_axes.width * 0.5, ellipse_axes.height * 0.5, normal_vectors);
+            return t;
+        }
+        return it->second;
+    };
+
+protected:
+    inline ContourTemplate build_template(const float radius_x, const float radius_y, const std::vector<Vector2f> &normal_vectors) const
+    {
+        ContourTemplate t;
+        const int total_vectors = normal_vectors.size();
+        t.offsets.reserve(total_vectors * 4);
+        t.plane_offsets.reserve(total_vectors * 4);
+        for (int i = 0; i < total_vectors; i++) {
+            const float v_x = normal_vectors[i][0];
+            const float v_y = normal_vectors[i][1];
+            const Vector2f samples[] = {Vector2f(v_x, v_y), Vector2f(-v_x, -v_y), Vector2f(-v_y, v_x), Vector2f(v_y, -v_x)};
+            for (const Vector2f &v : samples) {
+                const int d_x = cvRound(v[0] * radius_x);
+                const int d_y = cvRound(v[1] * radius_y);
+                t.offsets.push_back(d_y * stride + d_x);
+                t.plane_offsets.push_back(quantize_orientation(v[0], v[1]) * plane_stride);
+            }
+        }
+        return t;
+    };
+
+    ContourTemplateMap templates;
+    int stride = -1;
+    int plane_stride = -1;
+};
+
+// Counterpart of ellipse_contour_test on the response maps, magnitude weighted relative to the frame maximum;
+// the result is in [0, 1].
+inline float ellipse_contour_response(const cv::Point &center, const ContourTemplate &contour, const cv::Mat &response_maps)
+{
+    const uchar *center_ptr = response_maps.ptr<uchar>(0) + center.y * response_maps.cols + center.x;
+    const int total_samples = contour.offsets.size();
+    const int *offsets = contour.offsets.data();
+    const int *plane_offsets = contour.plane_offsets.data();
+    int response_sum = 0;
+    for (int i = 0; i < total_samples; i++) {
+        response_sum += center_ptr[plane_offsets[i] + offsets[i]];
+    }
+    return response_sum / float(total_samples * RESPONSE_MAP_MAX_SCORE);
+}
@@ -1,16 +1,11 @@
 #include <algorithm>
 
 cv::Mat person_mask(const float x, const float y, const float z, cv::Mat rgb_frame, cv::Mat depth_frame,
-    cv::Mat background_depth, cv::Mat cameraMatrix,
+    cv::Mat background_depth, const CameraIntrinsics &intrinsics,
     cv::Mat lookupX, cv::Mat lookupY, cv::Mat &display, cv::Mat &display_mask, cv::Mat &flood_mask)
 {
     using namespace Eigen;
 
-    const float fx = cameraMatrix.at<double>(0, 0);
-    const float fy = cameraMatrix.at<double>(1, 1);
-    const float cx = cameraMatrix.at<double>(0, 2);
-    const float cy = cameraMatrix.at<double>(1, 2);
-
     float Z_TOLERANCE = 750.0;
     Vector3f translation_upper_left(-1.0, -1.0, 0.0);
     Vector3f translation_lower_right(1.0, 0.5, 0.0);
@@ -20,10 +15,10 @@ cv::Mat person_mask(const float x, const float y, const float z, cv::Mat rgb_fra
     point_3D[1] = 0;
 
     const Vector3f point_3D_upper_left = point_3D + translation_upper_left;
-    Vector2i upper_left = point_3D_projection(point_3D_upper_left, fx, fy, cx, cy);
+    Vector2i upper_left = point_3D_projection(point_3D_upper_left, intrinsics);
 
     const Vector3f point_3D_lower_right = point_3D + translation_lower_right;
-    Vector2i lower_right = point_3D_projection(point_3D_lower_right, fx, fy, cx, cy);
+    Vector2i lower_right = point_3D_projection(point_3D_lower_right, intrinsics);
     
     const int pixels_per_vertical_metter = lower_right[1] - upper_left[1];
     const int pixels_per_horizontal_metter = (lower_right[0] - upper_left[0]) * 0.5;
@@ -34,8 +29,8 @@ cv::Mat person_mask(const float x, const float y, const float z, cv::Mat rgb_fra
     upper_left[0] = std::max(0, std::min(rgb_frame.cols - 1, upper_left[0]));
     upper_left[1] = std::max(0, std::min(rgb_frame.rows - 1, upper_left[1]));
 
-    //Vector2i upper_left = translate_2D_vector_in_3D_space(x, y, z, translation_upper_left, cameraMatrix, lookupX, lookupY);
-    //Vector2i upper_right = translate_2D_vector_in_3D_space(x, y, z, translation_lower_right, cameraMatrix, lookupX, lookupY);
+    //Vector2i upper_left = translate_2D_vector_in_3D_space(x, y, z, translation_upper_left, intrinsics, lookupX, lookupY);
+    //Vector2i upper_right = translate_2D_vector_in_3D_space(x, y, z, translation_lower_right, intrinsics, lookupX, lookupY);
 
     //std::cout << "person_mask LEFT " << upper_left[0] << ' ' << upper_left[1] << std::endl;
     //std::cout << "person_mask RIGTH " << lower_right[0] << ' ' << lower_right[1] << std::endl;
@@ -85,7 +80,7 @@ cv::Mat person_mask(const float x, const float y, const float z, cv::Mat rgb_fra
     const Eigen::Vector3f center_3D = point_3D_reprojection(mean_pixel_x, mean_pixel_y, z, lookupX, lookupY);
 
     const Vector3f point_3D_left = center_3D + Vector3f(-0.12, -1, 0.0);
-    Vector2i left = point_3D_projection(point_3D_left, fx, fy, cx, cy);
+    Vector2i left = point_3D_projection(point_3D_left, intrinsics);
     Vector2i right = Vector2i(mean_pixel_x + (mean_pixel_x - left[0]), mean_pixel_y + (mean_pixel_y - left[1]));
     //const Vector3f point_3D_right = point_3D + (0.12., 0.0, 0.0);
     //cv::line(display, cv::Point(left[0], left[1]), cv::Point(right[0], right[1]), cv::Scalar(255, 0, 0), 3);
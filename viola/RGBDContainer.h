@@ -0,0 +1,567 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <emmintrin.h>
+
+#include <opencv2/opencv.hpp>
+
+#include "DepthPacking.h"
+
+// Single file recording of synchronized colour and depth frames with their timestamps:
+//
+//   RGBDFileHeader
+//   per frame: RGBDChunkHeader, depth payload, colour payload
+//   index: one RGBDIndexEntry per frame (8 byte aligned)
+//   RGBDFileTrailer
+//
+// All the fields are little endian. Depth is stored as 16 bit mm (CV_32FC1 frames are rounded), losslessly
+// compressed row by row: each pixel is predicted by its left neighbour (the pixel above for the first column),
+// the residuals are zigzag mapped and Rice coded in blocks of RGBD_DEPTH_BLOCK with a per block parameter.
+// Colour is stored raw or through imencode (PNG lossless, JPEG lossy).
+//
+// The reader maps the whole file and the index, so any frame is one lookup away. A file without trailer (the
+// recording did not finish) is indexed by walking the chunk headers.
+
+constexpr char RGBD_MAGIC[4] = {'R', 'G', 'B', 'D'};
+constexpr char RGBD_TRAILER_MAGIC[4] = {'R', 'G', 'B', 'I'};
+constexpr uint32_t RGBD_VERSION = 1;
+
+// residuals per Rice parameter
+constexpr int RGBD_DEPTH_BLOCK = 32;
+// unary quotients from this length on escape to the raw 16 bit residual
+constexpr int RGBD_DEPTH_ESCAPE = 24;
+
+enum class RGBDColorCodec : uint32_t
+{
+    RAW = 0,
+    PNG = 1,
+    JPEG = 2
+};
+
+struct RGBDFileHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t depth_width;
+    uint32_t depth_height;
+    uint32_t color_width;
+    uint32_t color_height;
+    uint32_t color_codec;
+    uint32_t reserved;
+};
+
+struct RGBDChunkHeader
+{
+    uint64_t timestamp_us;
+    uint32_t frame;
+    uint32_t depth_bytes;
+    uint32_t color_bytes;
+    uint32_t reserved;
+};
+
+struct RGBDIndexEntry
+{
+    uint64_t offset;
+    uint64_t timestamp_us;
+};
+
+struct RGBDFileTrailer
+{
+    uint64_t index_offset;
+    uint64_t frames;
+    char magic[4];
+    uint32_t version;
+};
+
+static_assert(sizeof(RGBDFileHeader) == 32 && sizeof(RGBDChunkHeader) == 24 && sizeof(RGBDIndexEntry) == 16 &&
+              sizeof(RGBDFileTrailer) == 24, "the on-disk structs must not be padded");
+
+namespace rgbd_codec
+{
+
+// MSB first bit packing
+class BitWriter
+{
+public:
+    BitWriter(std::vector<uint8_t> &out) :
+        out(out), bits(0), pending(0)
+    {
+        ;
+    };
+
+    // bits <= 32
+    inline void put(const uint32_t value, const int n)
+    {
+        bits = (bits << n) | value;
+        pending += n;
+        while (pending >= 8) {
+            pending -= 8;
+            out.push_back(uint8_t(bits >> pending));
+        }
+    };
+
+    inline void flush()
+    {
+        if (pending) {
+            out.push_back(uint8_t(bits << (8 - pending)));
+            pending = 0;
+        }
+    };
+
+protected:
+    std::vector<uint8_t> &out;
+    uint64_t bits;
+    int pending;
+};
+
+class BitReader
+{
+public:
+    BitReader(const uint8_t *data, const size_t size) :
+        p(data), end(data + size), bits(0), available(0)
+    {
+        ;
+    };
+
+    // bits <= 32
+    inline uint32_t get(const int n)
+    {
+        if (!n) {
+            return 0;
+        }
+        refill();
+        const uint32_t value = bits >> (64 - n);
+        bits <<= n;
+        available -= n;
+        return value;
+    };
+
+    // length of a run of zeros ended by a one, the one consumed
+    inline int get_unary()
+    {
+        refill();
+        // quotients are at most RGBD_DEPTH_ESCAPE long, the clamp only guards corrupted data
+        const int zeros = bits ? std::min(__builtin_clzll(bits), RGBD_DEPTH_ESCAPE) : RGBD_DEPTH_ESCAPE;
+        bits <<= zeros + 1;
+        available -= zeros + 1;
+        return zeros;
+    };
+
+protected:
+    inline void refill()
+    {
+        while (available <= 56) {
+            bits |= uint64_t(p < end ? *p++ : 0) << (56 - available);
+            available += 8;
+        }
+    };
+
+    const uint8_t *p;
+    const uint8_t *end;
+    uint64_t bits;
+    int available;
+};
+
+// zigzag(row[j] - predictor) for a row; the differences wrap around 16 bits, which keeps the mapping lossless
+inline void row_residuals(const uint16_t * const row, const uint16_t first_predictor, uint16_t * const residuals,
+                          const int cols)
+{
+    residuals[0] = uint16_t(row[0] - first_predictor);
+    int j = 1;
+    for (; j + 8 <= cols; j += 8) {
+        const __m128i difference = _mm_sub_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row + j)),
+                                                 _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + j - 1)));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(residuals + j), difference);
+    }
+    for (; j < cols; j++) {
+        residuals[j] = uint16_t(row[j] - row[j - 1]);
+    }
+
+    j = 0;
+    for (; j + 8 <= cols; j += 8) {
+        const __m128i difference = _mm_loadu_si128(reinterpret_cast<const __m128i *>(residuals + j));
+        const __m128i zigzag = _mm_xor_si128(_mm_slli_epi16(difference, 1), _mm_srai_epi16(difference, 15));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(residuals + j), zigzag);
+    }
+    for (; j < cols; j++) {
+        const int16_t difference = int16_t(residuals[j]);
+        residuals[j] = uint16_t((uint32_t(difference) << 1) ^ (difference >> 15));
+    }
+}
+
+inline void rice_encode(const uint16_t * const residuals, const int n, BitWriter &writer)
+{
+    for (int b = 0; b < n; b += RGBD_DEPTH_BLOCK) {
+        const int block = std::min(RGBD_DEPTH_BLOCK, n - b);
+        uint32_t sum = 0;
+        for (int i = 0; i < block; i++) {
+            sum += residuals[b + i];
+        }
+        const uint32_t mean = sum / block;
+        const int k = mean ? std::min(31 - __builtin_clz(mean), 15) : 0;
+        writer.put(k, 4);
+
+        for (int i = 0; i < block; i++) {
+            const uint32_t u = residuals[b + i];
+            const uint32_t q = u >> k;
+            if (q < uint32_t(RGBD_DEPTH_ESCAPE)) {
+                writer.put(1, q + 1);
+                writer.put(u & ((1u << k) - 1), k);
+            } else {
+                writer.put(1, RGBD_DEPTH_ESCAPE + 1);
+                writer.put(u, 16);
+            }
+        }
+    }
+}
+
+inline void rice_decode_row(BitReader &reader, const uint16_t first_predictor, uint16_t * const row, const int cols)
+{
+    uint16_t predictor = first_predictor;
+    for (int b = 0; b < cols; b += RGBD_DEPTH_BLOCK) {
+        const int block = std::min(RGBD_DEPTH_BLOCK, cols - b);
+        const int k = reader.get(4);
+        for (int i = 0; i < block; i++) {
+            const int q = reader.get_unary();
+            const uint32_t u = q == RGBD_DEPTH_ESCAPE ? reader.get(16) : (uint32_t(q) << k) | reader.get(k);
+            const uint16_t difference = uint16_t((u >> 1) ^ (0u - (u & 1)));
+            predictor = uint16_t(predictor + difference);
+            row[b + i] = predictor;
+        }
+    }
+}
+
+// depth: CV_16UC1
+inline void encode_depth(const cv::Mat &depth, std::vector<uint8_t> &out)
+{
+    std::vector<uint16_t> residuals(depth.cols);
+    BitWriter writer(out);
+    for (int i = 0; i < depth.rows; i++) {
+        const uint16_t *row = depth.ptr<uint16_t>(i);
+        const uint16_t first_predictor = i ? depth.ptr<uint16_t>(i - 1)[0] : 0;
+        row_residuals(row, first_predictor, residuals.data(), depth.cols);
+        rice_encode(residuals.data(), depth.cols, writer);
+    }
+    writer.flush();
+}
+
+inline void decode_depth(const uint8_t * const data, const size_t size, cv::Mat &depth)
+{
+    BitReader reader(data, size);
+    for (int i = 0; i < depth.rows; i++) {
+        const uint16_t first_predictor = i ? depth.ptr<uint16_t>(i - 1)[0] : 0;
+        rice_decode_row(reader, first_predictor, depth.ptr<uint16_t>(i), depth.cols);
+    }
+}
+
+}
+
+class RGBDContainerWriter
+{
+public:
+    RGBDContainerWriter() :
+        frames(0), color_codec(RGBDColorCodec::PNG), jpeg_quality(95)
+    {
+        ;
+    };
+
+    ~RGBDContainerWriter()
+    {
+        close();
+    };
+
+    bool open(const std::string &file_name, const cv::Size &color_size, const cv::Size &depth_size,
+              const RGBDColorCodec codec = RGBDColorCodec::PNG, const int quality = 95)
+    {
+        file.open(file_name, std::ios::binary | std::ios::trunc);
+        if (!file.is_open()) {
+            std::cerr << "Can't open " << file_name << " for writing." << std::endl;
+            return false;
+        }
+        color_codec = codec;
+        jpeg_quality = quality;
+        frames = 0;
+        index.clear();
+
+        RGBDFileHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, RGBD_MAGIC, sizeof(header.magic));
+        header.version = RGBD_VERSION;
+        header.depth_width = depth_size.width;
+        header.depth_height = depth_size.height;
+        header.color_width = color_size.width;
+        header.color_height = color_size.height;
+        header.color_codec = uint32_t(color_codec);
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        return bool(file);
+    };
+
+    // color CV_8UC3, depth CV_16UC1 mm or CV_32FC1 mm (rounded)
+    bool write(const cv::Mat &color, const cv::Mat &depth, const uint64_t timestamp_us)
+    {
+        cv::Mat depth_mm;
+        if (depth.type() == CV_16UC1) {
+            depth_mm = depth;
+        } else {
+            depth_to_mm(depth, depth_mm);
+        }
+
+        depth_payload.clear();
+        depth_payload.reserve(depth_mm.total());
+        rgbd_codec::encode_depth(depth_mm, depth_payload);
+
+        color_payload.clear();
+        if (color_codec == RGBDColorCodec::RAW) {
+            const cv::Mat color_continuous = color.isContinuous() ? color : color.clone();
+            color_payload.assign(color_continuous.data, color_continuous.data + color_continuous.total() * color_continuous.elemSize());
+        } else if (color_codec == RGBDColorCodec::PNG) {
+            cv::imencode(".png", color, color_payload, std::vector<int> {CV_IMWRITE_PNG_COMPRESSION, 1});
+        } else {
+            cv::imencode(".jpg", color, color_payload, std::vector<int> {CV_IMWRITE_JPEG_QUALITY, jpeg_quality});
+        }
+
+        RGBDChunkHeader chunk;
+        std::memset(&chunk, 0, sizeof(chunk));
+        chunk.timestamp_us = timestamp_us;
+        chunk.frame = frames;
+        chunk.depth_bytes = depth_payload.size();
+        chunk.color_bytes = color_payload.size();
+
+        const RGBDIndexEntry entry = {uint64_t(file.tellp()), timestamp_us};
+        index.push_back(entry);
+        file.write(reinterpret_cast<const char *>(&chunk), sizeof(chunk));
+        file.write(reinterpret_cast<const char *>(depth_payload.data()), depth_payload.size());
+        file.write(reinterpret_cast<const char *>(color_payload.data()), color_payload.size());
+        frames++;
+        return bool(file);
+    };
+
+    // writes the index and the trailer
+    void close()
+    {
+        if (!file.is_open()) {
+            return;
+        }
+        const uint64_t end = file.tellp();
+        const uint64_t index_offset = (end + 7) & ~uint64_t(7);
+        const char padding[8] = {0};
+        file.write(padding, index_offset - end);
+        file.write(reinterpret_cast<const char *>(index.data()), index.size() * sizeof(RGBDIndexEntry));
+
+        RGBDFileTrailer trailer;
+        std::memset(&trailer, 0, sizeof(trailer));
+        trailer.index_offset = index_offset;
+        trailer.frames = frames;
+        std::memcpy(trailer.magic, RGBD_TRAILER_MAGIC, sizeof(trailer.magic));
+        trailer.version = RGBD_VERSION;
+        file.write(reinterpret_cast<const char *>(&trailer), sizeof(trailer));
+        file.close();
+    };
+
+    inline size_t get_frames() const
+    {
+        return frames;
+    };
+
+protected:
+    std::ofstream file;
+    size_t frames;
+    RGBDColorCodec color_codec;
+    int jpeg_quality;
+    std::vector<RGBDIndexEntry> index;
+    std::vector<uint8_t> depth_payload;
+    std::vector<uint8_t> color_payload;
+};
+
+class RGBDContainerReader
+{
+public:
+    RGBDContainerReader() :
+        data(nullptr), size(0), index(nullptr), frames(0), chunks_end(0)
+    {
+        ;
+    };
+
+    ~RGBDContainerReader()
+    {
+        close();
+    };
+
+    bool open(const std::string &file_name)
+    {
+        close();
+        const int fd = ::open(file_name.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Can't open " << file_name << '.' << std::endl;
+            return false;
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) || size_t(file_stat.st_size) < sizeof(RGBDFileHeader)) {
+            std::cerr << file_name << " is not an RGB-D container." << std::endl;
+            ::close(fd);
+            return false;
+        }
+        size = file_stat.st_size;
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            std::cerr << "Can't map " << file_name << '.' << std::endl;
+            size = 0;
+            return false;
+        }
+        data = static_cast<const uint8_t *>(mapping);
+
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic, RGBD_MAGIC, sizeof(header.magic)) || header.version != RGBD_VERSION) {
+            std::cerr << file_name << " is not an RGB-D container." << std::endl;
+            close();
+            return false;
+        }
+
+        if (!map_index()) {
+            std::cerr << file_name << " has no index, rebuilding it." << std::endl;
+            rebuild_index();
+        }
+        return true;
+    };
+
+    void close()
+    {
+        if (data) {
+            munmap(const_cast<uint8_t *>(data), size);
+        }
+        data = nullptr;
+        size = 0;
+        index = nullptr;
+        frames = 0;
+        chunks_end = 0;
+        rebuilt_index.clear();
+    };
+
+    inline size_t get_frames() const
+    {
+        return frames;
+    };
+
+    inline uint64_t get_timestamp(const size_t frame) const
+    {
+        return index[frame].timestamp_us;
+    };
+
+    inline cv::Size get_color_size() const
+    {
+        return cv::Size(header.color_width, header.color_height);
+    };
+
+    inline cv::Size get_depth_size() const
+    {
+        return cv::Size(header.depth_width, header.depth_height);
+    };
+
+    // first frame recorded at or after timestamp_us, get_frames() if none
+    size_t find_frame(const uint64_t timestamp_us) const
+    {
+        const RGBDIndexEntry *entry = std::lower_bound(index, index + frames, timestamp_us,
+            [](const RGBDIndexEntry &e, const uint64_t t) {
+                return e.timestamp_us < t;
+            });
+        return entry - index;
+    };
+
+    // color CV_8UC3, depth CV_16UC1 mm; false if the chunk of the frame doesn't fit in the file
+    bool read(const size_t frame, cv::Mat &color, cv::Mat &depth) const
+    {
+        if (frame >= frames) {
+            return false;
+        }
+        // the index and the chunk sizes come from the file: a truncated or corrupted one must not read past the mapping
+        const uint64_t offset = index[frame].offset;
+        if (offset < sizeof(RGBDFileHeader) || offset > chunks_end || chunks_end - offset < sizeof(RGBDChunkHeader)) {
+            std::cerr << "Frame " << frame << " is out of the RGB-D container." << std::endl;
+            return false;
+        }
+        RGBDChunkHeader chunk;
+        std::memcpy(&chunk, data + offset, sizeof(chunk));
+        const uint64_t payload_bytes = chunks_end - offset - sizeof(chunk);
+        const bool raw_color = RGBDColorCodec(header.color_codec) == RGBDColorCodec::RAW;
+        if (chunk.frame != frame || uint64_t(chunk.depth_bytes) + chunk.color_bytes > payload_bytes ||
+            (raw_color && chunk.color_bytes < uint64_t(header.color_width) * header.color_height * 3)) {
+            std::cerr << "The chunk of frame " << frame << " of the RGB-D container is corrupted." << std::endl;
+            return false;
+        }
+        const uint8_t *depth_data = data + offset + sizeof(chunk);
+        const uint8_t *color_data = depth_data + chunk.depth_bytes;
+
+        depth.create(header.depth_height, header.depth_width, CV_16UC1);
+        rgbd_codec::decode_depth(depth_data, chunk.depth_bytes, depth);
+
+        const cv::Mat color_payload(1, chunk.color_bytes, CV_8UC1, const_cast<uint8_t *>(color_data));
+        if (raw_color) {
+            cv::Mat(header.color_height, header.color_width, CV_8UC3, const_cast<uint8_t *>(color_data)).copyTo(color);
+        } else {
+            color = cv::imdecode(color_payload, CV_LOAD_IMAGE_COLOR);
+        }
+        return true;
+    };
+
+protected:
+    bool map_index()
+    {
+        if (size < sizeof(RGBDFileHeader) + sizeof(RGBDFileTrailer)) {
+            return false;
+        }
+        RGBDFileTrailer trailer;
+        std::memcpy(&trailer, data + size - sizeof(trailer), sizeof(trailer));
+        // frames bounded first, so the sum can't wrap around
+        const uint64_t max_frames = (size - sizeof(RGBDFileHeader) - sizeof(trailer)) / sizeof(RGBDIndexEntry);
+        if (std::memcmp(trailer.magic, RGBD_TRAILER_MAGIC, sizeof(trailer.magic)) || trailer.frames > max_frames ||
+            trailer.index_offset < sizeof(RGBDFileHeader) ||
+            trailer.index_offset + trailer.frames * sizeof(RGBDIndexEntry) + sizeof(trailer) != size) {
+            return false;
+        }
+        index = reinterpret_cast<const RGBDIndexEntry *>(data + trailer.index_offset);
+        frames = trailer.frames;
+        chunks_end = trailer.index_offset;
+        return true;
+    };
+
+    void rebuild_index()
+    {
+        uint64_t offset = sizeof(RGBDFileHeader);
+        RGBDChunkHeader chunk;
+        while (offset + sizeof(chunk) <= size) {
+            std::memcpy(&chunk, data + offset, sizeof(chunk));
+            const uint64_t next = offset + sizeof(chunk) + uint64_t(chunk.depth_bytes) + chunk.color_bytes;
+            if (chunk.frame != rebuilt_index.size() || next > size) {
+                break;
+            }
+            const RGBDIndexEntry entry = {offset, chunk.timestamp_us};
+            rebuilt_index.push_back(entry);
+            offset = next;
+        }
+        index = rebuilt_index.data();
+        frames = rebuilt_index.size();
+        chunks_end = offset;
+    };
+
+    const uint8_t *data;
+    size_t size;
+    RGBDFileHeader header;
+    const RGBDIndexEntry *index;
+    size_t frames;
+    // end of the last chunk, where the index starts
+    uint64_t chunks_end;
+    std::vector<RGBDIndexEntry> rebuilt_index;
+};
@@ -0,0 +1,397 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <opencv2/opencv.hpp>
+
+// Sidecar index of a recording made of several AVI videos of the same frames (Kinect2VideoReader: colour and the two
+// depth halves). For every frame of the first video stream of every file it keeps the byte offset and size of the
+// frame chunk, whether it is a keyframe, and the frame time from the stream rate:
+//
+//   RecordingIndexHeader
+//   per video: RecordingStreamHeader
+//   per video: one RecordingIndexEntry per frame
+//
+// All the fields are little endian. The index is built once by walking the RIFF chunks of the videos (AVI and
+// OpenDML AVIX parts, keyframes from the ix00 or idx1 indexes) and saved next to them; it is rebuilt when the size
+// of a video changes.
+//
+// The videos stay mapped: streams of intra-only image codecs (PNG, MJPEG) decode any frame straight from its chunk,
+// so seeking is exact and costs one frame decode. Other codecs can seek their decoder to keyframe_before(frame) and
+// decode forward from there.
+
+constexpr char RECORDING_INDEX_MAGIC[4] = {'K', '2', 'I', 'X'};
+constexpr uint32_t RECORDING_INDEX_VERSION = 1;
+constexpr uint32_t RECORDING_INDEX_KEYFRAME = 1;
+
+struct RecordingIndexHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t streams;
+    uint32_t reserved;
+};
+
+struct RecordingStreamHeader
+{
+    uint64_t file_size;
+    uint64_t frames;
+    uint32_t fourcc;
+    // frame time = frame * scale / rate seconds
+    uint32_t rate;
+    uint32_t scale;
+    uint32_t reserved;
+};
+
+struct RecordingIndexEntry
+{
+    uint64_t offset;
+    uint32_t size;
+    uint32_t flags;
+};
+
+static_assert(sizeof(RecordingIndexHeader) == 16 && sizeof(RecordingStreamHeader) == 32 &&
+              sizeof(RecordingIndexEntry) == 16, "the on-disk structs must not be padded");
+
+class RecordingStream
+{
+public:
+    RecordingStream() :
+        data(nullptr), size(0), stream_lists(0)
+    {
+        std::memset(&header, 0, sizeof(header));
+    };
+
+    ~RecordingStream()
+    {
+        close();
+    };
+
+    RecordingStream(const RecordingStream &) = delete;
+    RecordingStream &operator=(const RecordingStream &) = delete;
+
+    bool map(const std::string &file_name)
+    {
+        close();
+        const int fd = ::open(file_name.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Can't open " << file_name << '.' << std::endl;
+            return false;
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) || !file_stat.st_size) {
+            std::cerr << file_name << " is empty." << std::endl;
+            ::close(fd);
+            return false;
+        }
+        size = file_stat.st_size;
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED) {
+            std::cerr << "Can't map " << file_name << '.' << std::endl;
+            size = 0;
+            return false;
+        }
+        data = static_cast<const uint8_t *>(mapping);
+        return true;
+    };
+
+    void close()
+    {
+        if (data) {
+            munmap(const_cast<uint8_t *>(data), size);
+        }
+        data = nullptr;
+        size = 0;
+    };
+
+    // walks the chunks of the mapped video
+    bool build()
+    {
+        entries.clear();
+        idx1_keyframes.clear();
+        ix_keyframes.clear();
+        stream_lists = 0;
+        std::memset(&header, 0, sizeof(header));
+        header.file_size = size;
+
+        size_t position = 0;
+        while (position + 12 <= size) {
+            const uint32_t riff_size = read32(position + 4);
+            const uint32_t riff_type = read32(position + 8);
+            if (read32(position) != fourcc("RIFF") || (riff_type != fourcc("AVI ") && riff_type != fourcc("AVIX"))) {
+                break;
+            }
+            walk(position + 12, std::min(size_t(position + 8 + riff_size), size));
+            position += 8 + size_t(riff_size) + (riff_size & 1);
+        }
+        if (entries.empty()) {
+            return false;
+        }
+
+        // empty chunks repeat the previous frame
+        for (size_t i = 1; i < entries.size(); i++) {
+            if (!entries[i].size) {
+                entries[i].offset = entries[i - 1].offset;
+                entries[i].size = entries[i - 1].size;
+            }
+        }
+
+        const std::vector<bool> &keyframes = ix_keyframes.size() == entries.size() ? ix_keyframes : idx1_keyframes;
+        for (size_t i = 0; i < entries.size(); i++) {
+            const bool keyframe = keyframes.size() == entries.size() ? keyframes[i] : (intra() || i == 0);
+            entries[i].flags = keyframe ? RECORDING_INDEX_KEYFRAME : 0;
+        }
+        header.frames = entries.size();
+        return true;
+    };
+
+    inline size_t get_frames() const
+    {
+        return entries.size();
+    };
+
+    inline size_t get_file_size() const
+    {
+        return size;
+    };
+
+    inline uint64_t get_timestamp_us(const size_t frame) const
+    {
+        return header.rate ? uint64_t(double(frame) * header.scale * 1e6 / header.rate + 0.5) : 0;
+    };
+
+    inline size_t keyframe_before(const size_t frame) const
+    {
+        size_t k = std::min(frame, entries.size() - 1);
+        while (k && !(entries[k].flags & RECORDING_INDEX_KEYFRAME)) {
+            k--;
+        }
+        return k;
+    };
+
+    // every frame is a still image imdecode reads
+    inline bool intra() const
+    {
+        return header.fourcc == fourcc("MPNG") || header.fourcc == fourcc("png ") ||
+               header.fourcc == fourcc("PNG ") || header.fourcc == fourcc("MJPG") || header.fourcc == fourcc("mjpg");
+    };
+
+    inline bool direct() const
+    {
+        return data && intra();
+    };
+
+    // frame decoded from its chunk into image (BGR, its buffer reused when the size matches)
+    bool decode(const size_t frame, cv::Mat &image) const
+    {
+        if (!direct() || frame >= entries.size()) {
+            return false;
+        }
+        const RecordingIndexEntry &entry = entries[frame];
+        if (!entry.size || entry.offset + entry.size > size) {
+            return false;
+        }
+        const cv::Mat chunk(1, entry.size, CV_8UC1, const_cast<uint8_t *>(data + entry.offset));
+        cv::imdecode(chunk, CV_LOAD_IMAGE_COLOR, &image);
+        return !image.empty();
+    };
+
+    RecordingStreamHeader header;
+    std::vector<RecordingIndexEntry> entries;
+
+protected:
+    static inline uint32_t fourcc(const char * const code)
+    {
+        return uint32_t(uint8_t(code[0])) | uint32_t(uint8_t(code[1])) << 8 |
+               uint32_t(uint8_t(code[2])) << 16 | uint32_t(uint8_t(code[3])) << 24;
+    };
+
+    inline uint32_t read32(const size_t position) const
+    {
+        uint32_t value;
+        std::memcpy(&value, data + position, sizeof(value));
+        return value;
+    };
+
+    inline uint16_t read16(const size_t position) const
+    {
+        uint16_t value;
+        std::memcpy(&value, data + position, sizeof(value));
+        return value;
+    };
+
+    // chunks of [begin, end), into the LISTs
+    void walk(const size_t begin, const size_t end)
+    {
+        size_t position = begin;
+        while (position + 8 <= end) {
+            const uint32_t id = read32(position);
+            const uint32_t chunk_size = read32(position + 4);
+            const size_t body = position + 8;
+            const size_t body_end = std::min(body + chunk_size, end);
+
+            if (id == fourcc("LIST") && body + 4 <= body_end) {
+                if (read32(body) == fourcc("strl")) {
+                    stream_lists++;
+                }
+                walk(body + 4, body_end);
+            } else if (id == fourcc("strh") && stream_lists == 1 && body + 32 <= body_end) {
+                header.fourcc = read32(body + 4);
+                header.scale = read32(body + 20);
+                header.rate = read32(body + 24);
+            } else if (id == fourcc("strf") && stream_lists == 1 && body + 20 <= body_end) {
+                // the BITMAPINFOHEADER compression names the codec when the stream header does not
+                const uint32_t compression = read32(body + 16);
+                if (compression) {
+                    header.fourcc = compression;
+                }
+            } else if (id == fourcc("00dc") || id == fourcc("00db")) {
+                entries.push_back(RecordingIndexEntry{uint64_t(body), uint32_t(body_end - body), 0});
+            } else if (id == fourcc("idx1")) {
+                for (size_t entry = body; entry + 16 <= body_end; entry += 16) {
+                    const uint32_t chunk_id = read32(entry);
+                    if (chunk_id == fourcc("00dc") || chunk_id == fourcc("00db")) {
+                        // AVIIF_KEYFRAME
+                        idx1_keyframes.push_back(read32(entry + 4) & 0x10);
+                    }
+                }
+            } else if (id == fourcc("ix00") && body + 24 <= body_end) {
+                // OpenDML standard index: 8 byte entries {offset, size}, bit 31 of the size set for delta frames
+                const uint16_t longs_per_entry = read16(body);
+                const uint32_t entries_in_use = read32(body + 4);
+                const size_t entry_bytes = std::max<size_t>(longs_per_entry, 2) * 4;
+                for (size_t i = 0, entry = body + 24; i < entries_in_use && entry + 8 <= body_end; i++, entry += entry_bytes) {
+                    ix_keyframes.push_back(!(read32(entry + 4) & 0x80000000u));
+                }
+            }
+            position = body + size_t(chunk_size) + (chunk_size & 1);
+        }
+    };
+
+    const uint8_t *data;
+    size_t size;
+    int stream_lists;
+    std::vector<bool> idx1_keyframes;
+    std::vector<bool> ix_keyframes;
+};
+
+class RecordingIndex
+{
+public:
+    RecordingIndex()
+    {
+        ;
+    };
+
+    // maps the videos; loads the index saved in index_file_name if it matches them, builds and saves it otherwise
+    bool open(const std::vector<std::string> &video_file_names, const std::string &index_file_name)
+    {
+        streams.clear();
+        for (size_t i = 0; i < video_file_names.size(); i++) {
+            streams.emplace_back(new RecordingStream());
+            if (!streams.back()->map(video_file_names[i])) {
+                streams.clear();
+                return false;
+            }
+        }
+
+        if (load(index_file_name)) {
+            return true;
+        }
+        for (size_t i = 0; i < streams.size(); i++) {
+            if (!streams[i]->build()) {
+                std::cerr << video_file_names[i] << " can't be indexed." << std::endl;
+                streams.clear();
+                return false;
+            }
+        }
+        if (!save(index_file_name)) {
+            std::cerr << "Can't save the recording index " << index_file_name << '.' << std::endl;
+        }
+        return true;
+    };
+
+    inline bool empty() const
+    {
+        return streams.empty();
+    };
+
+    inline size_t get_streams() const
+    {
+        return streams.size();
+    };
+
+    inline const RecordingStream &stream(const size_t i) const
+    {
+        return *streams[i];
+    };
+
+    // frames present in every video
+    size_t get_frames() const
+    {
+        size_t frames = streams.empty() ? 0 : streams[0]->get_frames();
+        for (const auto &stream : streams) {
+            frames = std::min(frames, stream->get_frames());
+        }
+        return frames;
+    };
+
+protected:
+    bool load(const std::string &index_file_name)
+    {
+        std::ifstream file(index_file_name, std::ios::binary);
+        RecordingIndexHeader header;
+        if (!file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+            std::memcmp(header.magic, RECORDING_INDEX_MAGIC, sizeof(header.magic)) ||
+            header.version != RECORDING_INDEX_VERSION || header.streams != streams.size()) {
+            return false;
+        }
+        for (auto &stream : streams) {
+            // a video whose size changed since has to be indexed again
+            if (!file.read(reinterpret_cast<char *>(&stream->header), sizeof(stream->header)) ||
+                stream->header.file_size != stream->get_file_size()) {
+                return false;
+            }
+        }
+        for (auto &stream : streams) {
+            stream->entries.resize(stream->header.frames);
+            if (!file.read(reinterpret_cast<char *>(stream->entries.data()), stream->entries.size() * sizeof(RecordingIndexEntry))) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    bool save(const std::string &index_file_name) const
+    {
+        std::ofstream file(index_file_name, std::ios::binary | std::ios::trunc);
+        RecordingIndexHeader header;
+        std::memcpy(header.magic, RECORDING_INDEX_MAGIC, sizeof(header.magic));
+        header.version = RECORDING_INDEX_VERSION;
+        header.streams = streams.size();
+        header.reserved = 0;
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        for (const auto &stream : streams) {
+            file.write(reinterpret_cast<const char *>(&stream->header), sizeof(stream->header));
+        }
+        for (const auto &stream : streams) {
+            file.write(reinterpret_cast<const char *>(stream->entries.data()), stream->entries.size() * sizeof(RecordingIndexEntry));
+        }
+        return bool(file);
+    };
+
+    std::vector<std::unique_ptr<RecordingStream>> streams;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+// Counting semaphore for the threads that wait on a BoundedQueue: the producer posts once per value pushed and the
+// consumer waits before popping, so it sleeps while the queue is empty instead of polling it.
+class Semaphore
+{
+public:
+    explicit Semaphore(const size_t count = 0) :
+        count(count)
+    {
+        ;
+    };
+
+    Semaphore(const Semaphore &) = delete;
+    Semaphore &operator=(const Semaphore &) = delete;
+
+    void post()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            count++;
+        }
+        available.notify_one();
+    };
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        available.wait(lock, [this]() { return count > 0; });
+        count--;
+    };
+
+    // false instead of waiting
+    bool try_wait()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!count) {
+            return false;
+        }
+        count--;
+        return true;
+    };
+
+protected:
+    size_t count;
+    std::mutex mutex;
+    std::condition_variable available;
+};
@@ -0,0 +1,183 @@
+#pragma once
+
+#include <vector>
+
+#include "project_config.h"
+
+IGNORE_WARNINGS_PUSH
+
+#include <mrpt/otherlibs/do_opencv_includes.h>
+
+IGNORE_WARNINGS_POP
+
+#include "MiscHelpers.h"
+
+// Image stored in 8x8 pixel tiles. The tiles are Z-ordered inside blocks of 8x8 tiles (64x64 pixels) and
+// the blocks are stored row-major, so a particle ROI or a contour gather touches a handful of cache lines
+// instead of one per image row. The pixels of a tile are row-major, so every tile row is a contiguous run.
+//
+// The storage is a regular cv::Mat with the dimensions rounded up to the block size and the same type as the
+// source image, which lets a tiled frame travel through a CSensoryFrame like any other image. The layout is
+// separable: index(y, x) = row_offset[y] + col_offset[x].
+
+constexpr int TILED_IMAGE_TILE_BITS = 3;
+constexpr int TILED_IMAGE_TILE_SIZE = 1 << TILED_IMAGE_TILE_BITS;
+constexpr int TILED_IMAGE_BLOCK_BITS = 3;
+constexpr int TILED_IMAGE_BLOCK_SIZE = TILED_IMAGE_TILE_SIZE << TILED_IMAGE_BLOCK_BITS;
+
+template<typename T>
+class TiledImage
+{
+public:
+    TiledImage() = default;
+
+    // wraps a storage matrix that is already in tiled layout (as returned by get_storage)
+    explicit TiledImage(const cv::Mat &tiled_storage) :
+        storage(tiled_storage)
+    {
+        assert(storage.isContinuous());
+        assert(storage.rows % TILED_IMAGE_BLOCK_SIZE == 0 && storage.cols % TILED_IMAGE_BLOCK_SIZE == 0);
+        assert(storage.elemSize() == sizeof(T));
+        build_offsets();
+    }
+
+    static TiledImage from_mat(const cv::Mat &image)
+    {
+        assert(image.elemSize() == sizeof(T));
+        TiledImage tiled;
+        tiled.storage.create(padded(image.rows), padded(image.cols), image.type());
+        tiled.build_offsets();
+
+        auto copy_row = [&](const int i) {
+            const T *src = image.ptr<T>(i);
+            T *dst = tiled.data() + tiled.row_offsets[i];
+            for (int j = 0; j < image.cols; j += TILED_IMAGE_TILE_SIZE) {
+                const int run = std::min(TILED_IMAGE_TILE_SIZE, image.cols - j);
+                std::copy(src + j, src + j + run, dst + tiled.col_offsets[j]);
+            }
+        };
+
+#ifdef USE_INTEL_TBB
+        tbb::parallel_for(tbb::blocked_range<int>(0, image.rows, image.rows / TBB_PARTITIONS),
+            [&](const tbb::blocked_range<int> &r) {
+                for (int i = r.begin(); i < r.end(); i++) {
+                    copy_row(i);
+                }
+            }
+        );
+#else
+        for (int i = 0; i < image.rows; i++) {
+            copy_row(i);
+        }
+#endif
+        return tiled;
+    }
+
+    inline const T &at(const int y, const int x) const
+    {
+        return data()[row_offsets[y] + col_offsets[x]];
+    }
+
+    // pointer to (y, x); the following min(length, TILED_IMAGE_TILE_SIZE - (x % TILED_IMAGE_TILE_SIZE)) pixels
+    // of the row are contiguous
+    inline const T *run_ptr(const int y, const int x) const
+    {
+        return data() + row_offsets[y] + col_offsets[x];
+    }
+
+    // calls f(i, j, pixels, length) for each contiguous run of the rows of the region, (i, j) relative to it
+    template<typename F>
+    inline void for_each_run(const cv::Rect &region, F f) const
+    {
+        const int x_1 = region.x + region.width;
+        for (int i = 0; i < region.height; i++) {
+            const int y = region.y + i;
+            const T *row = data() + row_offsets[y];
+            int x = region.x;
+            while (x < x_1) {
+                const int length = std::min(TILED_IMAGE_TILE_SIZE - (x & (TILED_IMAGE_TILE_SIZE - 1)), x_1 - x);
+                f(i, x - region.x, row + col_offsets[x], length);
+                x += length;
+            }
+        }
+    }
+
+    cv::Mat to_mat(const cv::Size &size) const
+    {
+        cv::Mat image(size.height, size.width, storage.type());
+        for (int i = 0; i < size.height; i++) {
+            T *dst = image.ptr<T>(i);
+            for (int j = 0; j < size.width; j++) {
+                dst[j] = at(i, j);
+            }
+        }
+        return image;
+    }
+
+    inline const cv::Mat &get_storage() const
+    {
+        return storage;
+    }
+
+    inline int rows() const
+    {
+        return storage.rows;
+    }
+
+    inline int cols() const
+    {
+        return storage.cols;
+    }
+
+    inline bool empty() const
+    {
+        return storage.empty();
+    }
+
+protected:
+    static inline int padded(const int n)
+    {
+        return (n + TILED_IMAGE_BLOCK_SIZE - 1) / TILED_IMAGE_BLOCK_SIZE * TILED_IMAGE_BLOCK_SIZE;
+    }
+
+    inline T *data()
+    {
+        return reinterpret_cast<T *>(storage.data);
+    }
+
+    inline const T *data() const
+    {
+        return reinterpret_cast<const T *>(storage.data);
+    }
+
+    void build_offsets()
+    {
+        constexpr int tile_mask = TILED_IMAGE_TILE_SIZE - 1;
+        constexpr int block_mask = (1 << TILED_IMAGE_BLOCK_BITS) - 1;
+        constexpr int tile_pixels_bits = 2 * TILED_IMAGE_TILE_BITS;
+        constexpr int block_pixels_bits = 2 * (TILED_IMAGE_TILE_BITS + TILED_IMAGE_BLOCK_BITS);
+        const int blocks_per_row = storage.cols / TILED_IMAGE_BLOCK_SIZE;
+
+        col_offsets.resize(storage.cols);
+        for (int x = 0; x < storage.cols; x++) {
+            const int tile_x = x >> TILED_IMAGE_TILE_BITS;
+            const int block_x = tile_x >> TILED_IMAGE_BLOCK_BITS;
+            col_offsets[x] = (x & tile_mask)
+                             + (int(morton_spread_bits(tile_x & block_mask)) << tile_pixels_bits)
+                             + (block_x << block_pixels_bits);
+        }
+
+        row_offsets.resize(storage.rows);
+        for (int y = 0; y < storage.rows; y++) {
+            const int tile_y = y >> TILED_IMAGE_TILE_BITS;
+            const int block_y = tile_y >> TILED_IMAGE_BLOCK_BITS;
+            row_offsets[y] = ((y & tile_mask) << TILED_IMAGE_TILE_BITS)
+                             + (int(morton_spread_bits(tile_y & block_mask) << 1) << tile_pixels_bits)
+                             + ((block_y * blocks_per_row) << block_pixels_bits);
+        }
+    }
+
+    cv::Mat storage;
+    std::vector<int> row_offsets;
+    std::vector<int> col_offsets;
+};
@@ -2,10 +2,12 @@
 
 #include "StateEstimation.h"
 #include "EllipseStash.h"
+#include "DepthLikelihood.h"
+#include "DepthStatistics.h"
 //CDisplayWindow image2("image2");
 
 template<typename DEPTH_TYPE>
-bool init_tracking(const cv::Point &center, float center_depth, const cv::Mat &hsv_frame, const cv::Mat &depth_frame,
+bool init_tracking(const cv::Point &center, float center_depth, const cv::Mat &hsv_frame, const DepthStatistics &depth_statistics,
                    const vector<Eigen::Vector2f> &shape_model, CImageParticleFilter<DEPTH_TYPE> &particles,
                    StateEstimation &state, EllipseStash &ellipses, const ImageRegistration &reg)
 {
@@ -28,13 +30,7 @@ bool init_tracking(const cv::Point &center, float center_depth, const cv::Mat &h
     state.region = cv::Rect(center.x - state.radius_x, center.y - state.radius_y, mask.cols, mask.rows);
 
     const cv::Mat hsv_roi = hsv_frame(state.region);
-    const cv::Mat depth_roi = depth_frame(state.region);
-    cv::Mat depth_roi_masked;
-    depth_roi.copyTo(depth_roi_masked, mask);
-
-    float non_zero = cv::countNonZero(depth_roi_masked);
-    cv::Scalar sum = cv::sum(depth_roi_masked);
-    state.average_z = sum[0] / non_zero;
+    state.average_z = depth_statistics.mean(state.region.tl(), ellipses.get_ellipse_spans(BodyPart::HEAD, center_depth));
 
     /*
     {
@@ -63,8 +59,8 @@ bool init_tracking(const cv::Point &center, float center_depth, const cv::Mat &h
     //CHEST
     const cv::Mat torso_mask_weights = ellipses.get_ellipse_mask_weights(BodyPart::TORSO, center_depth);
 
-    Eigen::Vector2i torso_center = translate_2D_vector_in_3D_space(center.x, center.y, center_depth, HEAD_TO_TORSE_CENTER_VECTOR,
-                                   reg.cameraMatrix, reg.lookupX, reg.lookupY);
+    const cv::Point torso_offset = ellipses.get_torso_offset(center_depth);
+    Eigen::Vector2i torso_center = Eigen::Vector2i(center.x + torso_offset.x, center.y + torso_offset.y);
 
     const cv::Rect torso_rect = cv::Rect(cvRound(torso_center[0] - torso_mask_weights.cols * 0.5f),
                                          cvRound(torso_center[1] - torso_mask_weights.rows * 0.5f),
@@ -93,14 +89,13 @@ void do_tracking(CParticleFilter &PF, CImageParticleFilter<DEPTH_TYPE> &particle
 template <typename DEPTH_TYPE>
 void build_state_model(const CImageParticleFilter<DEPTH_TYPE> &particles,
                        const StateEstimation &old_state, StateEstimation &new_state,
-                       const cv::Mat &hsv_frame, const cv::Mat &depth_frame,
+                       const cv::Mat &hsv_frame, const DepthStatistics &depth_statistics,
                        EllipseStash &ellipses, const ImageRegistration &reg)
 {
     particles.get_mean(new_state.x, new_state.y, new_state.z, new_state.v_x, new_state.v_y, new_state.v_z);
     //printf("RADIUS STATE: %f %f %f\n", new_state.x, new_state.y, new_state.z);
     Eigen::Vector2i top_corner, bottom_corner;
-    const double center_measured_depth = depth_frame.at<DEPTH_TYPE>(cvRound(new_state.y),
-                                         cvRound(new_state.x));
+    const double center_measured_depth = depth_statistics.depth_at(cv::Point(cvRound(new_state.x), cvRound(new_state.y)));
     //TODO USE MEAN DEPTH OF THE ELLIPSE
     const double z = center_measured_depth > 0 ? center_measured_depth : old_state.z;
     new_state.z = z;
@@ -118,15 +113,7 @@ void build_state_model(const CImageParticleFilter<DEPTH_TYPE> &particles,
         return;
     }
 
-    {
-        const cv::Mat ellipse_mask = ellipses.get_ellipse_mask_1D(BodyPart::HEAD, z);
-        const cv::Mat depth_roi = depth_frame(new_state.region);
-        cv::Mat depth_roi_masked;
-        depth_roi.copyTo(depth_roi_masked, ellipse_mask);
-        float non_zero = cv::countNonZero(depth_roi_masked);
-        cv::Scalar sum = cv::sum(depth_roi_masked);
-        new_state.average_z = sum[0] / non_zero;
-    }
+    new_state.average_z = depth_statistics.mean(new_state.region.tl(), ellipses.get_ellipse_spans(BodyPart::HEAD, z));
 
     const cv::Mat mask_weights = ellipses.get_ellipse_mask_weights(BodyPart::HEAD, z);
     cv::Mat hsv_roi = hsv_frame(new_state.region);
@@ -137,8 +124,8 @@ void build_state_model(const CImageParticleFilter<DEPTH_TYPE> &particles,
     //in case the chest not visible the old model is kept.
     new_state.torso_color_model = old_state.torso_color_model;
 
-    Eigen::Vector2i torso_center = translate_2D_vector_in_3D_space(new_state.x, new_state.y, new_state.z, HEAD_TO_TORSE_CENTER_VECTOR,
-                                   reg.cameraMatrix, reg.lookupX, reg.lookupY);
+    const cv::Point torso_offset = ellipses.get_torso_offset(new_state.z);
+    Eigen::Vector2i torso_center = Eigen::Vector2i(int(new_state.x) + torso_offset.x, int(new_state.y) + torso_offset.y);
 
 
     const cv::Mat torso_mask_weights = ellipses.get_ellipse_mask_weights(BodyPart::TORSO, new_state.z);
@@ -152,7 +139,7 @@ void build_state_model(const CImageParticleFilter<DEPTH_TYPE> &particles,
     }
 
     //if the torso region fits inside the frame it fits into the depth frame as well, so no need to test bounds
-    const double torso_measured_depth = depth_frame.at<DEPTH_TYPE>(torso_center[1], torso_center[0]);
+    const double torso_measured_depth = depth_statistics.depth_at(cv::Point(torso_center[0], torso_center[1]));
 
     // under chest occlusion condition the chest color model should not be updated.
     if (std::abs(torso_measured_depth - new_state.z) > HEAD_TO_CHEST_Z_MAX_DIFFERENCE_MM) {
@@ -164,7 +151,7 @@ void build_state_model(const CImageParticleFilter<DEPTH_TYPE> &particles,
 }
 
 void score_visual_model(const StateEstimation &state, StateEstimation &new_state, const cv::Mat &gradient_vectors,
-                        const std::vector<Eigen::Vector2f> &shape_model, const boost::math::normal_distribution<float> &depth_normal_distribution, const bool object_found, const int index)
+                        const std::vector<Eigen::Vector2f> &shape_model, const DepthLikelihood &depth_likelihood, const bool object_found, const int index)
 {
     if (new_state.color_model.empty()) {
         new_state.score_total = -1;
@@ -183,7 +170,7 @@ void score_visual_model(const StateEstimation &state, StateEstimation &new_state
     new_state.torso_color_score = 1 - cv::compareHist(new_state.torso_color_model, state.torso_color_model,
                                   CV_COMP_BHATTACHARYYA);
 
-    new_state.score_z = 1 - (2 * cdf(depth_normal_distribution, std::abs(state.z - new_state.z)) - 1);
+    new_state.score_z = depth_likelihood(state.z - new_state.z);
 
     //const float score_z = object_found * new_state.score_z + !object_found * std::max(1.0, new_state.score_z * 1.25);
     new_state.score_total = new_state.score_color * new_state.score_shape * new_state.torso_color_score * new_state.score_z;
@@ -0,0 +1,178 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "DepthPacking.h"
+
+// Compares the shuffle kernels of DepthPacking.h with the byte loops and convertTo they replace, on Kinect v2
+// depth frames, and checks they give the same bytes. Fails if they don't, or if depth_to_mm mishandles the depths
+// out of the uint16 range or not finite.
+// Usage: depth_packing_benchmark [iterations]
+
+void pack_depth_scalar(const cv::Mat &depth, cv::Mat &plane_1_3, cv::Mat &plane_4)
+{
+    plane_1_3.create(depth.rows, depth.cols, CV_8UC3);
+    plane_4.create(depth.rows, depth.cols, CV_8UC3);
+    const size_t n = depth.total();
+    const uchar *depth_ptr = depth.data;
+    uchar *depth3_ptr = plane_1_3.data;
+    uchar *depth4_ptr = plane_4.data;
+    for (size_t i = 0; i < n; i++) {
+        depth3_ptr[3 * i + 0] = depth_ptr[4 * i + 0];
+        depth3_ptr[3 * i + 1] = depth_ptr[4 * i + 1];
+        depth3_ptr[3 * i + 2] = depth_ptr[4 * i + 2];
+        depth4_ptr[3 * i + 0] = depth_ptr[4 * i + 3];
+        depth4_ptr[3 * i + 1] = 0;
+        depth4_ptr[3 * i + 2] = 0;
+    }
+}
+
+void unpack_depth_scalar(const cv::Mat &plane_1_3, const cv::Mat &plane_4, cv::Mat &depth)
+{
+    depth.create(plane_1_3.rows, plane_1_3.cols, CV_32FC1);
+    const size_t n = depth.total();
+    uchar *depth_ptr = depth.data;
+    const uchar *depth3_ptr = plane_1_3.data;
+    const uchar *depth4_ptr = plane_4.data;
+    for (size_t i = 0; i < n; i++) {
+        depth_ptr[4 * i + 0] = depth3_ptr[3 * i + 0];
+        depth_ptr[4 * i + 1] = depth3_ptr[3 * i + 1];
+        depth_ptr[4 * i + 2] = depth3_ptr[3 * i + 2];
+        depth_ptr[4 * i + 3] = depth4_ptr[3 * i + 0];
+    }
+}
+
+// saturated to [0, 65535], NaN to 0
+uint16_t depth_to_mm_reference(const float depth)
+{
+    // NaN from the bit pattern, as std::isnan is folded to false under --fast-math
+    uint32_t bits;
+    std::memcpy(&bits, &depth, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000 || depth <= 0) {
+        return 0;
+    }
+    if (depth >= 65535) {
+        return 65535;
+    }
+    return uint16_t(std::nearbyint(depth));
+}
+
+// every edge case in both the SSE loop and the scalar tail
+bool check_depth_to_mm_edge_cases()
+{
+    const float inf = std::numeric_limits<float>::infinity();
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    const float depths[] = {inf, -inf, nan, -nan, 1e10f, -1e10f, 2147483648.0f, 4294967296.0f, 65535.4f,
+                            65535.6f, 65536.0f, 70000.0f, -1.0f, 0.5f, 1.5f, 2.5f, 4500.0f};
+    const int n_depths = sizeof(depths) / sizeof(depths[0]);
+    bool ok = true;
+    for (int tail = 0; tail < 2; tail++) {
+        // the 8 pixel SSE loop takes the first 8 * (n / 8), the others go through the scalar tail
+        const int n = 8 * (tail ? 1 : n_depths) + (tail ? n_depths : 0);
+        cv::Mat depth(1, n, CV_32FC1, cv::Scalar(1000));
+        for (int k = 0; k < n_depths; k++) {
+            depth.at<float>(0, tail ? 8 + k : 8 * k) = depths[k];
+        }
+        cv::Mat mm;
+        depth_to_mm(depth, mm);
+        for (int i = 0; i < n; i++) {
+            const float d = depth.at<float>(0, i);
+            if (mm.at<uint16_t>(0, i) != depth_to_mm_reference(d)) {
+                std::cout << "  to_mm " << (tail ? "tail " : "SSE ") << d << " -> " << mm.at<uint16_t>(0, i)
+                          << " expected " << depth_to_mm_reference(d) << std::endl;
+                ok = false;
+            }
+        }
+    }
+    return ok;
+}
+
+bool same_bytes(const cv::Mat &a, const cv::Mat &b)
+{
+    return a.size() == b.size() && a.type() == b.type() &&
+           std::memcmp(a.data, b.data, a.total() * a.elemSize()) == 0;
+}
+
+// bytes: read and written per call
+template<typename F>
+void run_benchmark(const std::string &name, const int iterations, const size_t bytes, F f)
+{
+    const uint64_t t0 = cv::getTickCount();
+    for (int k = 0; k < iterations; k++) {
+        f();
+    }
+    const double t = (cv::getTickCount() - t0) / double(cv::getTickFrequency());
+    std::cout << name << " TIME " << t / iterations * 1e6 << " us/frame BANDWIDTH "
+              << bytes * double(iterations) / t * 1e-9 << " GB/s" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    const int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    const cv::Size sizes[] = {cv::Size(512, 424), cv::Size(1920, 1080)};
+    bool ok = check_depth_to_mm_edge_cases();
+    std::cout << "EDGE_CASES to_mm " << ok << std::endl;
+
+    for (const cv::Size &size : sizes) {
+        cv::Mat depth(size, CV_32FC1);
+        cv::randu(depth, cv::Scalar(0), cv::Scalar(8000));
+        const size_t n = depth.total();
+        std::cout << "DEPTH " << size.width << 'x' << size.height << std::endl;
+
+        cv::Mat plane_1_3, plane_4, plane_1_3_reference, plane_4_reference;
+        pack_depth_scalar(depth, plane_1_3_reference, plane_4_reference);
+        pack_depth(depth, plane_1_3, plane_4);
+        cv::Mat unpacked, unpacked_reference;
+        unpack_depth_scalar(plane_1_3_reference, plane_4_reference, unpacked_reference);
+        unpack_depth(plane_1_3, plane_4, unpacked);
+        cv::Mat mm, mm_reference, depth_mm, depth_mm_reference;
+        depth.convertTo(mm_reference, CV_16UC1);
+        depth_to_mm(depth, mm);
+        mm_reference.convertTo(depth_mm_reference, CV_32FC1);
+        mm_to_depth(mm, depth_mm);
+        const bool same_pack = same_bytes(plane_1_3, plane_1_3_reference) && same_bytes(plane_4, plane_4_reference);
+        const bool same_unpack = same_bytes(unpacked, depth) && same_bytes(unpacked_reference, depth);
+        const bool same_to_mm = same_bytes(mm, mm_reference);
+        const bool same_from_mm = same_bytes(depth_mm, depth_mm_reference);
+        std::cout << "  SAME_BYTES pack " << same_pack << " unpack " << same_unpack << " to_mm " << same_to_mm
+                  << " from_mm " << same_from_mm << std::endl;
+        ok = ok && same_pack && same_unpack && same_to_mm && same_from_mm;
+
+        run_benchmark("  pack scalar         ", iterations, 10 * n, [&]() {
+            pack_depth_scalar(depth, plane_1_3, plane_4);
+        });
+        run_benchmark("  pack shuffle        ", iterations, 10 * n, [&]() {
+            pack_depth(depth, plane_1_3, plane_4);
+        });
+        run_benchmark("  unpack scalar       ", iterations, 10 * n, [&]() {
+            unpack_depth_scalar(plane_1_3, plane_4, unpacked);
+        });
+        run_benchmark("  unpack shuffle      ", iterations, 10 * n, [&]() {
+            unpack_depth(plane_1_3, plane_4, unpacked);
+        });
+        run_benchmark("  to mm convertTo     ", iterations, 6 * n, [&]() {
+            depth.convertTo(mm, CV_16UC1);
+        });
+        run_benchmark("  to mm SSE           ", iterations, 6 * n, [&]() {
+            depth_to_mm(depth, mm);
+        });
+        run_benchmark("  from mm convertTo   ", iterations, 6 * n, [&]() {
+            mm.convertTo(depth_mm, CV_32FC1);
+        });
+        run_benchmark("  from mm SSE         ", iterations, 6 * n, [&]() {
+            mm_to_depth(mm, depth_mm);
+        });
+        // a plain copy of the float frame as the memory bandwidth reference
+        cv::Mat copy;
+        run_benchmark("  copyTo              ", iterations, 8 * n, [&]() {
+            depth.copyTo(copy);
+        });
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,101 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <opencv2/opencv.hpp>
+
+#include "FrameBus.h"
+#include "Kinect2FrameBusFeed.h"
+
+// Publishes on a frame bus of its own and reads it back in the same process, with the writer lapping the ring
+// under a grabbed view: the view must stay intact until the writer reaches its slot again and be rejected from
+// then on, and grab_copy must then give the newest frame whole.
+// Usage: frame_bus_check [bus name]
+
+const cv::Size CHECK_COLOR_SIZE(640, 360);
+const cv::Size CHECK_DEPTH_SIZE(512, 424);
+
+// every colour byte is k & 255, every depth k
+void publish_frame(FrameBusWriter &bus, const int k)
+{
+    cv::Mat color(CHECK_COLOR_SIZE.height, CHECK_COLOR_SIZE.width, CV_8UC3);
+    cv::Mat depth(CHECK_DEPTH_SIZE.height, CHECK_DEPTH_SIZE.width, CV_32FC1);
+    std::memset(color.data, k & 255, color.rows * color.cols * color.elemSize());
+    std::fill_n(reinterpret_cast<float *>(depth.data), depth.rows * depth.cols, float(k));
+    bus.publish(color, depth, 1000 + k);
+}
+
+// every pixel of both Mats comes from frame k
+bool is_frame(const cv::Mat &color, const cv::Mat &depth, const int k)
+{
+    if (color.empty() || depth.empty()) {
+        return false;
+    }
+    for (int i = 0; i < color.rows; i++) {
+        const uchar *color_row = color.ptr(i);
+        for (int j = 0; j < color.cols * 3; j++) {
+            if (color_row[j] != (k & 255)) {
+                return false;
+            }
+        }
+    }
+    for (int i = 0; i < depth.rows; i++) {
+        const float *depth_row = reinterpret_cast<const float *>(depth.ptr(i));
+        for (int j = 0; j < depth.cols; j++) {
+            if (depth_row[j] != float(k)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool check(const bool ok, const std::string &what)
+{
+    std::cout << "  " << what << ' ' << ok << std::endl;
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    const std::string bus_name(argc > 1 ? argv[1] : "viola_frame_bus_check");
+
+    FrameBusWriter writer;
+    if (!writer.open(bus_name, "CHECK", CHECK_COLOR_SIZE, CHECK_DEPTH_SIZE)) {
+        return EXIT_FAILURE;
+    }
+    Kinect2FrameBusFeed feed(bus_name);
+    const int slots = FRAME_BUS_SLOTS;
+    bool ok = true;
+
+    int k = 0;
+    publish_frame(writer, k);
+    cv::Mat color, depth;
+    feed.grab(color, depth);
+    ok &= check(is_frame(color, depth, k) && feed.is_intact(), "VIEW_INTACT");
+
+    // the other slots, the grabbed frame isn't touched
+    for (int i = 1; i < slots; i++) {
+        publish_frame(writer, ++k);
+    }
+    ok &= check(is_frame(color, depth, 0) && feed.is_intact(), "VIEW_INTACT_BEFORE_LAP");
+
+    // back in the slot of the grabbed frame
+    publish_frame(writer, ++k);
+    ok &= check(!feed.is_intact(), "VIEW_REJECTED_AFTER_LAP");
+
+    // the frames in between are skipped
+    cv::Mat color_copy, depth_copy;
+    feed.grab_copy(color_copy, depth_copy);
+    ok &= check(is_frame(color_copy, depth_copy, k) && feed.is_intact(), "COPY_NEWEST");
+    ok &= check(feed.get_skipped_frames() == size_t(slots - 1), "SKIPPED");
+
+    writer.close();
+    feed.grab(color, depth);
+    ok &= check(color.empty() && depth.empty(), "CLOSED");
+
+    std::cout << "FRAME_BUS_CHECK " << ok << std::endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
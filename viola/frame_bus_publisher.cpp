@@ -0,0 +1,95 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "project_config.h"
+
+#include "FrameBus.h"
+#include "Kinect2Camera.h"
+#include "Kinect2ContainerReader.h"
+#include "Kinect2VideoReader.h"
+
+// Publishes the frames of the Kinect v2 on a FrameBus, so that particle_filter_main ("bus:<name>"), the recorder
+// and the other consumers can share it. Given a recording (the base name of the three videos, or an .rgbd
+// container) it plays it at its frame rate instead, standing in for the device.
+// Usage: frame_bus_publisher <bus name> [recording]
+
+std::atomic<bool> stop(false);
+
+void handle_signal(int)
+{
+    stop = true;
+}
+
+bool ends_with(const std::string &s, const std::string &suffix)
+{
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " <bus name> [recording]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    const std::string recording = argc > 2 ? argv[2] : "";
+    std::unique_ptr<Kinect2Feed> feed;
+    Kinect2VideoReader *video_reader = nullptr;
+    Kinect2ContainerReader *container_reader = nullptr;
+    if (recording.empty()) {
+        feed.reset(new Kinect2Camera());
+    } else if (ends_with(recording, ".rgbd")) {
+        container_reader = new Kinect2ContainerReader(std::string("013572345247"), recording);
+        feed.reset(container_reader);
+    } else {
+        video_reader = new Kinect2VideoReader(std::string("013572345247"), recording, std::string("avi"));
+        feed.reset(video_reader);
+    }
+
+    FrameBusWriter bus;
+    size_t frames = 0;
+    uint64_t first_timestamp_us = 0;
+    const auto t0 = std::chrono::steady_clock::now();
+    while (!stop) {
+        cv::Mat color, depth;
+        uint64_t timestamp_us;
+        if (video_reader) {
+            video_reader->grab_next(color, depth);
+            timestamp_us = uint64_t(frames * 1e6 / video_reader->get_framerate() + 0.5);
+        } else if (container_reader) {
+            container_reader->grab(color, depth);
+            timestamp_us = container_reader->get_timestamp_us();
+        } else {
+            feed->grab(color, depth);
+            timestamp_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - t0).count();
+        }
+        if (color.empty() || depth.empty()) {
+            break;
+        }
+        if (!bus.is_open() && !bus.open(argv[1], feed->get_device_serial_number(), color.size(), depth.size())) {
+            return EXIT_FAILURE;
+        }
+        // recordings play at their own pace
+        if (video_reader || container_reader) {
+            first_timestamp_us = frames ? first_timestamp_us : timestamp_us;
+            std::this_thread::sleep_until(t0 + std::chrono::microseconds(timestamp_us - first_timestamp_us));
+        }
+        bus.publish(color, depth, timestamp_us);
+        frames++;
+    }
+    bus.close();
+    feed->close();
+
+    const double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << "FRAMES " << frames << " TIME " << t << " FPS " << frames / t << std::endl;
+    return EXIT_SUCCESS;
+}
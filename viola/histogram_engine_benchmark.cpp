@@ -0,0 +1,100 @@
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "project_config.h"
+
+IGNORE_WARNINGS_PUSH
+
+#include <mrpt/otherlibs/do_opencv_includes.h>
+
+IGNORE_WARNINGS_POP
+
+#include "EllipseFunctions.h"
+#include "ColorModel.h"
+#include "HistogramEngine.h"
+
+// Compares compute_color_model2 (two calc_hist2D passes) with the single pass HistogramEngine kernel, with float
+// and fixed point weights, over head ellipses of several sizes. First checks the bin indices of the SIMD kernel
+// (AVX2 when built with USE_AVX2, SSE otherwise, and both then) against the scalar ones for every HSV value, and
+// fails if any differs.
+// Usage: histogram_engine_benchmark [iterations]
+
+// every H (0..179) S V triple, 16 pixels per call
+bool check_pixel_bins()
+{
+    const int n_pixels = 180 * 256 * 256;
+    std::vector<uchar> hsv(3 * n_pixels);
+    for (int p = 0; p < n_pixels; p++) {
+        hsv[3 * p + 0] = p >> 16;
+        hsv[3 * p + 1] = (p >> 8) & 255;
+        hsv[3 * p + 2] = p & 255;
+    }
+    bool ok = true;
+    alignas(32) uint16_t bins_hs[16], bins_v[16];
+    auto check_kernel = [&](const std::string &name, void (*kernel)(const uchar *, uint16_t *, uint16_t *)) {
+        size_t wrong = 0;
+        for (int p = 0; p < n_pixels; p += 16) {
+            kernel(&hsv[3 * p], bins_hs, bins_v);
+            for (int k = 0; k < 16; k++) {
+                uint16_t bin_hs, bin_v;
+                histogram_engine::pixel_bins(&hsv[3 * (p + k)], bin_hs, bin_v);
+                wrong += bins_hs[k] != bin_hs || bins_v[k] != bin_v;
+            }
+        }
+        std::cout << "PIXEL_BINS " << name << " WRONG " << wrong << std::endl;
+        ok = ok && wrong == 0;
+    };
+    check_kernel("sse ", histogram_engine::pixel_bins_16_sse);
+#ifdef __AVX2__
+    check_kernel("avx2", histogram_engine::pixel_bins_16_avx2);
+#endif
+    return ok;
+}
+
+template<typename F>
+void run_benchmark(const std::string &name, const int iterations, const cv::Mat &reference, F f)
+{
+    cv::Mat histogram;
+    const uint64_t t0 = cv::getTickCount();
+    for (int k = 0; k < iterations; k++) {
+        histogram = f();
+    }
+    const double t = (cv::getTickCount() - t0) / double(cv::getTickFrequency());
+    const double error = cv::norm(histogram, reference, cv::NORM_INF);
+    std::cout << name << " TIME " << t / iterations * 1e6 << " us/histogram MAX_ERROR " << error << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    const int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    const cv::Size sizes[] = {cv::Size(24, 40), cv::Size(60, 100), cv::Size(120, 200)};
+    const bool bins_ok = check_pixel_bins();
+
+    for (const cv::Size &size : sizes) {
+        cv::Mat hsv(size, CV_8UC3);
+        cv::randu(hsv, cv::Scalar(0, 0, 0), cv::Scalar(180, 256, 256));
+
+        const cv::Mat mask = create_ellipse_mask(cv::Rect(0, 0, size.width, size.height), 1);
+        const cv::Mat weights = create_ellipse_weight_mask(mask);
+        const cv::Mat fixed_point_weights = to_fixed_point_weights(weights);
+
+        const cv::Mat reference = compute_color_model2(hsv, weights);
+        std::cout << "ELLIPSE " << size.width << 'x' << size.height << std::endl;
+
+        run_benchmark("  calc_hist2D x2      ", iterations, reference, [&]() {
+            return compute_color_model2(hsv, weights);
+        });
+
+        run_benchmark("  fused float         ", iterations, reference, [&]() {
+            return compute_color_model_fused(hsv, weights);
+        });
+
+        run_benchmark("  fused fixed point   ", iterations, reference, [&]() {
+            return compute_color_model_fused(hsv, fixed_point_weights);
+        });
+    }
+
+    return bins_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -3,6 +3,9 @@
 #include <string>
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <vector>
+#include <cassert>
 #include <unistd.h>
 
 
@@ -14,17 +17,19 @@
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
+#include "BoundedQueue.h"
+#include "Semaphore.h"
+#include "DepthPacking.h"
 
 using namespace std;
 using namespace cv;
 
-bool RECORDING = false;
-bool RUNNING = true;
+std::atomic<bool> RECORDING(false);
+std::atomic<bool> RUNNING(true);
 
 FileStorage fs;
 string fic_name;
 int num_fic = 1;
-chrono::time_point<chrono::high_resolution_clock> t0, t1, dt;
 
 libfreenect2::Freenect2Device *dev;
 libfreenect2::Freenect2 freenect2;
@@ -34,6 +39,27 @@ libfreenect2::PacketPipeline *pipeline;
 size_t rgb_height, rgb_width, depth_height, depth_width;
 size_t n_pixels_depth;
 
+// Frames are copied out of the listener into a fixed set of buffers that cycle between two queues: free ->
+// (main loop copies a frame) -> pending -> (a writer thread saves it) -> free. When no buffer is free the writers
+// are behind and the frame is dropped and counted, so memory and threads stay bounded however long we record.
+// Each queue has a semaphore counting its buffers: the writers sleep on the pending one until a frame comes, the main
+// loop takes a free buffer only if one is counted and never waits. Both queues hold every buffer, so no push fails.
+constexpr size_t WRITER_BUFFERS = 32;
+
+struct FrameBuffer
+{
+    std::vector<uchar> rgb;
+    std::vector<uchar> depth;
+    size_t frame;
+};
+
+BoundedQueue<FrameBuffer *> free_buffers(WRITER_BUFFERS);
+BoundedQueue<FrameBuffer *> pending_buffers(WRITER_BUFFERS);
+Semaphore free_count;
+// one more post per writer once the recorder stops, which finds the queue empty and ends it
+Semaphore pending_count;
+std::atomic<size_t> frames_written(0);
+
 void stop_recording()
 {
     if (RECORDING) {
@@ -80,31 +106,13 @@ int handle_OpenCV_error( int status, const char* func_name, const char* err_msg,
     return 0;
 }
 
-void write_images_threads(const int frame_count, uchar * __restrict  rgb_data, uchar * __restrict  depth_data)
+void write_images(const int frame_count, const uchar * __restrict  rgb_data, const uchar * __restrict  depth_data)
 {
-    const cv::Mat color_mat = cv::Mat(rgb_height, rgb_width, CV_8UC3, rgb_data);
-    const cv::Mat depth_mat = cv::Mat(depth_height, depth_width, CV_32FC1, depth_data);
+    const cv::Mat color_mat = cv::Mat(rgb_height, rgb_width, CV_8UC3, const_cast<uchar *>(rgb_data));
+    const cv::Mat depth_mat = cv::Mat(depth_height, depth_width, CV_32FC1, const_cast<uchar *>(depth_data));
 
-    const cv::Mat depth_mat_1_3 = cv::Mat(depth_height, depth_width, CV_8UC3);
-    const cv::Mat depth_mat_4 = cv::Mat(depth_height, depth_width, CV_8UC3);
-
-    uchar *depth3_ptr = depth_mat_1_3.data;
-    uchar *depth4_ptr = depth_mat_4.data;
-    uchar *depth_ptr = depth_mat.data;
-    
-    for (size_t i = 0; i < n_pixels_depth; i++){
-      *(depth3_ptr + 0) = *(depth_ptr + 0);
-      *(depth3_ptr + 1) = *(depth_ptr + 1);
-      *(depth3_ptr + 2) = *(depth_ptr + 2);
-      *(depth4_ptr + 0) = *(depth_ptr + 3);
-      
-      //*(depth4_ptr + 1) = *(depth_ptr + 3);
-      //*(depth4_ptr + 2) = *(depth_ptr + 3);
-
-      depth3_ptr += 3;
-      depth4_ptr += 3;
-      depth_ptr += 4;
-    }
+    cv::Mat depth_mat_1_3, depth_mat_4;
+    pack_depth(depth_mat, depth_mat_1_3, depth_mat_4);
 
 
     std::ostringstream out_depth_1_3;
@@ -116,8 +124,23 @@ void write_images_threads(const int frame_count, uchar * __restrict  rgb_data, u
     cv::imwrite(out_color.str(), color_mat);
     cv::imwrite(out_depth_1_3.str(), depth_mat_1_3);
     cv::imwrite(out_depth_4.str(), depth_mat_4);
-    delete rgb_data;
-    delete depth_data;
+}
+
+// saves pending frames until the recorder stops and nothing is left
+void writer_thread()
+{
+    while (true) {
+        pending_count.wait();
+        FrameBuffer *buffer;
+        if (!pending_buffers.try_pop(buffer)) {
+            break;
+        }
+        write_images(buffer->frame, buffer->rgb.data(), buffer->depth.data());
+        frames_written++;
+        const bool pushed = free_buffers.try_push(buffer);
+        assert(pushed);
+        free_count.post();
+    }
 }
 
 int main(int argc, char **argv)
@@ -164,8 +187,15 @@ int main(int argc, char **argv)
     if (argc > 1){
        FRAMERATE = atoi(argv[1]);
     }
-    
-    std::chrono::milliseconds T_FPS(uint64_t(std::round((1 / float(FRAMERATE)) * 1000)));
+
+    int WRITERS = 3;
+
+    if (argc > 2){
+       WRITERS = std::max(1, atoi(argv[2]));
+    }
+
+    // libfreenect2 frame timestamps tick every 0.1 ms
+    const int32_t frame_period = int32_t(std::round(10000.0 / FRAMERATE));
     
     std::thread keyboard_handler_thread(keyboard_handler);
 
@@ -179,6 +209,7 @@ int main(int argc, char **argv)
     rgb_width = rgb->width;
     depth_height = depth->height;
     depth_width = depth->width;
+    listener->release(frames_kinect2);
     
     //VideoWriter video_D1_3("capture_D1_3.avi", CV_FOURCC('F','F','V','1'), 24, cvSize(depth->width, depth->height));
     //VideoWriter video_D4("capture_D4.avi", CV_FOURCC('F','F','V','1'), 24, cvSize(depth->width, depth->height));
@@ -191,9 +222,26 @@ int main(int argc, char **argv)
     char current_dir[100];
     getcwd(current_dir, 100);
 
-    listener->waitForNewFrame(frames_kinect2);
-    t0 = chrono::high_resolution_clock::now();
+    assert(free_buffers.capacity() == WRITER_BUFFERS && pending_buffers.capacity() == WRITER_BUFFERS);
+    std::vector<FrameBuffer> buffers(WRITER_BUFFERS);
+    for (FrameBuffer &buffer : buffers) {
+        buffer.rgb.resize(rgb_height * rgb_width * 3);
+        buffer.depth.resize(depth_height * depth_width * 4);
+        const bool pushed = free_buffers.try_push(&buffer);
+        assert(pushed);
+        free_count.post();
+    }
+
+    std::vector<std::thread> writers;
+    for (int i = 0; i < WRITERS; i++) {
+        writers.emplace_back(writer_thread);
+    }
+
     size_t framecount = 0;
+    size_t frames_dropped = 0;
+    size_t frames_skipped = 0;
+    bool first_frame = true;
+    uint32_t next_timestamp = 0;
 
     time_t start, end;
     int counter = 0;
@@ -207,56 +255,66 @@ int main(int argc, char **argv)
         if (counter == 0){
             time(&start);
         }
-        
-        t1 = chrono::high_resolution_clock::now();
-        std::chrono::milliseconds dt = std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0);    
-        
-        if (dt < T_FPS){
-            continue;
-        }
-        
-        listener->waitForNewFrame(frames_kinect2);
-
-        //const auto d_actual = std::chrono::duration_cast<std::chrono::milliseconds>(dt).count();
-        //const auto t_fps_count = std::chrono::duration_cast<std::chrono::milliseconds>(T_FPS).count();
-        //std::cout << "DT " << d_actual << ' ' << t_fps_count << std::endl;
-        
-        t0 = t1;
 
+        // blocks until the sensor delivers, which paces the loop
+        listener->waitForNewFrame(frames_kinect2);
 
         rgb = frames_kinect2[libfreenect2::Frame::Color];
         depth = frames_kinect2[libfreenect2::Frame::Depth];
+
+        // keep FRAMERATE frames per second of sensor time; when late by more than a period restart the schedule
+        const int32_t late = int32_t(depth->timestamp - next_timestamp);
+        if (!first_frame && late < 0) {
+            frames_skipped++;
+            listener->release(frames_kinect2);
+            continue;
+        }
+        next_timestamp = (first_frame || late >= frame_period ? depth->timestamp : next_timestamp) + frame_period;
+        first_frame = false;
         
         if (RECORDING) {
-            uchar *rgb_data = new uchar[rgb->height * rgb->width * 3];
-            uchar *depth_data = new uchar[depth->height * depth->width * 4];
-            
-            memcpy(rgb_data, rgb->data, rgb->height * rgb->width * 3);
-            memcpy(depth_data, depth->data, depth->height * depth->width * 4);
-
-            std::thread *recorder =  new std::thread(write_images_threads, framecount, rgb_data, depth_data);
-            recorder->detach();
-            framecount++;
+            FrameBuffer *buffer;
+            if (free_count.try_wait()) {
+                const bool popped = free_buffers.try_pop(buffer);
+                assert(popped);
+                memcpy(buffer->rgb.data(), rgb->data, buffer->rgb.size());
+                memcpy(buffer->depth.data(), depth->data, buffer->depth.size());
+                buffer->frame = framecount;
+                const bool pushed = pending_buffers.try_push(buffer);
+                assert(pushed);
+                pending_count.post();
+                framecount++;
+            } else {
+                // the writers are behind, nothing to copy the frame into
+                frames_dropped++;
+            }
         }
 
+        listener->release(frames_kinect2);
+
         counter++;
         if (counter > 30){
             time(&end);
             sec = difftime(end, start);
             fps = counter/sec;
-            printf("%.2f fps\n", fps);
+            printf("%.2f fps - pending %zu dropped %zu\n", fps, pending_buffers.size(), frames_dropped);
         }
 
         if (counter == (INT_MAX - 1000)){
             counter = 0;
         }
-
-
-        listener->release(frames_kinect2);
     }
     time(&end_end);
     cout << "TOTAL TIME " << difftime(end_end, start_start) << std::endl;
 
+    for (size_t i = 0; i < writers.size(); i++) {
+        pending_count.post();
+    }
+    for (std::thread &writer : writers) {
+        writer.join();
+    }
+    cout << "FRAMES WRITTEN " << frames_written << " DROPPED " << frames_dropped << " SKIPPED " << frames_skipped << std::endl;
+
     listener->waitForNewFrame(frames_kinect2);
     listener->release(frames_kinect2);
     dev->stop();
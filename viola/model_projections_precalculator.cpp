@@ -43,8 +43,9 @@ int main(int argc, char *argv[])
         //std::cout << "HALF\n";
     }
 
-    float cx = cameraMatrix.at<double>(0, 2);
-    float cy = cameraMatrix.at<double>(1, 2);
+    const CameraIntrinsics intrinsics(cameraMatrix);
+    float cx = intrinsics.cx;
+    float cy = intrinsics.cy;
     std::cout << "cx " << cx << ' ' << "cy " << cy << std::endl;
     //const float cx = 1000 * 0.5;
     //const float cy = 500 * 0.5;
@@ -73,7 +74,7 @@ int main(int argc, char *argv[])
             Eigen::Vector2i top_corner, bottom_corner;
             std::tie(top_corner, bottom_corner) = project_model(Eigen::Vector2f(cx, cy), depth,
                                                   Eigen::Vector2f(X_SEMI_AXIS_METTERS, Y_SEMI_AXIS_METTERS),
-                                                  cameraMatrix, reg.lookupX, reg.lookupY);
+                                                  intrinsics, reg.lookupX, reg.lookupY);
             model_length = bottom_corner - top_corner;
 
             sprintf(size, "%d %d", model_length[0], model_length[1]);
@@ -87,7 +88,7 @@ int main(int argc, char *argv[])
             Eigen::Vector2i top_corner, bottom_corner;
             std::tie(top_corner, bottom_corner) = project_model(Eigen::Vector2f(cxx, cyx), depth,
                 Eigen::Vector2f(X_SEMI_AXIS_METTERS, Y_SEMI_AXIS_METTERS),
-                reg.cameraMatrix, reg.lookupX, reg.lookupY);
+                reg.intrinsics, reg.lookupX, reg.lookupY);
             model_length2 = bottom_corner - top_corner;
 
             //sprintf(size, "%d %d %d %d", cxx, cyx, model_length2[0], model_length2[1]);
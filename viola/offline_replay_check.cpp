@@ -0,0 +1,83 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "project_config.h"
+
+IGNORE_WARNINGS_PUSH
+
+#include <opencv2/opencv.hpp>
+
+IGNORE_WARNINGS_POP
+
+#include "ImageRegistration.h"
+#include "Kinect2VideoReader.h"
+#include "OfflineReplay.h"
+
+// Replays a recording with the frames prepared in line (lookahead 0) and ahead (lookahead N) side by side, and
+// checks every registered colour and depth frame is the same in both. Each replay has its own registration.
+// Usage: offline_replay_check <recording base name> [lookahead] [serial number]
+
+bool same_bytes(const cv::Mat &a, const cv::Mat &b)
+{
+    if (a.size() != b.size() || a.type() != b.type()) {
+        return false;
+    }
+    const size_t row_bytes = a.cols * a.elemSize();
+    for (int i = 0; i < a.rows; i++) {
+        if (std::memcmp(a.ptr(i), b.ptr(i), row_bytes) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " <recording base name> [lookahead] [serial number]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const std::string recording(argv[1]);
+    const int lookahead = argc > 2 ? atoi(argv[2]) : 3;
+    const std::string serial(argc > 3 ? argv[3] : "013572345247");
+    const std::string face_cascade_name = "../cascades/haarcascade_frontalface_default.xml";
+    const std::string eyes_cascade_name = "../cascades/haarcascade_eye_tree_eyeglasses.xml";
+    const std::string calib_path = std::string(getenv("HOME")) + "/kinect2_calib/";
+
+    ImageRegistration reg_in_line, reg_ahead;
+    reg_in_line.init(calib_path, serial);
+    reg_ahead.init(calib_path, serial);
+    Kinect2VideoReader recording_in_line(serial, recording, std::string("avi"));
+    Kinect2VideoReader recording_ahead(serial, recording, std::string("avi"));
+    OfflineReplay replay_in_line(recording_in_line, reg_in_line, face_cascade_name, eyes_cascade_name, 0);
+    OfflineReplay replay_ahead(recording_ahead, reg_ahead, face_cascade_name, eyes_cascade_name, lookahead);
+
+    size_t frames = 0;
+    size_t mismatches = 0;
+    OfflineFrame frame_in_line, frame_ahead;
+    for (;;) {
+        const bool more_in_line = replay_in_line.next(frame_in_line);
+        const bool more_ahead = replay_ahead.next(frame_ahead);
+        if (more_in_line != more_ahead) {
+            std::cout << "LENGTH MISMATCH after " << frames << " frames" << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (!more_in_line) {
+            break;
+        }
+        const bool same_index = frame_in_line.index == frame_ahead.index;
+        const bool same_color = same_bytes(frame_in_line.registered_color, frame_ahead.registered_color);
+        const bool same_depth = same_bytes(frame_in_line.registered_depth, frame_ahead.registered_depth);
+        if (!same_index || !same_color || !same_depth) {
+            std::cout << "MISMATCH frame " << frame_in_line.index << " index " << same_index << " color " << same_color
+                      << " depth " << same_depth << std::endl;
+            mismatches++;
+        }
+        frames++;
+    }
+
+    std::cout << "FRAMES " << frames << " LOOKAHEAD " << lookahead << " MISMATCHES " << mismatches << std::endl;
+    return mismatches == 0 && frames > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
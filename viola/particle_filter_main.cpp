@@ -1,6 +1,7 @@
 #include <signal.h>
 #include <cstdlib>
 #include <string>
+#include <numeric>
 #include "project_config.h"
 
 IGNORE_WARNINGS_PUSH
@@ -37,9 +38,18 @@ IGNORE_WARNINGS_POP
 #include "MultiTracker.h"
 #include "Tracker.h"
 #include "EllipseStash.h"
+#include "OrientationResponseMaps.h"
+#include "TiledImage.h"
+#include "BackProjection.h"
+#include "DepthStatistics.h"
+#include "DepthHoleFiller.h"
 
 #include "Kinect2Camera.h"
 #include "Kinect2VideoReader.h"
+#include "OfflineReplay.h"
+#include "FaceDetectionStage.h"
+#include "Kinect2SyntheticFeed.h"
+#include "Kinect2FrameBusFeed.h"
 
 #include "PersonMask.h"
 
@@ -109,83 +119,130 @@ void create_cloud(const cv::Mat &color, const cv::Mat &depth, const float scale,
 {
     //const float badPoint = std::numeric_limits<float>::quiet_NaN();
     cloud.clear();
+    const size_t cols = depth.cols;
+    std::vector<float> u(cols), v(cols), depth_row(cols);
+    std::vector<float> x_coords(cols), y_coords(cols), z_coords(cols);
+    std::iota(u.begin(), u.end(), 0.f);
+
     for (int r = 0; r < depth.rows; ++r) {
         const uint16_t *itD = depth.ptr<uint16_t>(r);
         const cv::Vec3b *itC = color.ptr<cv::Vec3b>(r);
-        const float y = reg.lookupY.at<float>(0, r);
-        const float *itX = reg.lookupX.ptr<float>();
+        std::fill(v.begin(), v.end(), float(r));
+        std::copy(itD, itD + cols, depth_row.begin());
+
+        pixels_3D_reprojection(u.data(), v.data(), depth_row.data(), cols, reg.intrinsics,
+                               x_coords.data(), y_coords.data(), z_coords.data(), scale);
 
-        for (size_t c = 0; c < (size_t)depth.cols; ++c, ++itD, ++itC, ++itX) {
-            register const float depthValue = *itD;
+        for (size_t c = 0; c < cols; ++c, ++itC) {
             // Check for invalid measurements
-            if (isnan(depthValue) || std::abs(depthValue) <= 0.001) {
+            if (std::abs(depth_row[c]) <= 0.001) {
                 continue;
             }
-
-            const float z_coord = depthValue * scale;
-            const float x_coord = (*itX) * depthValue* scale;
-            const float y_coord = y * depthValue* scale;
-            //cout << "CLOUD " << x_coord << ' ' << y_coord << ' ' << z_coord << endl;
-            cloud.insertPoint(-z_coord, x_coord, -y_coord , itC->val[2] / 255.0, itC->val[1] / 255.0, itC->val[0] / 255.0);
+            //cout << "CLOUD " << x_coords[c] << ' ' << y_coords[c] << ' ' << z_coords[c] << endl;
+            cloud.insertPoint(-z_coords[c], x_coords[c], -y_coords[c], itC->val[2] / 255.0, itC->val[1] / 255.0, itC->val[0] / 255.0);
         }
     }
 }
 
-int particle_filter()
+// offline_recording: base name of a recording to replay offline (OfflineReplay.h), live or real-time replay if empty;
+// synthetic:<people>[:<frames>] replays a synthetic scene (Kinect2SyntheticFeed.h) and prints its ground truth;
+// bus:<name> tracks live on the frames another process publishes (Kinect2FrameBusFeed.h)
+int particle_filter(const std::string &offline_recording)
 {
     //Cascades initialization
     //string face_cascade_name = "../cascades/lbpcascade_frontalface.xml";
     string face_cascade_name = "../cascades/haarcascade_frontalface_default.xml";
     string eyes_cascade_name = "../cascades/haarcascade_eye_tree_eyeglasses.xml";
-    cv::ocl::OclCascadeClassifier ocl_face_cascade;
-    cv::ocl::OclCascadeClassifier ocl_eyes_cascade;
-    //cv::CascadeClassifier face_cascade;
-    //cv::CascadeClassifier eyes_cascade;
-
-    /*
-    if (!face_cascade.load(face_cascade_name)) {
-        printf("--(!)Error loading %s\n", face_cascade_name.c_str());
-        return -1;
-    }
-
-    if (!eyes_cascade.load(eyes_cascade_name)) {
-        printf("--(!)Error loading %s\n", eyes_cascade_name.c_str());
-        return -1;
-    }
-    */
-
-    if (!ocl_face_cascade.load(face_cascade_name)) {
-        printf("--(!)Error loading %s\n", face_cascade_name.c_str());
-        return -1;
-    }
-
-    if (!ocl_eyes_cascade.load(eyes_cascade_name)) {
-        printf("--(!)Error loading %s\n", eyes_cascade_name.c_str());
-        return -1;
-    }
-
-    dlib::frontal_face_detector face_detector = dlib::get_frontal_face_detector();
-
+    const bool frame_bus = offline_recording.compare(0, 4, "bus:") == 0;
+    const bool offline = !offline_recording.empty() && !frame_bus;
+    const bool synthetic = offline_recording.compare(0, 10, "synthetic:") == 0;
+    const std::string recording_serial("013572345247");
+    std::unique_ptr<Kinect2Feed> feed;
+    Kinect2VideoReader *offline_reader = nullptr;
+    Kinect2SyntheticFeed *synthetic_feed = nullptr;
+    Kinect2FrameBusFeed *frame_bus_feed = nullptr;
 #define LIVE
+#ifndef LIVE
+    std::thread kinect_frame_update;
+#endif
+    if (synthetic) {
+        // created once the calibration gives the camera it renders from
+    } else if (frame_bus) {
+        frame_bus_feed = new Kinect2FrameBusFeed(offline_recording.substr(4));
+        feed.reset(frame_bus_feed);
+    } else if (offline) {
+        offline_reader = new Kinect2VideoReader(recording_serial, offline_recording, std::string("avi"));
+        feed.reset(offline_reader);
+    } else {
 #ifdef LIVE
-    Kinect2Camera video_feed;
+        feed.reset(new Kinect2Camera(KINECT2_ASYNC_CAPTURE));
 #else
-    Kinect2VideoReader video_feed(std::string("013572345247"),
-        std::string("/run/media/juen/1cf91ca4-036c-44f3-a9b8-35deb7ced99c/videos/video4/video0"),
-        //std::string("/home/juen/videos/video3/video0"),
-        std::string("avi"));
-    std::thread kinect_frame_update(&Kinect2VideoReader::update, &video_feed);
+        Kinect2VideoReader *video_reader = new Kinect2VideoReader(recording_serial,
+            std::string("/run/media/juen/1cf91ca4-036c-44f3-a9b8-35deb7ced99c/videos/video4/video0"),
+            //std::string("/home/juen/videos/video3/video0"),
+            std::string("avi"));
+        feed.reset(video_reader);
+        kinect_frame_update = std::thread(&Kinect2VideoReader::update, video_reader);
 #endif
+    }
     char *calib_dir = getenv("HOME");
     const std::string calib_path = std::string(calib_dir) + "/kinect2_calib/";
 
     //Registration initialization
     ImageRegistration reg;
-    reg.init(calib_path, video_feed.get_device_serial_number());
+    reg.init(calib_path, synthetic ? recording_serial : feed->get_device_serial_number());
 
 #ifdef USE_HALF_RES
     reg.createLookup(reg.sizeLowRes.width, reg.sizeLowRes.height, reg.cameraMatrixLowRes);
 #endif
+
+    if (synthetic) {
+        // rendered registered, in the camera the tracking works with
+#ifndef USE_HALF_RES
+        const cv::Size synthetic_size = reg.sizeColor;
+#else
+        const cv::Size synthetic_size = reg.sizeLowRes;
+#endif
+        size_t people = 1;
+        size_t frames = 0;
+        sscanf(offline_recording.c_str(), "synthetic:%zu:%zu", &people, &frames);
+        SyntheticScene scene(synthetic_size, reg.intrinsics, 30, frames);
+        scene.add_walking_people(people);
+        synthetic_feed = new Kinect2SyntheticFeed(scene);
+        feed.reset(synthetic_feed);
+    }
+    Kinect2Feed &video_feed = *feed;
+
+    std::unique_ptr<OfflineReplay> offline_replay;
+    if (offline) {
+#ifndef USE_HALF_RES
+        const cv::Size tracking_size;
+#else
+        const cv::Size tracking_size = reg.sizeLowRes;
+#endif
+        if (synthetic) {
+            offline_replay.reset(new OfflineReplay([synthetic_feed]() { return synthetic_feed->grab_frame(); }, nullptr,
+                face_cascade_name, eyes_cascade_name, OFFLINE_FACE_DETECTION_LOOKAHEAD, tracking_size));
+        } else {
+            offline_replay.reset(new OfflineReplay(*offline_reader, reg, face_cascade_name, eyes_cascade_name,
+                                                   OFFLINE_FACE_DETECTION_LOOKAHEAD, tracking_size));
+        }
+    }
+    OfflineFrame offline_frame;
+    std::vector<SyntheticGroundTruth> ground_truth;
+
+    // live, the faces are detected on their own thread while the tracking goes on
+    std::unique_ptr<FaceDetectionStage> face_detection;
+    if (!offline) {
+        face_detection.reset(new FaceDetectionStage(face_cascade_name, eyes_cascade_name, FACE_DETECTION_INTERVAL,
+                                                    FACE_DETECTION_MAX_INTERVAL, FACE_DETECTION_MOTION_THRESHOLD));
+    }
+    size_t frame_index = 0;
+    FaceDetection face_detection_result;
+    // colour model and depth of the frame a late detection was found on
+    cv::Mat late_detection_hsv_frame;
+    DepthStatistics late_detection_depth_statistics;
+
     //load or precompute ellipses projections
 
 #ifndef USE_HALF_RES
@@ -199,6 +256,9 @@ int particle_filter()
     cv::Mat color_frame;
     cv::Mat color_display_frame;
     cv::Mat depth_frame;
+    DepthStatistics depth_statistics;
+    DepthHoleFiller depth_hole_filler(DEPTH_HOLE_FILLING_MAX_AGE, DEPTH_HOLE_FILLING_RADIUS,
+                                      DEPTH_HOLE_FILLING_MIN_NEIGHBOURS);
 
     CDisplayWindow image("image");
     CDisplayWindow registered_color_window("registered_depth_color");
@@ -260,7 +320,11 @@ int particle_filter()
 #endif
 
     //MRPT random generator initialization
-    randomGenerator.randomize();
+    if (offline) {
+        randomGenerator.randomize(OFFLINE_REPLAY_RANDOM_SEED);
+    } else {
+        randomGenerator.randomize();
+    }
     // Create PF
     // ----------------------
     CParticleFilter::TParticleFilterOptions PF_options;
@@ -298,8 +362,26 @@ int particle_filter()
 
         cv::Mat color_mat, depth_mat;
 
-        video_feed.grab(color_mat, depth_mat);
-
+        if (offline) {
+            if (!offline_replay->next(offline_frame)) {
+                break;
+            }
+            if (synthetic && synthetic_feed->get_ground_truth(offline_frame.index, ground_truth)) {
+                for (const SyntheticGroundTruth &truth : ground_truth) {
+                    std::cout << "GROUND_TRUTH " << offline_frame.index << ' ' << truth.id << ' '
+                              << truth.head_center.x << ' ' << truth.head_center.y << ' ' << truth.head_center.z << ' '
+                              << truth.head_pixel.x << ' ' << truth.head_pixel.y << ' ' << truth.head_visible << std::endl;
+                }
+            }
+        } else {
+            video_feed.grab(color_mat, depth_mat);
+            // the frame bus writer closed
+            if (color_mat.empty()) {
+                break;
+            }
+        }
+        // seconds, the tracking dt is taken between consecutive frame times
+        const double frame_time = offline ? offline_frame.time : cv::getTickCount() / double(cv::getTickFrequency());
 
         float read_kinect_t = (cv::getTickCount() - read_kinect_t0) / double(cv::getTickFrequency());
         std::cout << "TIMES_READ_KINECT " << read_kinect_t << ' ' << 1.0f /read_kinect_t <<std::endl;
@@ -310,7 +392,24 @@ int particle_filter()
         cv::Mat registered_depth;
         cv::Mat registered_color;
 
-        reg.register_images(color_mat, depth_mat, registered_color, registered_depth);
+        // registered ahead in offline replay
+        if (offline) {
+            registered_color = offline_frame.registered_color;
+            registered_depth = offline_frame.registered_depth;
+        } else {
+            reg.register_images(color_mat, depth_mat, registered_color, registered_depth);
+            // the frame bus views are only read by the registration: if the writer lapped the ring meanwhile, the
+            // registered frames may mix two frames and are dropped
+            if (frame_bus_feed && !frame_bus_feed->is_intact()) {
+                std::cout << "FRAME_BUS_TORN_FRAME " << frame_bus_feed->get_timestamp_us() << std::endl;
+                continue;
+            }
+        }
+
+        uint64_t hole_filling_t0 = cv::getTickCount();
+        depth_hole_filler.fill(registered_depth, registered_depth);
+        float hole_filling_t = (cv::getTickCount() - hole_filling_t0) / double(cv::getTickFrequency());
+        std::cout << "TIMES_HOLE_FILLING " << hole_filling_t << std::endl;
 
         // Observation building
 #ifndef USE_HALF_RES
@@ -320,10 +419,21 @@ int particle_filter()
         cv::resize(registered_color, color_frame, reg.sizeLowRes, 0, 0, cv::INTER_AREA);
         cv::resize(registered_depth, depth_frame, reg.sizeLowRes, 0, 0, cv::INTER_AREA);
 #endif
-        color_display_frame = color_frame.clone();
+        if (offline) {
+            color_frame = offline_frame.color_frame;
+            color_display_frame = offline_frame.color_display_frame;
+        } else {
+            color_display_frame = color_frame.clone();
+        }
 
         float registration_t = (cv::getTickCount() - registration_t0) / double(cv::getTickFrequency());
         std::cout << "TIMES_REGISTRATION " << registration_t << std::endl;
+
+        uint64_t depth_statistics_t0 = cv::getTickCount();
+        depth_statistics.compute<DEPTH_TYPE>(depth_frame);
+        float depth_statistics_t = (cv::getTickCount() - depth_statistics_t0) / double(cv::getTickFrequency());
+        std::cout << "TIMES_DEPTH_STATISTICS " << depth_statistics_t << std::endl;
+
         float learningRate = -1;
         /*
         if (n >= 10){
@@ -384,7 +494,49 @@ int particle_filter()
         std::cout << "TIMES_COLOR_CONVERSION " << color_conversion_t << std::endl;
         std::cout << "TIMES_SOBEL " << sobel_t << std::endl;
 
-        //cv::Mat frame_3D_points = depth_3D_reprojection(depth_frame, reg.cameraMatrix);
+        uint64_t response_maps_t0 = cv::getTickCount();
+
+        cv::Mat orientation_response_maps;
+        if (LIKELIHOOD_USE_RESPONSE_MAPS) {
+            orientation_response_maps = compute_orientation_response_maps(gradient_vectors, gradient_magnitude, RESPONSE_MAP_SPREAD_T);
+        }
+
+        float response_maps_t = (cv::getTickCount() - response_maps_t0) / double(cv::getTickFrequency());
+        std::cout << "TIMES_RESPONSE_MAPS " << response_maps_t << std::endl;
+
+        uint64_t tiling_t0 = cv::getTickCount();
+
+        TiledImage<cv::Vec3b> hsv_tiled;
+        TiledImage<cv::Vec2f> gradient_vectors_tiled;
+        TiledImage<float> gradient_magnitude_tiled;
+        if (LIKELIHOOD_HISTOGRAM_BACKEND == ColorHistogramBackend::TILED) {
+            hsv_tiled = TiledImage<cv::Vec3b>::from_mat(hsv_frame);
+        }
+        // the contour fitting reads the response maps instead when they are on
+        if (LIKELIHOOD_USE_TILED_FRAMES && orientation_response_maps.empty()) {
+            gradient_vectors_tiled = TiledImage<cv::Vec2f>::from_mat(gradient_vectors);
+            gradient_magnitude_tiled = TiledImage<float>::from_mat(gradient_magnitude);
+        }
+
+        float tiling_t = (cv::getTickCount() - tiling_t0) / double(cv::getTickFrequency());
+        std::cout << "TIMES_TILING " << tiling_t << std::endl;
+
+        uint64_t color_pyramid_t0 = cv::getTickCount();
+
+        const bool back_projection = LIKELIHOOD_COLOR_MODE == ColorLikelihood::BACK_PROJECTION;
+        std::vector<cv::Mat> color_bin_pyramid;
+        cv::Mat frame_histogram;
+        if (LIKELIHOOD_USE_COLOR_PYRAMID || back_projection) {
+            color_bin_pyramid = compute_color_bin_pyramid(hsv_frame, LIKELIHOOD_PYRAMID_LEVELS);
+        }
+        if (back_projection) {
+            frame_histogram = compute_color_histogram_from_bins(color_bin_pyramid.back());
+        }
+
+        float color_pyramid_t = (cv::getTickCount() - color_pyramid_t0) / double(cv::getTickFrequency());
+        std::cout << "TIMES_COLOR_PYRAMID " << color_pyramid_t << std::endl;
+
+        //cv::Mat frame_3D_points = depth_3D_reprojection(depth_frame, reg.intrinsics);
 
         //cv::Mat hsv_frame;
         //cv::cvtColor(color_frame, hsv_frame, cv::COLOR_BGR2HSV);
@@ -424,27 +576,124 @@ int particle_filter()
         observation.insert(obsImage_gradient_vectors);
         observation.insert(obsImage_gradient_magnitude);
 
+        std::unique_ptr<IplImage> ipl_image_response_maps;
+        if (!orientation_response_maps.empty()) {
+            ipl_image_response_maps.reset(new IplImage(orientation_response_maps));
+            CObservationImagePtr obsImage_response_maps = CObservationImage::Create();
+            obsImage_response_maps->image.setFromIplImageReadOnly(ipl_image_response_maps.get());
+            obsImage_response_maps->sensorLabel = "orientation_response_maps";
+            observation.insert(obsImage_response_maps);
+        }
+
+        // the tiled frames are only wrapped: TiledImage(storage) rebuilds the layout on the particle filter side
+        std::unique_ptr<IplImage> ipl_image_hsv_tiled;
+        std::unique_ptr<IplImage> ipl_image_gradient_vectors_tiled;
+        std::unique_ptr<IplImage> ipl_image_gradient_magnitude_tiled;
+        if (!hsv_tiled.empty()) {
+            ipl_image_hsv_tiled.reset(new IplImage(hsv_tiled.get_storage()));
+            CObservationImagePtr obsImage_hsv_tiled = CObservationImage::Create();
+            obsImage_hsv_tiled->image.setFromIplImageReadOnly(ipl_image_hsv_tiled.get());
+            obsImage_hsv_tiled->sensorLabel = "hsv_tiled";
+            observation.insert(obsImage_hsv_tiled);
+        }
+        if (!gradient_vectors_tiled.empty()) {
+            ipl_image_gradient_vectors_tiled.reset(new IplImage(gradient_vectors_tiled.get_storage()));
+            ipl_image_gradient_magnitude_tiled.reset(new IplImage(gradient_magnitude_tiled.get_storage()));
+
+            CObservationImagePtr obsImage_gradient_vectors_tiled = CObservationImage::Create();
+            CObservationImagePtr obsImage_gradient_magnitude_tiled = CObservationImage::Create();
+
+            obsImage_gradient_vectors_tiled->image.setFromIplImageReadOnly(ipl_image_gradient_vectors_tiled.get());
+            obsImage_gradient_vectors_tiled->sensorLabel = "gradient_vectors_tiled";
+
+            obsImage_gradient_magnitude_tiled->image.setFromIplImageReadOnly(ipl_image_gradient_magnitude_tiled.get());
+            obsImage_gradient_magnitude_tiled->sensorLabel = "gradient_magnitude_tiled";
+
+            observation.insert(obsImage_gradient_vectors_tiled);
+            observation.insert(obsImage_gradient_magnitude_tiled);
+        }
+
+        std::vector<std::unique_ptr<IplImage>> ipl_image_color_bin_pyramid;
+        for (size_t level = 1; level < color_bin_pyramid.size(); level++) {
+            ipl_image_color_bin_pyramid.emplace_back(new IplImage(color_bin_pyramid[level]));
+            CObservationImagePtr obsImage_color_bins = CObservationImage::Create();
+            obsImage_color_bins->image.setFromIplImageReadOnly(ipl_image_color_bin_pyramid.back().get());
+            obsImage_color_bins->sensorLabel = "hsv_bins_" + std::to_string(level);
+            observation.insert(obsImage_color_bins);
+        }
+
+        // the particle filter reads its particle depths from the integral tables
+        const std::unique_ptr<IplImage> ipl_image_depth_sum(new IplImage(depth_statistics.get_depth_sum()));
+        const std::unique_ptr<IplImage> ipl_image_depth_valid_count(new IplImage(depth_statistics.get_valid_count()));
+        CObservationImagePtr obsImage_depth_sum = CObservationImage::Create();
+        CObservationImagePtr obsImage_depth_valid_count = CObservationImage::Create();
+        obsImage_depth_sum->image.setFromIplImageReadOnly(ipl_image_depth_sum.get());
+        obsImage_depth_sum->sensorLabel = "depth_sum";
+        obsImage_depth_valid_count->image.setFromIplImageReadOnly(ipl_image_depth_valid_count.get());
+        obsImage_depth_valid_count->sensorLabel = "depth_valid_count";
+        observation.insert(obsImage_depth_sum);
+        observation.insert(obsImage_depth_valid_count);
+
+        std::unique_ptr<IplImage> ipl_image_frame_histogram;
+        if (back_projection) {
+            ipl_image_frame_histogram.reset(new IplImage(frame_histogram));
+            CObservationImagePtr obsImage_frame_histogram = CObservationImage::Create();
+            obsImage_frame_histogram->image.setFromIplImageReadOnly(ipl_image_frame_histogram.get());
+            obsImage_frame_histogram->sensorLabel = "hsv_frame_histogram";
+            observation.insert(obsImage_frame_histogram);
+        }
+
         float observation_t = (cv::getTickCount() - observation_t0) / double(cv::getTickFrequency());
         std::cout << "TIMES_OBSERVATION " << observation_t << std::endl;
 
         uint64_t viola_t0 = cv::getTickCount();
 
-        cv::ocl::oclMat ocl_gray_frame_upper_half = ocl_gray_frame(cv::Rect(0, 0, ocl_gray_frame.cols, ocl_gray_frame.rows * 0.75));
         //if(!trackers.states.size()){
 
-        std::vector<cv::Rect> faces_roi = viola_faces::detect_faces_dual(ocl_gray_frame_upper_half, ocl_face_cascade, ocl_eyes_cascade, 1, face_detector, color_frame, color_display_frame);
+        // detected ahead in offline replay
+        std::vector<cv::Rect> faces_roi;
+        double detection_time = -1;
+        // frame the trackers are started from
+        const cv::Mat *detection_hsv_frame = &hsv_frame;
+        const DepthStatistics *detection_depth_statistics = &depth_statistics;
+        if (offline) {
+            faces_roi = offline_frame.faces;
+        } else {
+            // found on an earlier frame by the detection thread: the trackers start on that frame, their first
+            // prediction spanning the frames since
+            FaceDetection newest_detection;
+            while (face_detection->poll(face_detection_result)) {
+                if (frame_time - face_detection_result.time <= FACE_DETECTION_MAX_AGE) {
+                    newest_detection = std::move(face_detection_result);
+                    detection_time = newest_detection.time;
+                }
+            }
+            if (detection_time >= 0 && !newest_detection.faces.empty()) {
+                faces_roi = newest_detection.faces;
+                cv::cvtColor(newest_detection.color_frame, late_detection_hsv_frame, cv::COLOR_BGR2HSV);
+                late_detection_depth_statistics.compute<DEPTH_TYPE>(newest_detection.depth_frame);
+                detection_hsv_frame = &late_detection_hsv_frame;
+                detection_depth_statistics = &late_detection_depth_statistics;
+            }
+            for (auto &roi : faces_roi) {
+                cv::rectangle(color_display_frame, roi, cv::Scalar(0, 0, 255), 1);
+            }
+            face_detection->submit(frame_index, frame_time, color_frame, depth_frame, background_mask_depth);
+        }
+        const double detection_age = detection_time >= 0 ? frame_time - detection_time : 0;
 
         for (auto &roi : faces_roi){
             cv::Point center(cvRound(roi.x + roi.width * 0.5), cvRound(roi.y + roi.height * 0.5));
 
-            //TODO CHANGE TO AVERAGE DEPTH?
-            const DEPTH_TYPE center_depth = depth_frame.at<DEPTH_TYPE>(cvRound(center.y), cvRound(center.x));
+            const float center_depth = detection_depth_statistics->depth_at(center);
             if (center_depth == 0){
                 continue;
             }
 
-            trackers.insert_tracker(center, center_depth, hsv_frame, depth_frame, ellipses);
+            trackers.insert_tracker(center, center_depth, *detection_hsv_frame, *detection_depth_statistics, ellipses,
+                                    detection_time, detection_age);
         }
+        frame_index++;
 
         //}
         float viola_t = (cv::getTickCount() - viola_t0) / double(cv::getTickFrequency());
@@ -453,7 +702,7 @@ int particle_filter()
 
         uint64_t tracking_t0 = cv::getTickCount();
 
-        trackers.tracking_step(hsv_frame, depth_frame, gradient_vectors, observation, PF, ellipses, reg);
+        trackers.tracking_step(hsv_frame, depth_statistics, gradient_vectors, observation, PF, ellipses, reg, frame_time);
 
         float tracking_t = (cv::getTickCount() - tracking_t0) / double(cv::getTickFrequency());
 
@@ -464,13 +713,14 @@ int particle_filter()
         uint64_t visualization_t0 = cv::getTickCount();
 
         for(auto &state : trackers.states) {
-            const DEPTH_TYPE center_depth = depth_frame.at<DEPTH_TYPE>(cvRound(state.center.y), cvRound(state.center.x));
+            const float center_depth = depth_statistics.depth_at(state.center);
             if (center_depth == 0){
                 continue;
             }
             std::cout << "DEPTH " << center_depth << std::endl;
             std::cout << "person_mask " << state.center.x << ' ' << state.center.y << ' ' <<  center_depth << std::endl;
-            Eigen::Vector2i torso_center = translate_2D_vector_in_3D_space(state.center.x, state.center.y, center_depth, HEAD_TO_TORSE_CENTER_VECTOR, reg.cameraMatrix, reg.lookupX, reg.lookupY);
+            const cv::Point torso_offset = ellipses.get_torso_offset(center_depth);
+            Eigen::Vector2i torso_center = Eigen::Vector2i(state.center.x + torso_offset.x, state.center.y + torso_offset.y);
 
             const cv::Size ellipse_axes = ellipses.get_ellipse_size(BodyPart::TORSO, center_depth);
             const cv::Rect torso_roi = cv::Rect(cvRound(torso_center[0] - ellipse_axes.width * 0.5f),
@@ -624,7 +874,7 @@ int particle_filter()
             */
             
             mask = person_mask(trackers.states[0].x, trackers.states[0].y, trackers.states[0].z, color_frame, depth_frame,
-                background_mask_depth, reg.cameraMatrix, reg.lookupX, reg.lookupY, color_display_frame, display_mask, flooded_mask);
+                background_mask_depth, reg.intrinsics, reg.lookupX, reg.lookupY, color_display_frame, display_mask, flooded_mask);
             
             //markers.at<int32_t>() = 1;
 
@@ -671,10 +921,10 @@ int particle_filter()
         //}
 
         //std::vector<Eigen::Vector3f> points_3d = points_3D_reprojection<DEPTH_DATA_TYPE>(particle_vectors, depth_frame, reg.lookupX, reg.lookupY);
-        //std::vector<Eigen::Vector3f> particle_points_3d = pixel_depth_to_3D_coordiantes(particle_vectors3d_2, reg.cameraMatrix);
+        //std::vector<Eigen::Vector3f> particle_points_3d = pixel_depth_to_3D_coordiantes(particle_vectors3d_2, reg.intrinsics);
         //create_cloud(points_3d, particle_points_map);
         //create_cloud(particle_vectors3d, particle_points_map);
-        //points_3d[0] = pixel_depth_to_3D_coordiantes(Eigen::Vector3f(x_global, y_global, depth_frame.at<DEPTH_TYPE>(y_global, x_global)), reg.cameraMatrix);
+        //points_3d[0] = pixel_depth_to_3D_coordiantes(Eigen::Vector3f(x_global, y_global, depth_frame.at<DEPTH_TYPE>(y_global, x_global)), reg.intrinsics);
         //create_cloud(particle_points_3d, 1.0/1000.0f, particle_points_map);
 
         win3D.get3DSceneAndLock();
@@ -704,8 +954,15 @@ int particle_filter()
         const double total_t = (cv::getTickCount() - t0) / double(cv::getTickFrequency());
         cout << "TIME_TOTAL_2 " << total_t << ' ' << 1/total_t << std::endl;
     }
+    if (offline) {
+        offline_replay->report();
+    } else {
+        face_detection->report();
+    }
 #ifndef LIVE
-    kinect_frame_update.join();
+    if (kinect_frame_update.joinable()) {
+        kinect_frame_update.join();
+    }
 #endif
     video_feed.close();
 
@@ -733,17 +990,38 @@ int main(int argc, char *argv[])
         MODEL_TRANSITION_STD_VXY  = 10;
     }
 
+    if (argc > 4) {
+        DEPTH_HOLE_FILLING_MAX_AGE = atoi(argv[4]);
+    }
+
+    if (argc > 5) {
+        DEPTH_HOLE_FILLING_RADIUS = atoi(argv[5]);
+    }
+
+    std::string offline_recording;
+    if (argc > 6) {
+        offline_recording = argv[6];
+    }
+
+    if (argc > 7) {
+        OFFLINE_FACE_DETECTION_LOOKAHEAD = atoi(argv[7]);
+    }
+
     std::cout << "NUM_PARTICLES: " << NUM_PARTICLES << " MODEL_TRANSITION_STD_XY: " << MODEL_TRANSITION_STD_XY << " MODEL_TRANSITION_STD_VXY: " << MODEL_TRANSITION_STD_VXY << std::endl;
+    std::cout << "DEPTH_HOLE_FILLING_MAX_AGE: " << DEPTH_HOLE_FILLING_MAX_AGE << " DEPTH_HOLE_FILLING_RADIUS: " << DEPTH_HOLE_FILLING_RADIUS << std::endl;
+    if (!offline_recording.empty()) {
+        std::cout << "OFFLINE_REPLAY: " << offline_recording << " OFFLINE_FACE_DETECTION_LOOKAHEAD: " << OFFLINE_FACE_DETECTION_LOOKAHEAD << std::endl;
+    }
 
     cv::redirectError(handle_OpenCV_error);
 
-    particle_filter();
+    particle_filter(offline_recording);
 
     return 0;
 
     /*
     try {
-        particle_filter();
+        particle_filter(offline_recording);
         return 0;
     } catch (std::exception &e) {
         std::cout << "MRPT exception caught: " << e.what() << std::endl;
@@ -0,0 +1,61 @@
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include <sys/stat.h>
+
+#include "Kinect2VideoReader.h"
+#include "RGBDContainer.h"
+
+// Converts a recording made of the three videos read by Kinect2VideoReader (<base>_color, <base>_depth_1_3 and
+// <base>_depth_4) into a single RGBDContainer file. The timestamps are rebuilt from the colour frame rate.
+// Usage: rgbd_convert <video base name> <output file> [raw|png|jpeg] [video extension]
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        std::cout << "Usage: " << argv[0] << " <video base name> <output file> [raw|png|jpeg] [video extension]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const std::string codec_name = argc > 3 ? argv[3] : "png";
+    const std::string extension = argc > 4 ? argv[4] : "avi";
+    RGBDColorCodec codec = RGBDColorCodec::PNG;
+    if (codec_name == "raw") {
+        codec = RGBDColorCodec::RAW;
+    } else if (codec_name == "jpeg") {
+        codec = RGBDColorCodec::JPEG;
+    }
+
+    Kinect2VideoReader video_feed(std::string(""), std::string(argv[1]), extension);
+    const double framerate = video_feed.get_framerate();
+
+    RGBDContainerWriter writer;
+    size_t raw_bytes = 0;
+    const uint64_t t0 = cv::getTickCount();
+    while (true) {
+        cv::Mat color, depth;
+        video_feed.grab_next(color, depth);
+        if (color.empty() || depth.empty()) {
+            break;
+        }
+        if (!writer.get_frames() && !writer.open(argv[2], color.size(), depth.size(), codec)) {
+            return EXIT_FAILURE;
+        }
+        const uint64_t timestamp_us = uint64_t(writer.get_frames() * 1e6 / framerate + 0.5);
+        if (!writer.write(color, depth, timestamp_us)) {
+            std::cout << "Write error on " << argv[2] << std::endl;
+            return EXIT_FAILURE;
+        }
+        raw_bytes += color.total() * color.elemSize() + depth.total() * sizeof(uint16_t);
+    }
+    const size_t frames = writer.get_frames();
+    writer.close();
+
+    const double t = (cv::getTickCount() - t0) / double(cv::getTickFrequency());
+    struct stat file_stat;
+    const double file_bytes = stat(argv[2], &file_stat) ? 0 : file_stat.st_size;
+    std::cout << "FRAMES " << frames << " TIME " << t << " FPS " << frames / t
+              << " RATIO " << (file_bytes ? raw_bytes / file_bytes : 0) << std::endl;
+    return EXIT_SUCCESS;
+}
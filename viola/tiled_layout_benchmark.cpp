@@ -0,0 +1,193 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "project_config.h"
+
+IGNORE_WARNINGS_PUSH
+
+#include <mrpt/otherlibs/do_opencv_includes.h>
+
+IGNORE_WARNINGS_POP
+
+#include "MiscHelpers.h"
+#include "EllipseFunctions.h"
+#include "ColorModel.h"
+#include "ModelParameters.h"
+#include "TiledImage.h"
+
+// Compares the particle likelihood gathers (HSV histogram over the head ROI + contour test) on row-major and
+// tiled frames. Usage: tiled_layout_benchmark [particles] [iterations]
+
+class CacheMissCounter
+{
+public:
+    CacheMissCounter()
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~CacheMissCounter()
+    {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    inline bool available() const
+    {
+        return fd >= 0;
+    }
+
+    void start()
+    {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    long long stop()
+    {
+        long long count = -1;
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+                count = -1;
+            }
+        }
+        return count;
+    }
+
+protected:
+    int fd;
+};
+
+template<typename F>
+void run_benchmark(const std::string &name, const int iterations, F f)
+{
+    CacheMissCounter counter;
+    float checksum = 0;
+
+    counter.start();
+    const uint64_t t0 = cv::getTickCount();
+    for (int k = 0; k < iterations; k++) {
+        checksum += f();
+    }
+    const double t = (cv::getTickCount() - t0) / double(cv::getTickFrequency());
+    const long long misses = counter.stop();
+
+    std::cout << name << " TIME " << t / iterations * 1000 << " ms/iteration";
+    if (counter.available()) {
+        std::cout << " CACHE_MISSES " << misses / iterations << " /iteration";
+    }
+    std::cout << " (checksum " << checksum << ')' << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    const int n_particles = argc > 1 ? atoi(argv[1]) : 500;
+    const int iterations = argc > 2 ? atoi(argv[2]) : 50;
+
+    const int rows = 1080;
+    const int cols = 1920;
+    const cv::Size head_size(60, 100);
+
+    std::mt19937 rng(42);
+
+    cv::Mat hsv_frame(rows, cols, CV_8UC3);
+    cv::randu(hsv_frame, cv::Scalar(0, 0, 0), cv::Scalar(180, 256, 256));
+
+    cv::Mat gradient_vectors(rows, cols, CV_32FC2);
+    cv::Mat gradient_magnitude(rows, cols, CV_32FC1);
+    cv::randu(gradient_vectors, cv::Scalar(-1, -1), cv::Scalar(1, 1));
+    cv::randu(gradient_magnitude, cv::Scalar(0), cv::Scalar(1));
+
+    // particles clustered around a few targets, like a running tracker
+    std::normal_distribution<float> spread(0, 40);
+    std::uniform_int_distribution<int> target_x(head_size.width * 2, cols - head_size.width * 2);
+    std::uniform_int_distribution<int> target_y(head_size.height * 2, rows - head_size.height * 2);
+    const cv::Point targets[] = {
+        cv::Point(target_x(rng), target_y(rng)),
+        cv::Point(target_x(rng), target_y(rng)),
+        cv::Point(target_x(rng), target_y(rng))
+    };
+
+    std::vector<cv::Point> particles(n_particles);
+    for (int i = 0; i < n_particles; i++) {
+        const cv::Point &target = targets[i % 3];
+        const int x = cvRound(target.x + spread(rng));
+        const int y = cvRound(target.y + spread(rng));
+        particles[i] = cv::Point(std::max(head_size.width, std::min(cols - head_size.width - 1, x)),
+                                 std::max(head_size.height, std::min(rows - head_size.height - 1, y)));
+    }
+
+    const cv::Mat mask = create_ellipse_mask(cv::Rect(0, 0, head_size.width, head_size.height), 1);
+    const cv::Mat mask_weights = create_ellipse_weight_mask(mask);
+    const std::vector<Vector2f> normals = calculate_ellipse_normals(head_size.width * 0.5, head_size.height * 0.5,
+                                                                   ELLIPSE_FITTING_ANGLE_STEP);
+
+    const uint64_t tiling_t0 = cv::getTickCount();
+    const TiledImage<cv::Vec3b> hsv_tiled = TiledImage<cv::Vec3b>::from_mat(hsv_frame);
+    const TiledImage<cv::Vec2f> gradient_vectors_tiled = TiledImage<cv::Vec2f>::from_mat(gradient_vectors);
+    const TiledImage<float> gradient_magnitude_tiled = TiledImage<float>::from_mat(gradient_magnitude);
+    const double tiling_t = (cv::getTickCount() - tiling_t0) / double(cv::getTickFrequency());
+
+    std::cout << "PARTICLES " << n_particles << " ITERATIONS " << iterations << std::endl;
+    std::cout << "TILING TIME " << tiling_t * 1000 << " ms/frame" << std::endl;
+
+    auto roi_of = [&](const cv::Point &p) {
+        return cv::Rect(p.x - head_size.width / 2, p.y - head_size.height / 2, head_size.width, head_size.height);
+    };
+
+    run_benchmark("ROW_MAJOR HISTOGRAM", iterations, [&]() {
+        float sum = 0;
+        for (const cv::Point &p : particles) {
+            sum += compute_color_model2(hsv_frame(roi_of(p)), mask_weights).at<float>(0, 0);
+        }
+        return sum;
+    });
+
+    run_benchmark("TILED     HISTOGRAM", iterations, [&]() {
+        float sum = 0;
+        for (const cv::Point &p : particles) {
+            sum += compute_color_model2(hsv_tiled, roi_of(p), mask_weights).at<float>(0, 0);
+        }
+        return sum;
+    });
+
+    run_benchmark("ROW_MAJOR CONTOUR", iterations, [&]() {
+        float sum = 0;
+        for (const cv::Point &p : particles) {
+            sum += ellipse_contour_test(p, head_size.width * 0.5, head_size.height * 0.5, normals,
+                                        gradient_vectors, gradient_magnitude, nullptr);
+        }
+        return sum;
+    });
+
+    run_benchmark("TILED     CONTOUR", iterations, [&]() {
+        float sum = 0;
+        for (const cv::Point &p : particles) {
+            sum += ellipse_contour_test(p, head_size.width * 0.5, head_size.height * 0.5, normals,
+                                        gradient_vectors_tiled, gradient_magnitude_tiled);
+        }
+        return sum;
+    });
+
+    return EXIT_SUCCESS;
+}
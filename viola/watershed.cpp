@@ -2,6 +2,8 @@
 #include "opencv2/opencv.hpp"
 #include <string>
 
+#include "DepthPacking.h"
+
 using namespace cv;
 using namespace std;
 
@@ -31,21 +33,8 @@ int main(int argc, char* argv[])
     cv::Mat depth3 = cv::imread(argv[3]);
     cv::Mat depth4 = cv::imread(argv[4]);
 
-    cv::Mat image = cv::Mat(depth3.rows, depth3.cols, CV_32FC1);
-
-    size_t n_bytes = depth3.rows * depth3.cols;
-
-    uchar *image_ptr = image.data;
-    uchar *depth3_ptr = depth3.data;
-    uchar *depth4_ptr = depth4.data;
-
-    #pragma omp parallel for
-    for (size_t i = 0; i < n_bytes; i++){
-      *(image_ptr + 4 * i + 0) = *(depth3_ptr + 3 * i + 0);
-      *(image_ptr + 4 * i + 1) = *(depth3_ptr + 3 * i + 1);
-      *(image_ptr + 4 * i + 2) = *(depth3_ptr + 3 * i + 2);
-      *(image_ptr + 4 * i + 3) = *(depth4_ptr + 3 * i + 0);
-    }
+    cv::Mat image;
+    unpack_depth(depth3, depth4, image);
 
     cv::Mat image2 = image.clone();
     cv::cvtColor(image2, image,CV_GRAY2BGR, 3);